@@ -0,0 +1,74 @@
+/**
+ * Allocation benchmark: VM heap (size-class pages) vs malloc
+ * for the small fixed-size objects (cells, strings).
+ *
+ * Usage: alloc-bench [objects] [rounds]
+ * */
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "../src/vm/EvaVM.h"
+
+/**
+ * Allocates `objectsCount` objects of the given size and frees every
+ * other one, then the rest, `rounds` times. Returns ns per allocation.
+ * `endSweep` runs after the frees of a round (the heap reuses freed
+ * slots once the sweep is complete).
+ * */
+template<typename Allocate, typename Free, typename EndSweep>
+double run(size_t objectsCount, size_t rounds, size_t size, Allocate allocate, Free free, EndSweep endSweep) {
+    std::vector<void *> objects(objectsCount);
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t round = 0; round < rounds; round++) {
+        for (auto &object: objects) {
+            object = allocate(size);
+        }
+        // Interleaved frees fragment the free lists.
+        for (size_t i = 0; i < objects.size(); i += 2) {
+            free(objects[i], size);
+        }
+        for (size_t i = 1; i < objects.size(); i += 2) {
+            free(objects[i], size);
+        }
+        endSweep();
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+
+    return (double) elapsed / (objectsCount * rounds);
+}
+
+int main(int argc, const char *argv[]) {
+    size_t objectsCount = argc > 1 ? std::stoul(argv[1]) : 1000000;
+    size_t rounds = argc > 2 ? std::stoul(argv[2]) : 10;
+
+    std::pair<std::string, size_t> types[] = {
+            {"CellObject",     sizeof(CellObject)},
+            {"StringObject",   sizeof(StringObject)},
+            {"InstanceObject", sizeof(InstanceObject)},
+    };
+
+    Heap heap;
+
+    for (auto &type: types) {
+        auto heapTime = run(objectsCount, rounds, type.second,
+                            [&heap](size_t size) { return heap.allocate(size); },
+                            [](void *object, size_t size) { Heap::free(object, Heap::sizeClassOf(size)); },
+                            [&heap]() { heap.releaseEmptyPages(); });
+
+        auto mallocTime = run(objectsCount, rounds, type.second,
+                              [](size_t size) { return std::malloc(size); },
+                              [](void *object, size_t) { std::free(object); },
+                              []() {});
+
+        std::cout << type.first << " (" << type.second << " bytes)\theap: " << heapTime
+                  << " ns/alloc\tmalloc: " << mallocTime << " ns/alloc\n";
+    }
+
+    std::cout << "\n";
+    heap.printStats();
+
+    return 0;
+}
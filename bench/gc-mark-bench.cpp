@@ -0,0 +1,80 @@
+/**
+ * Marking benchmark: builds a heap of InstanceObjects and
+ * measures the mark phase with different numbers of GC threads
+ * (and the sweep of the all-live heap).
+ *
+ * Usage: gc-mark-bench [objects] [max threads]
+ * */
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "../src/vm/EvaVM.h"
+
+/**
+ * Builds a tree of instances with `fanout` children each,
+ * wide enough to give every marking thread its own subtrees.
+ * */
+InstanceObject *buildHeap(ClassObject *cls, size_t objectsCount, size_t fanout) {
+    std::vector<InstanceObject *> level{new InstanceObject(cls)};
+    auto root = level[0];
+    size_t allocated = 1;
+
+    while (allocated < objectsCount) {
+        std::vector<InstanceObject *> next;
+        for (auto &parent: level) {
+            for (size_t i = 0; i < fanout && allocated < objectsCount; i++) {
+                auto child = new InstanceObject(cls);
+                child->properties["value"] = NUMBER((double) allocated);
+                parent->properties["c" + std::to_string(i)] = OBJECT(child);
+                next.push_back(child);
+                allocated++;
+            }
+        }
+        level.swap(next);
+    }
+
+    return root;
+}
+
+int main(int argc, const char *argv[]) {
+    size_t objectsCount = argc > 1 ? std::stoul(argv[1]) : 2000000;
+    size_t maxThreads = argc > 2 ? std::stoul(argv[2]) : std::max(1u, std::thread::hardware_concurrency());
+
+    Heap heap;
+    Heap::Scope scope(heap);
+
+    auto cls = new ClassObject("Node", nullptr);
+    auto root = buildHeap(cls, objectsCount, 4);
+
+    RootsProvider roots = [root, cls](const RootVisitor &visit) {
+        visit((Traceable *) root);
+        visit((Traceable *) cls);
+    };
+
+    std::cout << "Objects: " << heap.objectsCount() << "\n\n";
+
+    for (size_t threads = 1; threads <= maxThreads; threads *= 2) {
+        EvaCollector collector(heap);
+        collector.setMarkThreads(threads);
+
+        auto start = std::chrono::steady_clock::now();
+        collector.mark(roots);
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+
+        // Everything is alive: the sweep just resets the mark bits.
+        start = std::chrono::steady_clock::now();
+        collector.sweep();
+        auto swept = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+
+        std::cout << "threads: " << threads << "\tmark: " << elapsed / 1000.0
+                  << "ms\tsweep: " << swept / 1000.0 << "ms\n";
+    }
+
+    Traceable::cleanup(heap);
+
+    return 0;
+}
@@ -0,0 +1,110 @@
+/**
+ * Isolates benchmark: every thread runs its own EvaVM (with its own
+ * heap and collector) on the same program, and the throughput of
+ * 1, 2, 4 ... threads is compared with the single-threaded one. Also
+ * measured with the program compiled once and shared by all the VMs.
+ *
+ * Usage: isolates-bench [runs per thread] [max threads]
+ * */
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../src/vm/EvaVM.h"
+
+/**
+ * Allocation heavy workload: a growing list of instances, strings,
+ * closure and recursive calls, with a small heap trigger, so each
+ * VM also runs its GC often.
+ * */
+const std::string program = R"(
+  (class Point null
+    (def constructor (self x y)
+      (begin
+        (set (prop self x) x)
+        (set (prop self y) y))))
+
+  (def counter ()
+    (begin
+      (var c 0)
+      (lambda (d) (begin (set c (+ c d)) c))))
+
+  (def fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))
+
+  (var k (counter))
+  (var path (new Point 0 (new Point 0 0)))
+  (var i 0)
+  (while (< i 2000)
+    (begin
+      (set (prop path y) (new Point (+ "x" "y") (prop path y)))
+      (k 2)
+      (set i (+ i 1))))
+
+  (+ (fib 18) (k 0))
+)";
+
+/**
+ * Runs the program `runs` times, each time on a fresh VM: compiling
+ * the source, or running the shared compiled program if there is one.
+ * */
+void runIsolate(size_t runs, std::shared_ptr<const EvaProgram> compiled, double &result) {
+    for (size_t i = 0; i < runs; i++) {
+        EvaVM vm;
+        vm.disassemble = false;
+        vm.collector->pacer.minHeap = 256 * 1024;
+        result = AS_NUMBER(compiled != nullptr ? vm.run(compiled) : vm.exec(program));
+    }
+}
+
+/**
+ * Runs per second of the given number of isolates.
+ * */
+double measure(size_t threads, size_t runs, const std::shared_ptr<const EvaProgram> &compiled) {
+    std::vector<double> results(threads);
+    std::vector<std::thread> isolates;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < threads; i++) {
+        isolates.emplace_back(runIsolate, runs, compiled, std::ref(results[i]));
+    }
+    for (auto &isolate: isolates) {
+        isolate.join();
+    }
+    auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    for (auto &result: results) {
+        if (result != results[0]) {
+            DIE << "isolates-bench: isolates disagree on the result";
+        }
+    }
+    return threads * runs / seconds;
+}
+
+int main(int argc, const char *argv[]) {
+    size_t runs = argc > 1 ? std::stoul(argv[1]) : 20;
+    size_t maxThreads = argc > 2 ? std::stoul(argv[2]) : std::max(1u, std::thread::hardware_concurrency());
+
+    // Compiled once, shared by all the VMs.
+    std::shared_ptr<const EvaProgram> compiled;
+    {
+        EvaVM vm;
+        vm.disassemble = false;
+        compiled = vm.compile(program);
+    }
+
+    double baseline = 0;
+
+    for (size_t threads = 1; threads <= maxThreads; threads *= 2) {
+        auto throughput = measure(threads, runs, nullptr);
+        auto shared = measure(threads, runs, compiled);
+        if (threads == 1) {
+            baseline = throughput;
+        }
+        std::cout << "threads: " << threads << "\truns/s: " << (uint64_t) throughput
+                  << "\tscaling: " << throughput / baseline << "x\tshared code runs/s: " << (uint64_t) shared << "\n";
+    }
+
+    return 0;
+}
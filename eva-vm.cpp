@@ -1,60 +1,380 @@
+#include <cstdlib>
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <thread>
 
 #include "./src/vm/Logger.h"
+#include "./src/vm/EvaExecutor.h"
+#include "./src/vm/EvaServer.h"
 #include "./src/vm/EvaVM.h"
 
 void printHelp() {
     std::cout << "\nUsage: eva-vm [options]\n\n"
               << "Options:\n"
               << "    -e, --expression  Expression to parse\n"
-              << "    -f, --file        File to parse\n\n";
+              << "    -f, --file        File to parse\n"
+              << "    --gc-incremental  Collect garbage in bounded steps\n"
+              << "    --gc-step <n>     Max objects traced/swept per incremental step\n"
+              << "    --gc-threads <n>  Number of marking threads\n"
+              << "    --gc-concurrent-sweep  Sweep on a background thread\n"
+              << "    --gc-compact <n>  Compact the heap every n-th GC cycle\n"
+              << "    --gc-growth <f>   Heap growth factor between GC cycles\n"
+              << "    --gc-min-heap <bytes>  Heap size below which GC doesn't run\n"
+              << "    --gc-max-heap <bytes>  Heap size limit\n"
+              << "    --gc-cpu-target <f>    Target fraction of time spent in GC\n"
+              << "    --gc-max-pause <us>    Max GC pause (collects incrementally)\n"
+              << "    --gc-stats        Print GC pauses and sweep throughput at exit\n"
+              << "    --gc-telemetry <file>  Write GC telemetry (JSON) at exit\n"
+              << "    --heap-profile <file>  Write sampled live/allocated bytes per call stack at exit\n"
+              << "    --heap-profile-rate <bytes>  Mean bytes allocated between heap profile samples\n"
+              << "    --heap-snapshot <file>  Write the reachable object graph at exit\n"
+              << "    --cpu-profile <file>  Write sampled call stacks (flame graph input) at exit\n"
+              << "    --cpu-profile-hz <n>  CPU profiler samples per second\n"
+              << "    --batch <files>   Run the files on a pool of VMs, print results in order\n"
+              << "    --threads <n>     Number of worker threads (batch, server, actors, parallel)\n"
+              << "    --inputs <file>   Batch: run the (one) file once per line of `name=value` inputs\n"
+              << "    --serve <socket>  Serve scripts on a Unix socket (workers: --threads)\n"
+              << "    --client <socket>  Run the -e/-f script on the server at the socket\n"
+              << "    --stop            Client: stop the server\n\n";
+}
+
+/**
+ * Reads the whole file.
+ * */
+std::string readFile(const std::string &fileName) {
+    std::ifstream file(fileName);
+    if (!file) {
+        DIE << "Can't read " << fileName;
+    }
+    std::stringstream buffer;
+    buffer << file.rdbuf() << "\n";
+    return buffer.str();
+}
+
+/**
+ * Parses the batch inputs: one run per line, `name=value` pairs.
+ * */
+std::vector<EvaBindings> readInputs(const std::string &fileName) {
+    std::vector<EvaBindings> runs;
+    std::istringstream lines(readFile(fileName));
+    std::string line;
+    while (std::getline(lines, line)) {
+        std::istringstream pairs(line);
+        std::string pair;
+        EvaBindings bindings;
+        while (pairs >> pair) {
+            auto separator = pair.find('=');
+            if (separator == std::string::npos) {
+                DIE << "Invalid input " << pair << " (name=value expected)";
+            }
+            auto value = pair.substr(separator + 1);
+            char *end = nullptr;
+            auto number = std::strtod(value.c_str(), &end);
+            if (value.empty() || *end != '\0') {
+                DIE << "Invalid input " << pair << " (number value expected)";
+            }
+            bindings[pair.substr(0, separator)] = number;
+        }
+        if (!bindings.empty()) {
+            runs.push_back(bindings);
+        }
+    }
+    return runs;
 }
 
 /**
  * Eva VM main executable
  * */
 int main(int argc, const char *argv[]) {
-    if (argc != 3) {
+    /**
+     * Expression mode.
+     */
+    std::string mode;
+
+    /**
+     * Program to execute.
+     */
+    std::string program;
+
+    /**
+     * GC options.
+     */
+    bool gcIncremental = false;
+    bool gcStats = false;
+    std::string gcTelemetryFile;
+    size_t gcStep = 0;
+    size_t gcThreads = 1;
+    bool gcConcurrentSweep = false;
+    size_t gcCompactEvery = 0;
+    GCPacer gcPacer;
+    uint64_t gcMaxPause = 0;
+
+    /**
+     * Heap profiler options.
+     */
+    std::string heapProfileFile;
+    size_t heapProfileRate = HEAP_PROFILE_RATE;
+    std::string heapSnapshotFile;
+
+    /**
+     * CPU profiler options.
+     */
+    std::string cpuProfileFile;
+    size_t cpuProfileHz = CPU_PROFILE_HZ;
+
+    /**
+     * Batch mode options.
+     */
+    bool batch = false;
+    std::vector<std::string> batchFiles;
+    size_t batchThreads = std::max(1u, std::thread::hardware_concurrency());
+    std::string inputsFile;
+
+    /**
+     * Server mode options.
+     */
+    std::string serveSocket;
+    std::string clientSocket;
+    bool stopServer = false;
+
+    for (auto i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if ((arg == "-e" || arg == "--expression" || arg == "-f" || arg == "--file") && i + 1 < argc) {
+            mode = arg;
+            program = argv[++i];
+        } else if (arg == "--gc-incremental") {
+            gcIncremental = true;
+        } else if (arg == "--gc-step" && i + 1 < argc) {
+            gcStep = std::stoul(argv[++i]);
+        } else if (arg == "--gc-threads" && i + 1 < argc) {
+            gcThreads = std::stoul(argv[++i]);
+        } else if (arg == "--gc-concurrent-sweep") {
+            gcConcurrentSweep = true;
+        } else if (arg == "--gc-compact" && i + 1 < argc) {
+            gcCompactEvery = std::stoul(argv[++i]);
+        } else if (arg == "--gc-growth" && i + 1 < argc) {
+            gcPacer.growthFactor = std::stod(argv[++i]);
+        } else if (arg == "--gc-min-heap" && i + 1 < argc) {
+            gcPacer.minHeap = std::stoul(argv[++i]);
+        } else if (arg == "--gc-max-heap" && i + 1 < argc) {
+            gcPacer.maxHeap = std::stoul(argv[++i]);
+        } else if (arg == "--gc-cpu-target" && i + 1 < argc) {
+            gcPacer.cpuTarget = std::stod(argv[++i]);
+        } else if (arg == "--gc-max-pause" && i + 1 < argc) {
+            gcMaxPause = std::stoul(argv[++i]);
+        } else if (arg == "--gc-stats") {
+            gcStats = true;
+        } else if (arg == "--gc-telemetry" && i + 1 < argc) {
+            gcTelemetryFile = argv[++i];
+        } else if (arg == "--heap-profile" && i + 1 < argc) {
+            heapProfileFile = argv[++i];
+        } else if (arg == "--heap-profile-rate" && i + 1 < argc) {
+            heapProfileRate = std::stoul(argv[++i]);
+        } else if (arg == "--heap-snapshot" && i + 1 < argc) {
+            heapSnapshotFile = argv[++i];
+        } else if (arg == "--cpu-profile" && i + 1 < argc) {
+            cpuProfileFile = argv[++i];
+        } else if (arg == "--cpu-profile-hz" && i + 1 < argc) {
+            cpuProfileHz = std::stoul(argv[++i]);
+            if (cpuProfileHz == 0) {
+                DIE << "--cpu-profile-hz: at least 1 sample per second expected";
+            }
+        } else if (arg == "--batch") {
+            batch = true;
+        } else if (arg == "--threads" && i + 1 < argc) {
+            batchThreads = std::stoul(argv[++i]);
+        } else if (arg == "--inputs" && i + 1 < argc) {
+            inputsFile = argv[++i];
+        } else if (arg == "--serve" && i + 1 < argc) {
+            serveSocket = argv[++i];
+        } else if (arg == "--client" && i + 1 < argc) {
+            clientSocket = argv[++i];
+        } else if (arg == "--stop") {
+            stopServer = true;
+        } else if (batch && arg[0] != '-') {
+            batchFiles.push_back(arg);
+        } else {
+            printHelp();
+            return 0;
+        }
+    }
+
+    if (serveSocket.empty() && !(stopServer && !clientSocket.empty()) && (batch ? batchFiles.empty() : mode.empty())) {
         printHelp();
         return 0;
     }
 
+    auto configure = [&](EvaVM &vm) {
+        vm.collector->incremental = gcIncremental;
+        if (gcStep != 0) {
+            vm.collector->stepBudget = gcStep;
+        }
+        vm.collector->setMarkThreads(gcThreads);
+        vm.collector->setConcurrentSweep(gcConcurrentSweep);
+        vm.collector->compactEvery = gcCompactEvery;
+        vm.collector->pacer.growthFactor = gcPacer.growthFactor;
+        vm.collector->pacer.minHeap = gcPacer.minHeap;
+        vm.collector->pacer.maxHeap = gcPacer.maxHeap;
+        vm.collector->pacer.cpuTarget = gcPacer.cpuTarget;
+        if (gcMaxPause != 0) {
+            vm.collector->setMaxPause(gcMaxPause);
+        }
+    };
+
     /**
-   * Expression mode.
-   */
-    std::string mode = argv[1];
+     * Server: runs until a client sends `stop`.
+     */
+    if (!serveSocket.empty()) {
+        EvaServer server(serveSocket, batchThreads, configure);
+        std::cout << "Serving on " << serveSocket << " (" << server.vms.size() << " workers)\n";
+        server.serve();
+        server.printStats();
+        return 0;
+    }
 
     /**
-     * Program to execute.
+     * Client: the script runs on the server.
      */
-    std::string program;
+    if (!clientSocket.empty()) {
+        if (stopServer) {
+            std::cout << EvaServer::request(clientSocket, "stop");
+            return 0;
+        }
+        if (mode == "-f" || mode == "--file") {
+            program = readFile(program);
+        }
+        auto response = EvaServer::request(clientSocket, "run", program);
+        std::cout << response;
+        return response.empty() || response.compare(0, 6, "error=") == 0 ? 1 : 0;
+    }
 
     /**
-     * Simple expression.
+     * Batch: every file (or every line of inputs for one file) is a job.
      */
-    if (mode == "-e") {
-        program = argv[2];
-    } else if (mode == "-f") {
-        // Read the file:
-        std::ifstream programFile(argv[2]);
-        std::stringstream buffer;
-        buffer << programFile.rdbuf() << "\n";
+    if (batch) {
+        EvaExecutor executor(batchThreads, configure);
+
+        std::vector<EvaJob> jobs;
+        std::vector<std::string> labels;
+        // A file which doesn't compile has its error here, and no job.
+        std::vector<std::string> compileErrors;
+        if (!inputsFile.empty()) {
+            auto runs = readInputs(inputsFile);
+            std::vector<std::string> inputs;
+            for (auto &bindings: runs) {
+                for (auto &binding: bindings) {
+                    if (std::find(inputs.begin(), inputs.end(), binding.first) == inputs.end()) {
+                        inputs.push_back(binding.first);
+                    }
+                }
+            }
+            std::shared_ptr<const EvaProgram> compiled;
+            auto error = recover([&]() { compiled = executor.compile(readFile(batchFiles[0]), inputs); });
+            for (size_t i = 0; i < runs.size(); i++) {
+                if (error.empty()) {
+                    jobs.push_back({compiled, runs[i]});
+                }
+                labels.push_back(batchFiles[0] + ":" + std::to_string(i + 1));
+                compileErrors.push_back(error);
+            }
+        } else {
+            for (auto &file: batchFiles) {
+                std::shared_ptr<const EvaProgram> compiled;
+                auto error = recover([&]() { compiled = executor.compile(readFile(file)); });
+                if (error.empty()) {
+                    jobs.push_back({compiled, {}});
+                }
+                labels.push_back(file);
+                compileErrors.push_back(error);
+            }
+        }
+
+        auto results = executor.run(jobs);
+        size_t failed = 0;
+        for (size_t i = 0, job = 0; i < labels.size(); i++) {
+            auto error = compileErrors[i];
+            std::string value;
+            if (error.empty()) {
+                error = results[job].error;
+                value = results[job].value;
+                job++;
+            }
+            if (error.empty()) {
+                std::cout << labels[i] << "\t" << value << "\n";
+            } else {
+                std::cout << labels[i] << "\terror: " << error << "\n";
+                failed++;
+            }
+        }
+        std::cout << "\n";
+        executor.stats.print();
+
+        return failed == 0 ? 0 : 1;
+    }
 
-        // Program:
-        program = buffer.str();
+    /**
+     * Simple expression.
+     */
+    if (mode == "-f" || mode == "--file") {
+        program = readFile(program);
     }
 
     EvaVM vm;
+    configure(vm);
+    vm.actorThreads = batchThreads;
+    if (!heapProfileFile.empty()) {
+        HeapProfiler::start(heapProfileRate, [&vm]() { return vm.stackTrace(); });
+    }
+
+    if (!cpuProfileFile.empty()) {
+        CPUProfiler::start(cpuProfileHz);
+    }
+
 //  Traceable::printStats();
     auto result = vm.exec(program);
 
+    if (!cpuProfileFile.empty()) {
+        CPUProfiler::stop();
+        std::ofstream cpuProfile(cpuProfileFile);
+        CPUProfiler::writeCollapsed(cpuProfile);
+    }
+
     std::cout << "\n";
     log(result);
     std::cout << "\n";
 
+    if (gcStats) {
+        vm.collector->printPauseStats();
+        vm.collector->printSweepStats();
+        vm.collector->printPacingStats();
+    }
+
+    if (!gcTelemetryFile.empty()) {
+        std::ofstream telemetryFile(gcTelemetryFile);
+        vm.collector->writeTelemetry(telemetryFile);
+    }
+
+    if (!heapProfileFile.empty()) {
+        // Live bytes, and all the bytes allocated (as in pprof inuse_space / alloc_space).
+        vm.collector->finishSweep();
+        std::ofstream liveProfile(heapProfileFile);
+        HeapProfiler::writeCollapsed(liveProfile, true);
+        std::ofstream allocProfile(heapProfileFile + ".alloc");
+        HeapProfiler::writeCollapsed(allocProfile, false);
+    }
+
+    if (!heapSnapshotFile.empty()) {
+        std::ofstream snapshotFile(heapSnapshotFile);
+        vm.writeHeapSnapshot(snapshotFile);
+    }
+
+#ifdef EVA_OPCODE_STATS
+    OpcodeStats::print();
+#endif
+
 //  Traceable::printStats();
 //  vm.dumpStack();
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,115 @@
+#ifndef EVA_VM_LINETABLE_H
+#define EVA_VM_LINETABLE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Bytecode offset -> source line mapping of a code object.
+ *
+ * Delta encoded and run-length compressed: a sequence of (bytes, line
+ * delta) pairs, each one meaning "line += delta, and the next `bytes`
+ * bytes of code are at that line". Deltas out of the int8 range, and
+ * runs longer than 255 bytes, take several entries. The last run is
+ * kept open (not encoded) while the code is being emitted.
+ *
+ * Only written by the compiler and read on errors, by the disassembler
+ * and the profilers: never on the execution path.
+ * */
+struct LineTable {
+    /**
+     * Code emitted from this offset on is at the given line (0 - unknown,
+     * stays at the current line).
+     * */
+    void add(size_t offset, int line) {
+        if (line == 0 || line == openLine) {
+            return;
+        }
+        if (offset > openOffset) {
+            encode(offset - openOffset, openLine - encodedLine);
+            encodedLine = openLine;
+        }
+        openOffset = offset;
+        openLine = line;
+    }
+
+    /**
+     * Source line of the code at the offset (0 if unknown).
+     * */
+    int lineAt(size_t offset) const {
+        int line = 0;
+        size_t start = 0;
+        for (size_t i = 0; i < entries.size(); i += 2) {
+            line += (int8_t) entries[i + 1];
+            start += entries[i];
+            if (offset < start) {
+                return line;
+            }
+        }
+        return openLine;
+    }
+
+    /**
+     * Accounts `count` bytes inserted at the offset (they
+     * take the line of the code which was at the offset).
+     * */
+    void insert(size_t offset, size_t count) {
+        if (offset >= openOffset) {
+            return;
+        }
+        openOffset += count;
+
+        size_t start = 0;
+        for (size_t i = 0; i < entries.size(); i += 2) {
+            start += entries[i];
+            if (offset < start) {
+                // Grow the run, the overflow goes to new 0-delta entries.
+                auto bytes = entries[i] + count;
+                entries[i] = std::min<size_t>(bytes, 255);
+                std::vector<uint8_t> overflow;
+                for (bytes -= entries[i]; bytes > 0; bytes -= std::min<size_t>(bytes, 255)) {
+                    overflow.push_back(std::min<size_t>(bytes, 255));
+                    overflow.push_back(0);
+                }
+                entries.insert(entries.begin() + i + 2, overflow.begin(), overflow.end());
+                return;
+            }
+        }
+    }
+
+    /**
+     * Encoded runs.
+     * */
+    std::vector<uint8_t> entries;
+
+private:
+    void encode(size_t bytes, int delta) {
+        for (; delta > INT8_MAX; delta -= INT8_MAX) {
+            push(0, INT8_MAX);
+        }
+        for (; delta < INT8_MIN; delta -= INT8_MIN) {
+            push(0, INT8_MIN);
+        }
+        for (; bytes > 255; bytes -= 255) {
+            push(255, delta);
+            delta = 0;
+        }
+        push(bytes, delta);
+    }
+
+    void push(size_t bytes, int delta) {
+        entries.push_back((uint8_t) bytes);
+        entries.push_back((uint8_t) (int8_t) delta);
+    }
+
+    /* Line of the last encoded run. */
+    int encodedLine = 0;
+
+    /* Start and line of the open run. */
+    size_t openOffset = 0;
+
+    int openLine = 0;
+};
+
+#endif
@@ -112,6 +112,31 @@
  * */
 #define OP_SET_PROP 0x17
 
+/**
+ * Suspends the running coroutine.
+ * */
+#define OP_YIELD 0x18
+
+/**
+ * Resumes a coroutine.
+ * */
+#define OP_RESUME 0x19
+
+/**
+ * Array element access.
+ * */
+#define OP_GET_INDEX 0x1A
+
+/**
+ * Array element access.
+ * */
+#define OP_SET_INDEX 0x1B
+
+/**
+ * Number of opcodes (last opcode + 1).
+ * */
+#define OPCODES_COUNT 0x1C
+
 
 // -------------------------------------------------------
 
@@ -145,6 +170,10 @@ std::string opcodeToString(uint8_t opcode) {
     OP_STR(NEW);
     OP_STR(GET_PROP);
     OP_STR(SET_PROP);
+    OP_STR(YIELD);
+    OP_STR(RESUME);
+    OP_STR(GET_INDEX);
+    OP_STR(SET_INDEX);
   default:
     DIE << "opcodeToString: unknown opcode: " << std::hex << (int)opcode;
   };
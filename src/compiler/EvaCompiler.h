@@ -57,7 +57,7 @@ public:
         co = AS_CODE(createCodeObjectValue("main"));
         main = AS_FUNCTION(ALLOC_FUNCTION(co));
 
-        constantObject_.insert((Traceable *) main);
+        constantObject_.push_back((Traceable *) main);
 
         // Scope analysis
         analyze(exp, nullptr);
@@ -72,6 +72,8 @@ public:
      * Scope analysis
      * */
     void analyze(const Exp &exp, std::shared_ptr<Scope> scope) {
+        LineScope lineScope(line_, exp.line);
+
         if (exp.type == ExpType::SYMBOL) {
             /**
              * Boolean
@@ -98,6 +100,14 @@ public:
 
                     scopeInfo_[&exp] = newScope;
 
+                    // Globals defined before the compilation (natives,
+                    // constants, program inputs) are known in the program.
+                    if (scope == nullptr) {
+                        for (auto &global: globals->globals) {
+                            newScope->addLocal(global.name);
+                        }
+                    }
+
                     for (auto i = 1; i < exp.list.size(); ++i) {
                         analyze(exp.list[i], newScope);
                     }
@@ -171,6 +181,8 @@ public:
      * Main compile loop.
      * */
     void gen(const Exp &exp) {
+        LineScope lineScope(line_, exp.line);
+
         switch (exp.type) {
             case ExpType::NUMBER: {
                 emit(OP_CONST);
@@ -282,8 +294,9 @@ public:
                         emit(0);
 
                         auto loopEndJmpAddress = getOffset() - 2;
-                        // Emit body
+                        // Emit body (its value is discarded on every iteration)
                         gen(exp.list[2]);
+                        emit(OP_POP);
 
                         emit(OP_JMP);
 
@@ -292,9 +305,10 @@ public:
 
                         patchJumpAddress(getOffset() - 2, loopStartAddress);
 
-                        // Patch the end
-                        auto loopEndAddr = getOffset() + 1;
-                        patchJumpAddress(loopEndJmpAddress, loopEndAddr);
+                        // Patch the end: the loop evaluates to false
+                        patchJumpAddress(loopEndJmpAddress, getOffset());
+                        emit(OP_CONST);
+                        emit(booleanConstIdx(false));
                     }
                         /* For loop */
                     else if (op == "for") {
@@ -333,6 +347,7 @@ public:
                             // Initializer:
                             emit(OP_SET_GLOBAL);
                             emit(globals->getGlobalIndex(varName));
+                            emit(OP_POP);
                         } else if (opCodeSetter == OP_SET_CELL) {
                             // 2. Cells
                             co->cellNames.push_back(varName);
@@ -355,6 +370,16 @@ public:
                             emit(OP_SET_PROP);
                             emit(stringConstIdx(exp.list[1].list[2].string));
 
+                        } else if (isIndex(exp.list[1])) {
+                            // Value:
+                            gen(exp.list[2]);
+
+                            // Array and index:
+                            gen(exp.list[1].list[1]);
+                            gen(exp.list[1].list[2]);
+
+                            emit(OP_SET_INDEX);
+
                         } else {
                             auto varName = exp.list[1].string;
                             auto opCodeSetter = scopeStack_.top()->getNameSetter(varName);
@@ -423,6 +448,7 @@ public:
                                 globals->define(fnName);
                                 emit(OP_SET_GLOBAL);
                                 emit(globals->getGlobalIndex(fnName));
+                                emit(OP_POP);
                             } else {
                                 co->addLocal(fnName);
                                 // Note: no need to explicitly "set" the var value, since the
@@ -439,6 +465,24 @@ public:
                                 "lambda",
                                 exp.list[1],
                                 exp.list[2]);
+                    }
+                        /**
+                         * Coroutines (created by the `coroutine` native):
+                         *
+                         * (yield <value>)
+                         * (resume <coroutine> <value>)
+                         *
+                         * The value is optional (false), yield evaluates to the
+                         * value of the next resume, and resume to the next yielded
+                         * (or the returned) value.
+                         * */
+                    else if (op == "yield") {
+                        genOptional(exp, 1);
+                        emit(OP_YIELD);
+                    } else if (op == "resume") {
+                        gen(exp.list[1]);
+                        genOptional(exp, 2);
+                        emit(OP_RESUME);
                     }
                         /**
                          * Class declaration:
@@ -457,7 +501,7 @@ public:
                         classObjects_.push_back(classObject);
 
                         // Track for GC
-                        constantObject_.insert((Traceable *) classObject);
+                        constantObject_.push_back((Traceable *) classObject);
 
                         // Put the class in constant pool
                         co->addConstant(cls);
@@ -530,6 +574,12 @@ public:
                         // Property name:
                         emit(OP_GET_PROP);
                         emit(stringConstIdx(exp.list[2].string));
+                    }
+                        /* Array element access: (index <array> <index>) */
+                    else if (op == "index") {
+                        gen(exp.list[1]);
+                        gen(exp.list[2]);
+                        emit(OP_GET_INDEX);
                     }
                         /* Super operator */
                     else if (op == "super") {
@@ -609,12 +659,20 @@ public:
         //
         // Note: reset the current class, so nested blocks
         // and nested closures inside methods are handled.
+        //
+        // A body which is not a block gets a scope level of its own, so
+        // blocks nested in it are not taken for the function body.
         auto prevClassObject_ = classObject_;
         classObject_ = nullptr;
+        auto bodyIsBlock = isBlock(body);
+        if (!bodyIsBlock) {
+            co->scopeLevel++;
+        }
         gen(body);
         classObject_ = prevClassObject_;
 
-        if (!isBlock(body)) {
+        if (!bodyIsBlock) {
+            co->scopeLevel--;
             emit(OP_SCOPE_EXIT);
             emit(arity + 1);
         }
@@ -625,31 +683,15 @@ public:
         // == Class methods ==
         if (classObject_ != nullptr) {
             auto fn = ALLOC_FUNCTION(co);
-            constantObject_.insert((Traceable *) AS_OBJECT(fn));
+            constantObject_.push_back((Traceable *) AS_OBJECT(fn));
 
             co = prevCo;
 
             classObject_->properties[fnName] = fn;
         }
-            // 1. Simple functions (allocated at compile time).
-            // If it's not a closure (doesn't have free variables) allocate it at compile time and store as a constant
-            // Closure are allocated at runtime, but reuse the same code object
-        else if (scopeInfo->free.size() == 0) {
-            // Create the function
-            auto fn = ALLOC_FUNCTION(co);
-            constantObject_.insert((Traceable *) AS_OBJECT(fn));
-
-            // Restore the code object
-            co = prevCo;
-
-            // Add function as a constant to our co
-            co->addConstant(fn);
-
-            // And emit code for this new constant
-            emit(OP_CONST);
-            emit(co->constants.size() - 1);
-        }
-            // 2. Closures
+            // Functions (closures or not) are allocated at runtime, reusing the
+            // same code object: a function keeps its cells, so it's per-VM state,
+            // while the compiled code is shared (see EvaProgram).
             // - Load all free vars to capture (indices are taken from the 'cells' of the parent co)
             // - Load code object for the current function
             // - Make function
@@ -680,6 +722,13 @@ public:
         }
     }
 
+    /**
+     * All compiled code objects.
+     * */
+    const std::vector<CodeObject *> &getCodeObjects() {
+        return codeObjects_;
+    }
+
     /**
      * Return main function (entry point).
      * */
@@ -688,16 +737,37 @@ public:
     }
 
     /**
-     * Returns all constant traceable objects.
+     * Source line being compiled (0 if unknown).
      * */
-    std::set<Traceable *> &getConstantObjects() {
-        return constantObject_;
+    int currentLine() {
+        return line_;
+    }
+
+    /**
+     * Visits (in place) all objects the compiler holds:
+     * code objects, classes, constant pool objects.
+     * */
+    template<typename Visitor>
+    void traceRoots(Visitor &visit) {
+        visit(co);
+        visit(main);
+        visit(classObject_);
+
+        for (auto &co_: codeObjects_) {
+            visit(co_);
+        }
+        for (auto &classObject: classObjects_) {
+            visit(classObject);
+        }
+        for (auto &object: constantObject_) {
+            visit(object);
+        }
     }
 
     /**
      * Currently compiling class object.
      * */
-    ClassObject *classObject_;
+    ClassObject *classObject_ = nullptr;
 
 private:
 
@@ -719,7 +789,7 @@ private:
         auto co = AS_CODE(coValue);
 
         codeObjects_.push_back(co);
-        constantObject_.insert((Traceable *) co);
+        constantObject_.push_back((Traceable *) co);
 
         return coValue;
     }
@@ -779,6 +849,13 @@ private:
         return isTaggedList(exp, "prop");
     }
 
+    /**
+     * Whether the expression is an array element access.
+     * */
+    bool isIndex(const Exp &exp) {
+        return isTaggedList(exp, "index");
+    }
+
     /**
      * (var <name> <value>)
      * */
@@ -824,11 +901,9 @@ private:
     size_t getVarsCountOnScopeExit() {
         auto varsCount = 0;
 
-        if (co->locals.size() > 0) {
-            while (co->locals.back().scopeLevel == co->scopeLevel) {
-                co->locals.pop_back();
-                varsCount++;
-            }
+        while (!co->locals.empty() && co->locals.back().scopeLevel == co->scopeLevel) {
+            co->locals.pop_back();
+            varsCount++;
         }
 
         return varsCount;
@@ -852,7 +927,7 @@ private:
      * */
     size_t stringConstIdx(const std::string &value) {
         ALLOC_CONST(IS_STRING, AS_CPPSTRING, ALLOC_STRING, value);
-        constantObject_.insert((Traceable *) co->constants.back().object);
+        constantObject_.push_back((Traceable *) co->constants.back().object);
         return co->constants.size() - 1;
     }
 
@@ -864,10 +939,23 @@ private:
         return co->constants.size() - 1;
     }
 
+    /**
+     * Generates the element of the list if it's there, false otherwise.
+     * */
+    void genOptional(const Exp &exp, size_t index) {
+        if (index < exp.list.size()) {
+            gen(exp.list[index]);
+        } else {
+            emit(OP_CONST);
+            emit(booleanConstIdx(false));
+        }
+    }
+
     /**
      * Emits data to the bytecode.
      * */
     void emit(uint8_t code) {
+        co->lines.add(co->code.size(), line_);
         co->code.push_back(code);
     }
 
@@ -908,12 +996,35 @@ private:
     /**
      * Compiling code object.
      * */
-    CodeObject *co;
+    CodeObject *co = nullptr;
+
+    /**
+     * Source line of the expression being compiled.
+     * */
+    int line_ = 0;
+
+    /**
+     * Sets the current line for an expression, restoring the parent
+     * expression line at the end (for the code emitted after its operands).
+     * */
+    struct LineScope {
+        LineScope(int &line, int expLine) : line(line), parentLine(line) {
+            if (expLine != 0) {
+                line = expLine;
+            }
+        }
+
+        ~LineScope() { line = parentLine; }
+
+        int &line;
+
+        int parentLine;
+    };
 
     /**
      * Main entry point (function).
      * */
-    FunctionObject *main;
+    FunctionObject *main = nullptr;
 
     /**
      * All code objects.
@@ -923,7 +1034,7 @@ private:
     /**
      * All objects from the constant pools of all code objects.
      * */
-    std::set<Traceable *> constantObject_;
+    std::vector<Traceable *> constantObject_;
 
     /**
      * All class objects.
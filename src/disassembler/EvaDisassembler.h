@@ -19,7 +19,9 @@ public:
     void disassemble(CodeObject *co) {
         std::cout << "\n--------------- Disassembly: " << co->name << "---------------\n\n";
         size_t offset = 0;
+        int line = 0;
         while (offset < co->code.size()) {
+            printLine(co, offset, line);
             offset = disassembleInstruction(co, offset);
             std::cout << "\n";
         }
@@ -43,7 +45,11 @@ private:
             case OP_DIV:
             case OP_POP:
             case OP_RETURN:
-            case OP_NEW: {
+            case OP_NEW:
+            case OP_YIELD:
+            case OP_RESUME:
+            case OP_GET_INDEX:
+            case OP_SET_INDEX: {
                 return disassembleSimple(co, opcode, offset);
             }
             case OP_SCOPE_EXIT:
@@ -221,6 +227,18 @@ private:
         std::cout.flags(f);
     }
 
+    /**
+     * Prints the source line when it changes (blank otherwise).
+     * */
+    void printLine(CodeObject *co, size_t offset, int &lastLine) {
+        std::ios_base::fmtflags f(std::cout.flags());
+        auto line = co->lineAt(offset);
+        std::cout << std::dec << std::right << std::setfill(' ') << std::setw(5)
+                  << (line != lastLine && line != 0 ? std::to_string(line) : "") << "  ";
+        lastLine = line;
+        std::cout.flags(f);
+    }
+
     /**
      * Prints opcode.
      * */
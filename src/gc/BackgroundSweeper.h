@@ -0,0 +1,156 @@
+#ifndef EVA_VM_BACKGROUNDSWEEPER_H
+#define EVA_VM_BACKGROUNDSWEEPER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "./EvaSweeper.h"
+
+/**
+ * Sweeps the heap on a background thread.
+ *
+ * After marking, the mutator detaches all pages and large objects
+ * from allocation and hands them over, continuing with fresh pages,
+ * so objects allocated during the sweep are never seen by the sweeper.
+ * Every swept page is handed back right away: the mutator (the only
+ * thread allocating from the heap) attaches it and reuses its free
+ * slots while the sweep goes on. The large objects are handed back
+ * with the rest of the space once the sweep is complete.
+ * */
+class BackgroundSweeper {
+public:
+    BackgroundSweeper() : thread([this]() { sweeperLoop(); }) {}
+
+    ~BackgroundSweeper() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wakeUp.notify_one();
+        thread.join();
+    }
+
+    /**
+     * Takes the detached space and starts sweeping it.
+     * */
+    void start(HeapSpace &&space) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            sweeping = std::move(space);
+            pending = true;
+        }
+        wakeUp.notify_one();
+    }
+
+    /**
+     * Whether the sweep is complete (doesn't wait).
+     * */
+    bool isDone() {
+        return !pending.load(std::memory_order_acquire);
+    }
+
+    /**
+     * Takes the pages swept since the last call (doesn't wait).
+     * */
+    std::vector<Page *> takeSwept() {
+        std::vector<Page *> pages;
+        if (sweptCount.load(std::memory_order_acquire) == takenCount) {
+            return pages;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        pages.swap(swept);
+        takenCount += pages.size();
+        return pages;
+    }
+
+    /**
+     * Waits for the sweep to complete and returns the
+     * swept space (the pages not taken yet, large objects).
+     * */
+    HeapSpace finish() {
+        std::unique_lock<std::mutex> guard(lock);
+        done.wait(guard, [this]() { return !pending; });
+        auto space = std::move(sweeping);
+        space.pages.swap(swept);
+        takenCount = sweptCount.load(std::memory_order_relaxed);
+        return space;
+    }
+
+    /**
+     * Outcome and duration of the last sweep (read after finish).
+     * */
+    SweepStats stats;
+
+    uint64_t sweepNanos = 0;
+
+private:
+    void sweeperLoop() {
+        for (;;) {
+            HeapSpace space;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                wakeUp.wait(guard, [this]() { return stopping || pending; });
+                if (stopping) {
+                    return;
+                }
+                space = std::move(sweeping);
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            SweepStats sweptStats;
+            for (auto &page: space.pages) {
+                EvaSweeper::sweepPage(page, sweptStats);
+                // Not touched by the sweeper from now on.
+                std::lock_guard<std::mutex> guard(lock);
+                swept.push_back(page);
+                sweptCount.fetch_add(1, std::memory_order_release);
+            }
+            space.pages.clear();
+            EvaSweeper::sweepLargeObjects(space, sweptStats);
+            auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                sweeping = std::move(space);
+                stats = sweptStats;
+                sweepNanos = elapsed;
+                pending = false;
+            }
+            done.notify_all();
+        }
+    }
+
+    /**
+     * Space being swept, and then the survivors.
+     * */
+    HeapSpace sweeping;
+
+    /**
+     * Swept pages not taken by the mutator yet (under the lock).
+     * */
+    std::vector<Page *> swept;
+
+    /* Pages swept (all sweeps), and taken by the mutator (mutator only) */
+    std::atomic<size_t> sweptCount{0};
+
+    size_t takenCount = 0;
+
+    /* Written under the lock, read without it by isDone */
+    std::atomic<bool> pending{false};
+
+    bool stopping = false;
+
+    std::mutex lock;
+
+    std::condition_variable wakeUp;
+
+    std::condition_variable done;
+
+    std::thread thread;
+};
+
+#endif
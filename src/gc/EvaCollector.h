@@ -1,74 +1,662 @@
 #ifndef EVA_VM_GC_H
 #define EVA_VM_GC_H
 
-#include <set>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <vector>
 #include "../vm/EvaValue.h"
+#include "./BackgroundSweeper.h"
+#include "./EvaCompactor.h"
+#include "./EvaSweeper.h"
+#include "./GCPacer.h"
+#include "./GCTelemetry.h"
+#include "./Histogram.h"
+#include "./ParallelMarker.h"
 
+/**
+ * Phase of the collection cycle.
+ *
+ * A stop-the-world collection goes through all the phases
+ * at once, the incremental one spreads them over several steps.
+ * */
+enum class GCPhase {
+    IDLE,
+    MARK,
+    SWEEP
+};
+
+/**
+ * Called for every GC root.
+ * */
+using RootVisitor = std::function<void(Traceable *)>;
+
+/**
+ * Enumerates the current GC roots in place, calling the
+ * visitor for each of them (nothing is allocated).
+ * */
+using RootsProvider = std::function<void(const RootVisitor &)>;
+
+/**
+ * Updates the roots with new addresses of the relocated objects.
+ * */
+using RootsRelocator = std::function<void(const Forwarding &)>;
+
+/**
+ * Mark-Sweep garbage collector.
+ *
+ * Tri-color abstraction: white objects are not marked yet, grey objects
+ * are marked and still sit in the worklist, black objects are marked and
+ * all their pointers are traced. The mutator keeps the invariant "no black
+ * object points to a white one" via the write barrier, so marking can be
+ * interleaved with the program execution.
+ * */
 struct EvaCollector {
-    void gc(std::set<Traceable *> &roots) {
-        mark(roots);
-        sweep();
-    }
+    explicit EvaCollector(Heap &heap) : heap(heap) {}
 
     /**
-     * Return all pointers withing this object.
+     * Full (stop-the-world) collection.
      * */
-    std::set<Traceable *> getPointers(Traceable *object) {
-        std::set<Traceable *> pointers;
+    void gc(const RootsProvider &visitRoots) {
+        auto start = std::chrono::steady_clock::now();
 
-        auto evaValue = OBJECT((Object *) object);
+        if (phase == GCPhase::IDLE) {
+            mark(visitRoots);
+            recordMark(start);
+            sweep();
+        } else {
+            // Complete the cycle which is already in progress.
+            if (phase == GCPhase::MARK) {
+                finishMark(visitRoots);
+                recordMark(start);
+                beginSweep();
+            }
+            sweepStep(std::numeric_limits<size_t>::max());
+        }
 
-        if (IS_FUNCTION(evaValue)) {
-            auto fn = AS_FUNCTION(evaValue);
-            for (auto &cell: fn->cells) {
-                pointers.insert((Traceable *) cell);
+        recordPause(start);
+    }
+
+    /**
+     * Whether the VM should run (or continue) a collection now.
+     * */
+    bool shouldCollect() {
+        if (phase != GCPhase::IDLE) {
+            return true;
+        }
+        // The cycle is complete once the background sweep is done, the
+        // next one is not started before that (the trigger is not set yet).
+        // Swept pages are reused meanwhile, and if the heap still reaches
+        // the (previous) trigger, we wait for the sweep instead of growing.
+        if (backgroundSweepPending) {
+            attachSwept();
+            if (!sweeper->isDone() && !pacer.shouldCollect(heap.objectBytesAllocated)) {
+                return false;
             }
+            finishSweep();
         }
+        return pacer.shouldCollect(heap.objectBytesAllocated);
+    }
 
-        if (IS_INSTANCE(evaValue)) {
-            auto instance = AS_INSTANCE(evaValue);
-            for (auto &prop: instance->properties) {
-                if (IS_OBJECT(prop.second)) {
-                    pointers.insert((Traceable *) AS_OBJECT(prop.second));
+    /**
+     * Performs one bounded slice of an incremental collection,
+     * starting a new cycle if there is none in progress.
+     * */
+    void step(const RootsProvider &visitRoots) {
+        auto start = std::chrono::steady_clock::now();
+        auto marking = phase != GCPhase::SWEEP;
+
+        switch (phase) {
+            case GCPhase::IDLE: {
+                beginMark(visitRoots);
+                break;
+            }
+            case GCPhase::MARK: {
+                if (markStep(stepBudget)) {
+                    // Stack and locals are not guarded by the write barrier,
+                    // so the roots are re-scanned before we can sweep.
+                    finishMark(visitRoots);
+                    beginSweep();
                 }
+                break;
+            }
+            case GCPhase::SWEEP: {
+                sweepStep(stepBudget);
+                break;
             }
         }
 
-        return pointers;
+        if (marking) {
+            recordMark(start);
+        }
+        recordPause(start);
+    }
+
+    /**
+     * Write barrier (Dijkstra-style): stored values are shaded grey
+     * during marking, so a black object never points to a white one.
+     * */
+    void writeBarrier(const EvaValue &value) {
+        if (phase == GCPhase::MARK && IS_OBJECT(value)) {
+            shade((Traceable *) value.object);
+        }
     }
 
     // Marking phase (trace)
-    void mark(const std::set<Traceable *> &roots) {
-        std::vector<Traceable *> worklist(roots.begin(), roots.end());
+    void mark(const RootsProvider &visitRoots) {
+        beginMark(visitRoots);
+        finishMark(visitRoots);
+    }
+
+    // Sweep phase (reclaim)
+    void sweep() {
+        beginSweep();
+        sweepStep(std::numeric_limits<size_t>::max());
+    }
+
+    /**
+     * Starts the marking: roots become grey, objects
+     * allocated from now on are allocated black.
+     * */
+    void beginMark(const RootsProvider &visitRoots) {
+        // Mark bits of the previous cycle must be reset first.
+        finishSweep();
+
+        phase = GCPhase::MARK;
+        heap.allocationMark = true;
+
+        shadeRoots(visitRoots);
+    }
+
+    /**
+     * Traces at most `budget` grey objects.
+     * Returns true if there is no grey object left.
+     * */
+    bool markStep(size_t budget) {
+        auto start = std::chrono::steady_clock::now();
+        auto shadeChild = makeObjectVisitor([this](Traceable *child) { shade(child); });
+
+        for (size_t traced = 0; !worklist.empty(); traced++) {
+            if (traced >= budget || (traced % 64 == 63 && isOverTime(start))) {
+                return false;
+            }
 
-        while (!worklist.empty()) {
             auto object = worklist.back();
             worklist.pop_back();
+            traceObject(object, shadeChild);
+        }
 
-            if (!object->marked) {
-                object->marked = true;
-                for (auto &p: getPointers(object)) {
-                    worklist.push_back(p);
-                }
+        return true;
+    }
+
+    /**
+     * Final marking: re-scans the roots and drains the worklist.
+     * */
+    void finishMark(const RootsProvider &visitRoots) {
+        shadeRoots(visitRoots);
+
+        if (parallelMarker != nullptr) {
+            parallelMarker->drain(worklist);
+        } else {
+            markStep(std::numeric_limits<size_t>::max());
+        }
+    }
+
+    /**
+     * Starts the sweeping: all pages and large objects are detached
+     * from allocation, objects allocated from now on go to other
+     * pages and are not part of this sweep (so they are white).
+     *
+     * With the background sweeper the space is handed over to it,
+     * and the pages it has swept are attached back as the VM allocates.
+     * The pages the VM was allocating from (one per size class) are
+     * swept on the mutator thread right away, so it goes on allocating
+     * there rather than in fresh pages while the sweep runs.
+     * */
+    void beginSweep() {
+        phase = GCPhase::SWEEP;
+        heap.allocationMark = false;
+
+        auto current = heap.currentPages();
+        sweeping = heap.detach();
+        sweepPageIndex = 0;
+        allocatedAtSweepStart = heap.objectBytesAllocated;
+        if (sweeper != nullptr) {
+            sweepCurrentPages(current);
+            sweeper->start(std::move(sweeping));
+            backgroundSweepPending = true;
+        }
+    }
+
+    /**
+     * Waits for the background sweep (if any) and
+     * returns the swept space to allocation.
+     * */
+    void finishSweep() {
+        if (backgroundSweepPending) {
+            auto space = sweeper->finish();
+            heap.attach(space);
+            heap.releaseEmptyPages();
+
+            backgroundSweepPending = false;
+            cycle.sweep.add(sweeper->stats);
+            cycle.sweepNanos += sweeper->sweepNanos;
+            heap.freeExternal(sweeper->stats.externalBytesFreed);
+            endCycle();
+        }
+    }
+
+    /**
+     * Sweeps the given pages of the detached space on the
+     * mutator thread, and allocates from them again.
+     * */
+    void sweepCurrentPages(const std::vector<Page *> &current) {
+        if (current.empty()) {
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        auto &pages = sweeping.pages;
+        pages.erase(std::remove_if(pages.begin(), pages.end(), [&current](Page *page) {
+            return std::find(current.begin(), current.end(), page) != current.end();
+        }), pages.end());
+
+        SweepStats swept;
+        for (auto &page: current) {
+            EvaSweeper::sweepPage(page, swept);
+            heap.attachCurrent(page);
+        }
+        recordSweep(swept, start);
+    }
+
+    /**
+     * Returns the pages swept so far by the background sweeper
+     * to allocation, so their free slots are reused right away.
+     * */
+    void attachSwept() {
+        for (auto &page: sweeper->takeSwept()) {
+            heap.attach(page);
+        }
+    }
+
+    /**
+     * Sweeps at least `budget` objects (whole pages). A swept page
+     * is attached back, so its free slots are reused right away.
+     *
+     * Returns true when the cycle is complete.
+     * */
+    bool sweepStep(size_t budget) {
+        auto start = std::chrono::steady_clock::now();
+
+        SweepStats swept;
+        while (sweepPageIndex < sweeping.pages.size()) {
+            if (swept.visited() >= budget || isOverTime(start)) {
+                recordSweep(swept, start);
+                return false;
             }
+
+            auto page = sweeping.pages[sweepPageIndex++];
+            EvaSweeper::sweepPage(page, swept);
+            heap.attach(page);
         }
+
+        EvaSweeper::sweepLargeObjects(sweeping, swept);
+        sweeping.pages.clear();
+        heap.attach(sweeping);
+        recordSweep(swept, start);
+
+        phase = GCPhase::IDLE;
+        heap.allocationMark = false;
+
+        if (sweeper == nullptr) {
+            heap.releaseEmptyPages();
+            // The pacer is updated once the pause of this step is recorded.
+            cycleCompleted = true;
+        }
+
+        if (compactEvery != 0 && ++cyclesSinceCompaction >= compactEvery) {
+            compactionRequested = true;
+        }
+        return true;
     }
 
-    // Sweep phase (reclaim)
-    void sweep() {
-        auto it = Traceable::objects.begin();
-        while (it != Traceable::objects.end()) {
-            auto object = (Traceable *) *it;
+    /**
+     * Mark-compact collection (Lisp2-style): computes new addresses of the
+     * live objects, moves them, and updates all the references.
+     *
+     * Objects hold C++ members (strings, maps, vectors), so instead of
+     * sliding them with memmove they are move-constructed into fresh heap
+     * pages, while the old pages are evacuated and released. The order is
+     * depth-first from the roots, so objects of a size class end up packed
+     * in the order the program reaches them.
+     *
+     * Must be called at a safe point of the VM: all the object pointers
+     * are either in the heap or in the roots `relocateRoots` updates.
+     * */
+    void compact(const RootsProvider &visitRoots, const RootsRelocator &relocateRoots) {
+        // Complete the cycle in progress first.
+        if (phase != GCPhase::IDLE) {
+            gc(visitRoots);
+        }
+        finishSweep();
+
+        compactionRequested = false;
+        cyclesSinceCompaction = 0;
+
+        auto start = std::chrono::steady_clock::now();
+
+        // 1. Mark, recording the depth-first order.
+        std::vector<Traceable *> live;
+        std::vector<Traceable *> stack;
+        auto push = makeObjectVisitor([&stack](Traceable *object) { stack.push_back(object); });
+
+        visitRoots(push.fn);
+        while (!stack.empty()) {
+            auto object = stack.back();
+            stack.pop_back();
+
             if (object->marked) {
-                // Alive object, reset the mark bit for future collection cycles
-                object->marked = false;
-                ++it;
-            } else {
-                it = Traceable::objects.erase(it);
-                delete object;
+                continue;
+            }
+            object->marked = true;
+            live.push_back(object);
+
+            traceObject(object, push);
+        }
+
+        // 2. Compute the new addresses: current pages stop
+        // serving allocations, so these come from fresh ones.
+        auto evacuated = heap.detach();
+
+        Forwarding forward;
+        for (auto &object: live) {
+            forward.addresses[object] = (Traceable *) heap.allocate(object->size());
+        }
+
+        // 3. Move the objects and update the references.
+        for (auto &object: live) {
+            auto moved = EvaCompactor::move(object, forward(object));
+            moved->marked = false;
+            if (moved->sampled) {
+                HeapProfiler::move(object, moved);
             }
+            EvaCompactor::relocatePointers(moved, forward);
+        }
+        relocateRoots(forward);
+
+        // 4. Free the old copies and the garbage, release the evacuated pages.
+        heap.freeAll(evacuated, [](void *object) { destroyObject((Traceable *) object); });
+        heap.attach(evacuated);
+        heap.releaseEmptyPages();
+
+        telemetry.compactions++;
+
+        recordPause(start);
+    }
+
+    /**
+     * Marks the object and schedules it for tracing (white -> grey).
+     * */
+    void shade(Traceable *object) {
+        if (!object->marked) {
+            object->marked = true;
+            worklist.push_back(object);
+        }
+    }
+
+    /**
+     * Shades all the roots.
+     * */
+    void shadeRoots(const RootsProvider &visitRoots) {
+        visitRoots([this](Traceable *root) { shade(root); });
+    }
+
+    /**
+     * Sets the number of marking threads. Used for the whole marking
+     * of a stop-the-world cycle, and for the final marking of an
+     * incremental one.
+     * */
+    void setMarkThreads(size_t threadsCount) {
+        parallelMarker = threadsCount > 1
+                         ? std::make_unique<ParallelMarker>(threadsCount)
+                         : nullptr;
+    }
+
+    /**
+     * Enables sweeping on a background thread.
+     * */
+    void setConcurrentSweep(bool enabled) {
+        finishSweep();
+        sweeper = enabled ? std::make_unique<BackgroundSweeper>() : nullptr;
+    }
+
+    /**
+     * Max pause target: collects incrementally, in steps
+     * bounded by the given time (in microseconds).
+     * */
+    void setMaxPause(uint64_t micros) {
+        incremental = true;
+        stepTimeBudget = micros;
+        stepBudget = std::numeric_limits<size_t>::max();
+    }
+
+    /**
+     * Prints the GC pause times.
+     * */
+    void printPauseStats() {
+        pauses.print(incremental ? "GC pauses (incremental)" : "GC pauses");
+    }
+
+    /**
+     * Writes the GC telemetry as JSON.
+     * */
+    void writeTelemetry(std::ostream &out) {
+        finishSweep();
+        telemetry.writeJSON(out, heap, pauses);
+    }
+
+    /**
+     * Returns a GC metric by name (exposed to Eva programs).
+     * */
+    double stat(const std::string &name) {
+        if (name == "cycles") {
+            return telemetry.cycles;
+        } else if (name == "heap-bytes") {
+            return heap.bytesAllocated;
+        } else if (name == "allocated-bytes") {
+            return GCTelemetry::allocatedBytes(heap);
+        } else if (name == "objects-freed") {
+            return telemetry.swept.objectsFreed;
+        } else if (name == "bytes-freed") {
+            return telemetry.swept.bytesFreed;
+        } else if (name == "max-pause") {
+            return pauses.max;
+        }
+
+        // Per-cycle stats of the last cycle (0 before the first one).
+        if (name != "survivors" && name != "mark-time" && name != "sweep-time") {
+            DIE << "Unknown GC stat: " << name;
+        }
+        if (telemetry.recentCycles.empty()) {
+            return 0;
+        }
+        auto &last = telemetry.recentCycles.back();
+        if (name == "survivors") {
+            return last.sweep.survivors;
+        } else if (name == "mark-time") {
+            return last.markNanos / 1000;
+        }
+        return last.sweepNanos / 1000;
+    }
+
+    /**
+     * Prints the GC cycles rate and the heap trigger.
+     * */
+    void printPacingStats() {
+        pacer.print();
+    }
+
+    /**
+     * Prints the sweep throughput (objects visited per second).
+     * */
+    void printSweepStats() {
+        finishSweep();
+
+        auto objects = telemetry.swept.visited();
+        auto nanos = telemetry.sweepNanos;
+
+        std::cout << "Sweep: " << std::dec << objects << " objects in " << nanos / 1000 << "us";
+        if (nanos != 0) {
+            std::cout << " (" << (uint64_t) (objects * 1e9 / nanos) << " objects/s)";
+        }
+        std::cout << "\n\n";
+    }
+
+    /**
+     * Whether to collect in bounded steps interleaved with the program.
+     * */
+    bool incremental = false;
+
+    /**
+     * Max number of objects traced or swept (rounded up
+     * to whole pages) in one incremental step.
+     * */
+    size_t stepBudget = 256;
+
+    /**
+     * Max duration of one incremental step in microseconds (0 - unlimited).
+     * */
+    uint64_t stepTimeBudget = 0;
+
+    /**
+     * Compact the heap every N collection cycles (0 - never).
+     * */
+    size_t compactEvery = 0;
+
+    /**
+     * Set when a compaction is due; the VM performs
+     * it at the next safe point.
+     * */
+    bool compactionRequested = false;
+
+    /**
+     * Current phase of the collection cycle.
+     * */
+    GCPhase phase = GCPhase::IDLE;
+
+    /**
+     * Heap of the VM being collected.
+     * */
+    Heap &heap;
+
+    /**
+     * Pause times histogram.
+     * */
+    Histogram pauses;
+
+    /**
+     * When to start the next cycle (heap growth policy).
+     * */
+    GCPacer pacer;
+
+    /**
+     * Per-cycle stats and histograms.
+     * */
+    GCTelemetry telemetry;
+
+    /**
+     * Thread pool for parallel marking (null - single-threaded).
+     * */
+    std::unique_ptr<ParallelMarker> parallelMarker;
+
+    /**
+     * Background sweeping thread (null - sweep on the mutator thread).
+     * */
+    std::unique_ptr<BackgroundSweeper> sweeper;
+
+private:
+    bool isOverTime(const std::chrono::steady_clock::time_point &start) {
+        return stepTimeBudget != 0 && elapsedMicros(start) >= stepTimeBudget;
+    }
+
+    void recordPause(const std::chrono::steady_clock::time_point &start) {
+        auto micros = elapsedMicros(start);
+        pauses.record(micros);
+        pacer.recordGCTime(micros);
+
+        if (cycleCompleted) {
+            cycleCompleted = false;
+            endCycle();
         }
     }
+
+    void recordMark(const std::chrono::steady_clock::time_point &start) {
+        cycle.markNanos += elapsedNanos(start);
+    }
+
+    void recordSweep(const SweepStats &swept, const std::chrono::steady_clock::time_point &start) {
+        cycle.sweep.add(swept);
+        cycle.sweepNanos += elapsedNanos(start);
+        heap.freeExternal(swept.externalBytesFreed);
+    }
+
+    void endCycle() {
+        // Live: the survivors, plus the objects allocated during the sweep (not swept).
+        auto liveBytes = cycle.sweep.survivorBytes + (heap.objectBytesAllocated - allocatedAtSweepStart);
+        pacer.endCycle(liveBytes, heap.objectBytesAllocated);
+        telemetry.endCycle(cycle, heap);
+        cycle = GCCycle();
+    }
+
+    static uint64_t elapsedNanos(const std::chrono::steady_clock::time_point &start) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+    }
+
+    static uint64_t elapsedMicros(const std::chrono::steady_clock::time_point &start) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+    }
+
+    /**
+     * Grey objects (the mark stack).
+     * */
+    std::vector<Traceable *> worklist;
+
+    /**
+     * Set when the mutator thread sweep completes a cycle.
+     * */
+    bool cycleCompleted = false;
+
+    /**
+     * Whether the background sweeper holds a space to hand back.
+     * */
+    bool backgroundSweepPending = false;
+
+    /**
+     * Collection cycles since the last compaction.
+     * */
+    size_t cyclesSinceCompaction = 0;
+
+    /**
+     * Space being swept on the mutator thread, and the
+     * next page of the incremental sweep.
+     * */
+    HeapSpace sweeping;
+
+    size_t sweepPageIndex = 0;
+
+    /**
+     * Object bytes allocated (all cycles) when the sweep started.
+     * */
+    size_t allocatedAtSweepStart = 0;
+
+    /**
+     * Cycle in progress.
+     * */
+    GCCycle cycle;
 };
 
 #endif
@@ -0,0 +1,95 @@
+#ifndef EVA_VM_EVACOMPACTOR_H
+#define EVA_VM_EVACOMPACTOR_H
+
+#include <unordered_map>
+#include "../vm/EvaValue.h"
+
+/**
+ * Old -> new addresses of the objects relocated by a compaction.
+ * */
+struct Forwarding {
+    /**
+     * Returns the new address of the object (same one if not moved).
+     * */
+    template<typename T>
+    T *operator()(T *object) const {
+        auto it = addresses.find((Traceable *) object);
+        return it == addresses.end() ? object : (T *) it->second;
+    }
+
+    /**
+     * Updates the value if it's an object.
+     * */
+    void update(EvaValue &value) const {
+        if (IS_OBJECT(value)) {
+            value.object = (*this)(value.object);
+        }
+    }
+
+    std::unordered_map<Traceable *, Traceable *> addresses;
+};
+
+/**
+ * Trace visitor updating the visited pointers to the new addresses.
+ * */
+struct Relocator {
+    template<typename T>
+    void operator()(T *&object) {
+        object = forward(object);
+    }
+
+    void operator()(EvaValue &value) {
+        forward.update(value);
+    }
+
+    const Forwarding &forward;
+};
+
+/**
+ * Object relocation for the mark-compact collection.
+ * */
+struct EvaCompactor {
+    /**
+     * Move-constructs the object at the new place.
+     * */
+    static Traceable *move(Traceable *object, void *place) {
+        switch (((Object *) object)->type) {
+            case ObjectType::STRING:
+                return new(place) StringObject(std::move(*(StringObject *) object));
+            case ObjectType::CODE:
+                return new(place) CodeObject(std::move(*(CodeObject *) object));
+            case ObjectType::NATIVE:
+                return new(place) NativeObject(std::move(*(NativeObject *) object));
+            case ObjectType::FUNCTION:
+                return new(place) FunctionObject(std::move(*(FunctionObject *) object));
+            case ObjectType::CELL:
+                return new(place) CellObject(std::move(*(CellObject *) object));
+            case ObjectType::CLASS:
+                return new(place) ClassObject(std::move(*(ClassObject *) object));
+            case ObjectType::INSTANCE:
+                return new(place) InstanceObject(std::move(*(InstanceObject *) object));
+            case ObjectType::COROUTINE:
+                return new(place) CoroutineObject(std::move(*(CoroutineObject *) object));
+            case ObjectType::CHANNEL:
+                return new(place) ChannelObject(std::move(*(ChannelObject *) object));
+            case ObjectType::ARRAY:
+                return new(place) ArrayObject(std::move(*(ArrayObject *) object));
+            case ObjectType::FLOAT64_ARRAY:
+                return new(place) Float64ArrayObject(std::move(*(Float64ArrayObject *) object));
+            case ObjectType::MAP:
+                return new(place) MapObject(std::move(*(MapObject *) object));
+        }
+        DIE << "EvaCompactor::move: unknown object type " << (int) ((Object *) object)->type;
+        return nullptr; // Unreachable
+    }
+
+    /**
+     * Updates all pointers within the (relocated) object.
+     * */
+    static void relocatePointers(Traceable *object, const Forwarding &forward) {
+        Relocator relocate{forward};
+        traceObject(object, relocate);
+    }
+};
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef EVA_VM_EVASWEEPER_H
+#define EVA_VM_EVASWEEPER_H
+
+#include "../vm/EvaValue.h"
+
+/**
+ * Outcome of a sweep.
+ * */
+struct SweepStats {
+    size_t survivors = 0;
+
+    size_t survivorBytes = 0;
+
+    size_t objectsFreed = 0;
+
+    size_t bytesFreed = 0;
+
+    /* Storage outside of the heap freed with the objects (in bytesFreed too) */
+    size_t externalBytesFreed = 0;
+
+    size_t visited() const {
+        return survivors + objectsFreed;
+    }
+
+    void add(const SweepStats &other) {
+        survivors += other.survivors;
+        survivorBytes += other.survivorBytes;
+        objectsFreed += other.objectsFreed;
+        bytesFreed += other.bytesFreed;
+        externalBytesFreed += other.externalBytesFreed;
+    }
+};
+
+/**
+ * Sweep of the detached heap space: frees unmarked objects,
+ * resets mark bits of the survivors.
+ *
+ * Objects are found via the allocation bitmaps of the pages and
+ * the intrusive list of the large objects, so free slots are
+ * skipped a word (64 slots) at a time.
+ * */
+struct EvaSweeper {
+    /**
+     * Sweeps one page.
+     * */
+    static void sweepPage(Page *page, SweepStats &stats) {
+        page->forEachObject([&stats](void *slot) {
+            sweepObject((Traceable *) slot, stats);
+        });
+    }
+
+    /**
+     * Sweeps the large objects of the space, keeping
+     * the survivors in its list.
+     * */
+    static void sweepLargeObjects(HeapSpace &space, SweepStats &stats) {
+        LargeObject *survivors = nullptr;
+
+        while (space.largeObjects != nullptr) {
+            auto header = space.largeObjects;
+            space.largeObjects = header->next;
+            if (sweepObject((Traceable *) (header + 1), stats)) {
+                header->next = survivors;
+                survivors = header;
+            }
+        }
+
+        space.largeObjects = survivors;
+    }
+
+    /**
+     * Returns true if the object survives.
+     * */
+    static bool sweepObject(Traceable *object, SweepStats &stats) {
+        if (object->marked) {
+            // Alive object, reset the mark bit for future collection cycles
+            object->marked = false;
+            if (object->age != UINT8_MAX) {
+                object->age++;
+            }
+            stats.survivors++;
+            stats.survivorBytes += object->size() + externalSizeOf(object);
+            return true;
+        }
+        auto external = externalSizeOf(object);
+        stats.objectsFreed++;
+        stats.bytesFreed += object->size() + external;
+        stats.externalBytesFreed += external;
+        destroyObject(object);
+        return false;
+    }
+};
+
+#endif
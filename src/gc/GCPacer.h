@@ -0,0 +1,164 @@
+#ifndef EVA_VM_GCPACER_H
+#define EVA_VM_GCPACER_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include "../vm/Logger.h"
+
+/**
+ * Default heap growth: next cycle starts when the heap
+ * is this many times larger than after the previous one.
+ * */
+#define GC_GROWTH_FACTOR 2.0
+
+/**
+ * Heap size below which no collection is started.
+ * */
+#define GC_MIN_HEAP (1024 * 1024)
+
+/**
+ * Upper bound of the adapted growth factor.
+ * */
+#define GC_MAX_GROWTH_FACTOR 16.0
+
+/**
+ * GC pacing: decides when the next collection cycle starts.
+ *
+ * The trigger is the live heap after the previous cycle (bytes of the
+ * objects which survived it) times the growth factor, clamped to
+ * [minHeap, maxHeap]. It is compared with the live heap estimate: live
+ * bytes plus the bytes allocated since. The committed heap (pages, with
+ * their free slots) doesn't count: a cap between the live bytes and the
+ * page floor of the size classes would start a cycle at every check.
+ * With a GC CPU fraction target, the growth factor is adapted after
+ * every cycle: the heap grows more when the collector takes too much
+ * time, and goes back to the configured factor when it's well under
+ * the target.
+ * */
+struct GCPacer {
+    GCPacer() : start(std::chrono::steady_clock::now()), lastCycleEnd(start) {}
+
+    /**
+     * Whether a new cycle should start, given the object
+     * bytes allocated so far (all cycles).
+     * */
+    bool shouldCollect(size_t allocatedBytes) const {
+        auto liveEstimate = lastLiveBytes + (allocatedBytes - allocatedAtCycleEnd);
+        return liveEstimate >= nextTrigger();
+    }
+
+    /**
+     * Heap size which starts the next cycle.
+     * */
+    size_t nextTrigger() const {
+        auto limit = std::max(trigger, minHeap);
+        return maxHeap != 0 ? std::min(limit, maxHeap) : limit;
+    }
+
+    /**
+     * Accounts time spent in the collector (pauses).
+     * */
+    void recordGCTime(uint64_t micros) {
+        gcMicros += micros;
+        cycleGCMicros += micros;
+    }
+
+    /**
+     * Sets the next trigger once a cycle is complete, given the
+     * live bytes and the object bytes allocated so far.
+     * */
+    void endCycle(size_t liveBytes, size_t allocatedBytes) {
+        auto now = std::chrono::steady_clock::now();
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - lastCycleEnd).count();
+        lastCycleEnd = now;
+
+        cycles++;
+        lastLiveBytes = liveBytes;
+        allocatedAtCycleEnd = allocatedBytes;
+        lastCPUFraction = elapsed == 0 ? 0 : (double) cycleGCMicros / elapsed;
+        cycleGCMicros = 0;
+
+        if (maxHeap != 0 && liveBytes > maxHeap) {
+            DIE << "Heap limit exceeded: " << liveBytes << " bytes live, limit " << maxHeap;
+        }
+
+        if (cpuTarget > 0) {
+            currentGrowth = std::max(currentGrowth, growthFactor);
+            if (lastCPUFraction > cpuTarget) {
+                currentGrowth = std::min(currentGrowth * 1.5, GC_MAX_GROWTH_FACTOR);
+            } else if (lastCPUFraction < cpuTarget / 2) {
+                currentGrowth = std::max(currentGrowth / 1.25, growthFactor);
+            }
+        } else {
+            currentGrowth = growthFactor;
+        }
+
+        trigger = (size_t) (liveBytes * currentGrowth);
+    }
+
+    /**
+     * Prints the pacing stats.
+     * */
+    void print() {
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+
+        std::cout << "GC cycles: " << std::dec << cycles;
+        if (elapsed != 0) {
+            std::cout << " (" << cycles * 1e6 / elapsed << " per second)"
+                      << ", GC CPU: " << 100.0 * gcMicros / elapsed << "%";
+        }
+        std::cout << "\n";
+        std::cout << "Next trigger: " << nextTrigger() << " bytes (growth " << currentGrowth
+                  << "), live after the last cycle: " << lastLiveBytes << " bytes\n\n";
+    }
+
+    /**
+     * Configured heap growth factor.
+     * */
+    double growthFactor = GC_GROWTH_FACTOR;
+
+    /**
+     * Heap limits (maxHeap 0 - unlimited).
+     * */
+    size_t minHeap = GC_MIN_HEAP;
+
+    size_t maxHeap = 0;
+
+    /**
+     * Target fraction of time spent in the collector (0 - not set).
+     * */
+    double cpuTarget = 0;
+
+    /**
+     * Live bytes after the last cycle times the growth factor.
+     * */
+    size_t trigger = 0;
+
+    /**
+     * Growth factor in effect (adapted to the CPU target).
+     * */
+    double currentGrowth = GC_GROWTH_FACTOR;
+
+    size_t cycles = 0;
+
+    size_t lastLiveBytes = 0;
+
+    /* Object bytes allocated (all cycles) when the last cycle completed */
+    size_t allocatedAtCycleEnd = 0;
+
+    double lastCPUFraction = 0;
+
+private:
+    std::chrono::steady_clock::time_point start;
+
+    std::chrono::steady_clock::time_point lastCycleEnd;
+
+    uint64_t gcMicros = 0;
+
+    uint64_t cycleGCMicros = 0;
+};
+
+#endif
@@ -0,0 +1,160 @@
+#ifndef EVA_VM_GCTELEMETRY_H
+#define EVA_VM_GCTELEMETRY_H
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <ostream>
+#include "../vm/EvaValue.h"
+#include "./EvaSweeper.h"
+#include "./Histogram.h"
+
+/**
+ * Number of the most recent cycles kept in the telemetry.
+ * */
+#define GC_TELEMETRY_CYCLES 64
+
+/**
+ * One collection cycle.
+ * */
+struct GCCycle {
+    uint64_t markNanos = 0;
+
+    uint64_t sweepNanos = 0;
+
+    SweepStats sweep;
+
+    /* Bytes allocated since the previous cycle */
+    size_t allocatedBytes = 0;
+
+    /* Heap size once the cycle is complete */
+    size_t heapBytes = 0;
+};
+
+/**
+ * GC telemetry: per-cycle records, mark/sweep duration histograms,
+ * allocation rate and live heap per object type.
+ *
+ * Only collected in memory; exported as JSON on request.
+ * */
+struct GCTelemetry {
+    GCTelemetry() : start(std::chrono::steady_clock::now()) {}
+
+    /**
+     * Records a complete cycle.
+     * */
+    void endCycle(GCCycle &cycle, Heap &heap) {
+        auto allocated = allocatedBytes(heap);
+        cycle.allocatedBytes = allocated - lastAllocatedBytes;
+        cycle.heapBytes = heap.bytesAllocated;
+        lastAllocatedBytes = allocated;
+
+        cycles++;
+        markTimes.record(cycle.markNanos / 1000);
+        sweepTimes.record(cycle.sweepNanos / 1000);
+        swept.add(cycle.sweep);
+        sweepNanos += cycle.sweepNanos;
+
+        recentCycles.push_back(cycle);
+        if (recentCycles.size() > GC_TELEMETRY_CYCLES) {
+            recentCycles.pop_front();
+        }
+    }
+
+    /**
+     * Bytes allocated so far (all types).
+     * */
+    static size_t allocatedBytes(const Heap &heap) {
+        size_t bytes = 0;
+        for (auto &counter: heap.allocations) {
+            bytes += counter.bytes;
+        }
+        return bytes;
+    }
+
+    /**
+     * Writes the telemetry as a JSON object.
+     * */
+    void writeJSON(std::ostream &out, Heap &heap, const Histogram &pauses) const {
+        auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        out << "{\n";
+        out << "  \"cycles\": " << cycles << ",\n";
+        out << "  \"compactions\": " << compactions << ",\n";
+        out << "  \"seconds\": " << seconds << ",\n";
+        out << "  \"heapBytes\": " << heap.bytesAllocated << ",\n";
+        out << "  \"objectsFreed\": " << swept.objectsFreed << ",\n";
+        out << "  \"bytesFreed\": " << swept.bytesFreed << ",\n";
+
+        out << "  \"pauses\": ";
+        pauses.writeJSON(out);
+        out << ",\n  \"mark\": ";
+        markTimes.writeJSON(out);
+        out << ",\n  \"sweep\": ";
+        sweepTimes.writeJSON(out);
+
+        out << ",\n  \"allocation\": {";
+        for (size_t type = 0; type < OBJECT_TYPES_COUNT; type++) {
+            auto &counter = heap.allocations[type];
+            out << (type == 0 ? "\n" : ",\n") << "    \"" << objectTypeName((ObjectType) type)
+                << "\": {\"objects\": " << counter.objects << ", \"bytes\": " << counter.bytes
+                << ", \"bytesPerSecond\": " << (seconds > 0 ? counter.bytes / seconds : 0) << "}";
+        }
+
+        // Live heap per type.
+        std::array<std::pair<size_t, size_t>, OBJECT_TYPES_COUNT> live{};
+        heap.forEachObject([&live](void *object) {
+            auto &type = live[(size_t) ((Object *) object)->type];
+            type.first++;
+            type.second += ((Traceable *) object)->size();
+        });
+        out << "\n  },\n  \"heap\": {";
+        for (size_t type = 0; type < OBJECT_TYPES_COUNT; type++) {
+            out << (type == 0 ? "\n" : ",\n") << "    \"" << objectTypeName((ObjectType) type)
+                << "\": {\"objects\": " << live[type].first << ", \"bytes\": " << live[type].second << "}";
+        }
+
+        out << "\n  },\n  \"recentCycles\": [";
+        for (size_t i = 0; i < recentCycles.size(); i++) {
+            auto &cycle = recentCycles[i];
+            out << (i == 0 ? "\n" : ",\n")
+                << "    {\"markMicros\": " << cycle.markNanos / 1000
+                << ", \"sweepMicros\": " << cycle.sweepNanos / 1000
+                << ", \"survivors\": " << cycle.sweep.survivors
+                << ", \"survivorBytes\": " << cycle.sweep.survivorBytes
+                << ", \"objectsFreed\": " << cycle.sweep.objectsFreed
+                << ", \"bytesFreed\": " << cycle.sweep.bytesFreed
+                << ", \"allocatedBytes\": " << cycle.allocatedBytes
+                << ", \"heapBytes\": " << cycle.heapBytes << "}";
+        }
+        out << "\n  ]\n}\n";
+    }
+
+    size_t cycles = 0;
+
+    size_t compactions = 0;
+
+    /**
+     * Mark and sweep durations per cycle.
+     * */
+    Histogram markTimes;
+
+    Histogram sweepTimes;
+
+    /**
+     * Totals of all the sweeps.
+     * */
+    SweepStats swept;
+
+    uint64_t sweepNanos = 0;
+
+    std::deque<GCCycle> recentCycles;
+
+private:
+    std::chrono::steady_clock::time_point start;
+
+    size_t lastAllocatedBytes = 0;
+};
+
+#endif
@@ -0,0 +1,613 @@
+#ifndef EVA_VM_HEAP_H
+#define EVA_VM_HEAP_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <utility>
+#include <vector>
+
+/**
+ * Size of a heap page (pages are aligned to their size).
+ * */
+#define HEAP_PAGE_SIZE (64 * 1024)
+
+/**
+ * Size classes: 16, 32, ... 256 bytes.
+ * */
+#define HEAP_SIZE_CLASS_STEP 16
+
+/**
+ * Objects above this size take the large object path (malloc).
+ * */
+#define HEAP_MAX_SMALL_SIZE 256
+
+#define HEAP_SIZE_CLASSES (HEAP_MAX_SMALL_SIZE / HEAP_SIZE_CLASS_STEP)
+
+/**
+ * Size class of the large objects (their size is kept in the LargeObject header).
+ * */
+#define HEAP_LARGE_SIZE_CLASS 0xFF
+
+/**
+ * Max number of object types (per-type allocation counters).
+ * */
+#define HEAP_MAX_OBJECT_TYPES 16
+
+struct Heap;
+
+/**
+ * Free slot, linked into the free list of its page.
+ * */
+struct FreeSlot {
+    FreeSlot *next;
+};
+
+/**
+ * Allocation bitmap words per page (one bit per smallest slot).
+ * */
+#define HEAP_PAGE_BITMAP_WORDS (HEAP_PAGE_SIZE / HEAP_SIZE_CLASS_STEP / 64)
+
+/**
+ * Page of equally sized slots.
+ *
+ * The header sits at the beginning of the page, so the page
+ * of an object is found by masking the object address. The
+ * allocation bitmap lets the sweeper walk the objects of the
+ * page without any per-object list.
+ * */
+struct Page {
+    Page(size_t sizeClass, size_t slotSize)
+            : sizeClass(sizeClass),
+              slotSize(slotSize),
+              bump((char *) this + firstSlotOffset()),
+              end((char *) this + HEAP_PAGE_SIZE) {}
+
+    /**
+     * Takes a free slot: previously freed ones first, then never used ones.
+     * */
+    void *allocate() {
+        char *slot;
+        if (freeList != nullptr) {
+            slot = (char *) freeList;
+            freeList = freeList->next;
+        } else if (bump + slotSize <= end) {
+            slot = bump;
+            bump += slotSize;
+        } else {
+            return nullptr;
+        }
+
+        auto index = slotIndex(slot);
+        allocated[index / 64] |= (uint64_t) 1 << (index % 64);
+        liveCount++;
+        return slot;
+    }
+
+    bool hasFreeSlots() {
+        return freeList != nullptr || bump + slotSize <= end;
+    }
+
+    /**
+     * Returns the slot to the page.
+     * */
+    void free(void *slot) {
+        auto index = slotIndex((char *) slot);
+        allocated[index / 64] &= ~((uint64_t) 1 << (index % 64));
+
+        auto freeSlot = (FreeSlot *) slot;
+        freeSlot->next = freeList;
+        freeList = freeSlot;
+        liveCount--;
+    }
+
+    /**
+     * Calls fn(object) for every allocated slot; fn may free the object.
+     * */
+    template<typename Fn>
+    void forEachObject(const Fn &fn) {
+        auto first = (char *) this + firstSlotOffset();
+        auto words = (slotIndex(bump) + 63) / 64;
+        for (size_t word = 0; word < words; word++) {
+            auto bits = allocated[word];
+            while (bits != 0) {
+                auto bit = __builtin_ctzll(bits);
+                bits &= bits - 1;
+                fn(first + (word * 64 + bit) * slotSize);
+            }
+        }
+    }
+
+    static size_t firstSlotOffset() {
+        return (sizeof(Page) + HEAP_SIZE_CLASS_STEP - 1) / HEAP_SIZE_CLASS_STEP * HEAP_SIZE_CLASS_STEP;
+    }
+
+    size_t sizeClass;
+
+    size_t slotSize;
+
+    /* Next never allocated slot */
+    char *bump;
+
+    char *end;
+
+    FreeSlot *freeList = nullptr;
+
+    size_t liveCount = 0;
+
+    /* Bit per slot: set while the slot holds an object */
+    uint64_t allocated[HEAP_PAGE_BITMAP_WORDS] = {};
+
+private:
+    size_t slotIndex(char *slot) {
+        return (slot - ((char *) this + firstSlotOffset())) / slotSize;
+    }
+};
+
+/**
+ * Header of a large (malloc'ed) object, links all large objects.
+ * */
+struct alignas(16) LargeObject {
+    LargeObject *next;
+
+    Heap *heap;
+
+    size_t size;
+};
+
+/**
+ * Pages of one size class.
+ * */
+struct SizeClass {
+    /* Pages in allocation */
+    std::vector<Page *> pages;
+
+    /* Pages with free slots (as of their last sweep), not allocated from yet */
+    std::vector<Page *> available;
+
+    /* Page we currently allocate from */
+    Page *current = nullptr;
+};
+
+/**
+ * Part of the heap taken out of allocation: pages and large objects
+ * being swept or evacuated. Nothing is allocated there until the
+ * space is attached back to the heap.
+ * */
+struct HeapSpace {
+    HeapSpace() = default;
+
+    /**
+     * Moves the ownership, the source is left empty.
+     * */
+    HeapSpace(HeapSpace &&other) noexcept { *this = std::move(other); }
+
+    HeapSpace &operator=(HeapSpace &&other) noexcept {
+        pages.swap(other.pages);
+        other.pages.clear();
+        largeObjects = std::exchange(other.largeObjects, nullptr);
+        return *this;
+    }
+
+    std::vector<Page *> pages;
+
+    LargeObject *largeObjects = nullptr;
+};
+
+/**
+ * Allocations of one object type.
+ * */
+struct AllocationCounter {
+    size_t objects = 0;
+
+    size_t bytes = 0;
+};
+
+/**
+ * VM heap (isolate): size-segregated pages for the (fixed size) objects,
+ * and malloc for the large ones, plus the allocation accounting and the
+ * color of new objects.
+ *
+ * Every VM owns one, so VMs don't share any object or allocator state,
+ * and can run on parallel threads. New objects are allocated in the
+ * current heap of the thread, bound by the VM running there (Heap::Scope).
+ * Freeing doesn't need the current heap (a page is found from the object
+ * address, a large object keeps its heap in the header), so any thread,
+ * e.g. a background sweeper, can free objects.
+ * */
+struct Heap {
+    Heap() = default;
+
+    Heap(const Heap &) = delete;
+
+    Heap &operator=(const Heap &) = delete;
+
+    /**
+     * Releases all the pages, objects must be already destroyed.
+     * */
+    ~Heap() {
+        for (auto &sizeClass: sizeClasses) {
+            for (auto &page: sizeClass.pages) {
+                releasePage(page);
+            }
+            sizeClass.pages.clear();
+        }
+    }
+
+    /**
+     * Makes the heap current on this thread for the scope.
+     * */
+    struct Scope {
+        explicit Scope(Heap &heap) : previous(current) { current = &heap; }
+
+        ~Scope() { current = previous; }
+
+        Heap *previous;
+    };
+
+    /**
+     * Heap new objects are allocated in.
+     * */
+    static thread_local Heap *current;
+
+    /**
+     * Allocates memory for an object.
+     * */
+    void *allocate(size_t size) {
+        if (size > HEAP_MAX_SMALL_SIZE) {
+            auto header = (LargeObject *) std::malloc(sizeof(LargeObject) + size);
+            if (header == nullptr) {
+                throw std::bad_alloc();
+            }
+            header->size = size;
+            header->heap = this;
+            header->next = largeObjects;
+            largeObjects = header;
+            bytesAllocated += sizeof(LargeObject) + size;
+            largeObjectsBytes += size;
+            largeObjectsCount++;
+            return header + 1;
+        }
+
+        auto &sizeClass = sizeClasses[sizeClassOf(size)];
+
+        // Current page, then a page known to have free slots, then a new one.
+        if (sizeClass.current != nullptr) {
+            auto slot = sizeClass.current->allocate();
+            if (slot != nullptr) {
+                return slot;
+            }
+        }
+        while (!sizeClass.available.empty()) {
+            auto page = sizeClass.available.back();
+            sizeClass.available.pop_back();
+            auto slot = page->allocate();
+            if (slot != nullptr) {
+                sizeClass.current = page;
+                return slot;
+            }
+        }
+
+        auto page = allocatePage(sizeClassOf(size));
+        sizeClass.pages.push_back(page);
+        sizeClass.current = page;
+        return page->allocate();
+    }
+
+    /**
+     * Frees object memory. A large object must be already
+     * unlinked by the one walking the large objects list.
+     * */
+    static void free(void *object, uint8_t sizeClass) {
+        if (sizeClass == HEAP_LARGE_SIZE_CLASS) {
+            auto header = (LargeObject *) object - 1;
+            auto heap = header->heap;
+            heap->bytesAllocated -= sizeof(LargeObject) + header->size;
+            heap->largeObjectsBytes -= header->size;
+            heap->largeObjectsCount--;
+            std::free(header);
+            return;
+        }
+
+        pageOf(object)->free(object);
+    }
+
+    /**
+     * Size class of the object of the given size.
+     * */
+    static uint8_t sizeClassOf(size_t size) {
+        if (size > HEAP_MAX_SMALL_SIZE) {
+            return HEAP_LARGE_SIZE_CLASS;
+        }
+        return (size + HEAP_SIZE_CLASS_STEP - 1) / HEAP_SIZE_CLASS_STEP - 1;
+    }
+
+    /**
+     * Memory taken by the object: its slot, or the malloc'ed size.
+     * */
+    static size_t sizeOf(const void *object, uint8_t sizeClass) {
+        if (sizeClass == HEAP_LARGE_SIZE_CLASS) {
+            return ((const LargeObject *) object - 1)->size;
+        }
+        return (sizeClass + 1) * HEAP_SIZE_CLASS_STEP;
+    }
+
+    /**
+     * Takes all pages and large objects out of allocation,
+     * new objects go to fresh pages from now on.
+     * */
+    HeapSpace detach() {
+        HeapSpace space;
+        for (auto &sizeClass: sizeClasses) {
+            space.pages.insert(space.pages.end(), sizeClass.pages.begin(), sizeClass.pages.end());
+            sizeClass.pages.clear();
+            sizeClass.available.clear();
+            sizeClass.current = nullptr;
+        }
+        space.largeObjects = largeObjects;
+        largeObjects = nullptr;
+        return space;
+    }
+
+    /**
+     * Accounts the storage an object holds outside of the heap (e.g. the
+     * items of an array), given the bytes accounted for it so far (updated).
+     * */
+    void resizeExternal(size_t &accounted, size_t bytes) {
+        if (bytes > accounted) {
+            objectBytesAllocated += bytes - accounted;
+        }
+        bytesAllocated += bytes - accounted;
+        externalBytes += bytes - accounted;
+        accounted = bytes;
+    }
+
+    /**
+     * Drops the external storage of freed objects from the accounting.
+     * */
+    void freeExternal(size_t bytes) {
+        bytesAllocated -= bytes;
+        externalBytes -= bytes;
+    }
+
+    /**
+     * Pages objects are currently allocated from (one per size class at most).
+     * */
+    std::vector<Page *> currentPages() {
+        std::vector<Page *> pages;
+        for (auto &sizeClass: sizeClasses) {
+            if (sizeClass.current != nullptr) {
+                pages.push_back(sizeClass.current);
+            }
+        }
+        return pages;
+    }
+
+    /**
+     * Returns a (swept) page to allocation, as the page objects are allocated from.
+     * */
+    void attachCurrent(Page *page) {
+        auto &sizeClass = sizeClasses[page->sizeClass];
+        sizeClass.pages.push_back(page);
+        sizeClass.current = page;
+    }
+
+    /**
+     * Returns a (swept) page to allocation.
+     * */
+    void attach(Page *page) {
+        auto &sizeClass = sizeClasses[page->sizeClass];
+        sizeClass.pages.push_back(page);
+        if (page->hasFreeSlots()) {
+            sizeClass.available.push_back(page);
+        }
+    }
+
+    /**
+     * Returns the (swept) space to allocation.
+     * */
+    void attach(HeapSpace &space) {
+        for (auto &page: space.pages) {
+            attach(page);
+        }
+        space.pages.clear();
+
+        while (space.largeObjects != nullptr) {
+            auto header = space.largeObjects;
+            space.largeObjects = header->next;
+            header->next = largeObjects;
+            largeObjects = header;
+        }
+    }
+
+    /**
+     * Calls fn(object) for every object in the heap.
+     * */
+    template<typename Fn>
+    void forEachObject(const Fn &fn) {
+        for (auto &sizeClass: sizeClasses) {
+            for (auto &page: sizeClass.pages) {
+                page->forEachObject(fn);
+            }
+        }
+        for (auto header = largeObjects; header != nullptr; header = header->next) {
+            fn(header + 1);
+        }
+    }
+
+    /**
+     * Frees all objects of the space with fn(object),
+     * leaving it with empty pages only.
+     * */
+    template<typename Fn>
+    void freeAll(HeapSpace &space, const Fn &fn) {
+        for (auto &page: space.pages) {
+            page->forEachObject(fn);
+        }
+        while (space.largeObjects != nullptr) {
+            auto header = space.largeObjects;
+            space.largeObjects = header->next;
+            fn(header + 1);
+        }
+    }
+
+    /**
+     * Returns empty pages to the system. Called on the
+     * mutator thread once the sweep is complete, and at
+     * cleanup (with no spare page kept). The pages with
+     * free slots are available for allocation again, the
+     * page objects were allocated from stays the current one.
+     * */
+    void releaseEmptyPages(bool keepSpare = true) {
+        for (auto &sizeClass: sizeClasses) {
+            auto &pages = sizeClass.pages;
+            size_t kept = 0;
+            bool keptEmpty = false;
+            auto current = std::exchange(sizeClass.current, nullptr);
+            sizeClass.available.clear();
+            for (auto &page: pages) {
+                // Keep one empty page per size class to avoid page churn.
+                if (page->liveCount == 0) {
+                    if (keptEmpty || !keepSpare) {
+                        releasePage(page);
+                        continue;
+                    }
+                    keptEmpty = true;
+                }
+                pages[kept++] = page;
+                if (page == current) {
+                    sizeClass.current = page;
+                } else if (page->hasFreeSlots()) {
+                    sizeClass.available.push_back(page);
+                }
+            }
+            pages.resize(kept);
+        }
+    }
+
+    /**
+     * Number of pages in allocation.
+     * */
+    size_t pagesCount() {
+        size_t count = 0;
+        for (auto &sizeClass: sizeClasses) {
+            count += sizeClass.pages.size();
+        }
+        return count;
+    }
+
+    /**
+     * Number of objects in allocation.
+     * */
+    size_t objectsCount() {
+        size_t count = largeObjectsCount;
+        for (auto &sizeClass: sizeClasses) {
+            for (auto &page: sizeClass.pages) {
+                count += page->liveCount;
+            }
+        }
+        return count;
+    }
+
+    /**
+     * Memory taken by the objects in allocation (slots and large objects).
+     * */
+    size_t objectsBytes() {
+        size_t bytes = largeObjectsBytes;
+        for (auto &sizeClass: sizeClasses) {
+            for (auto &page: sizeClass.pages) {
+                bytes += page->liveCount * page->slotSize;
+            }
+        }
+        return bytes;
+    }
+
+    /**
+     * Prints per size class page usage.
+     * */
+    void printStats() {
+        std::cout << "Pages             : " << std::dec << pagesCount() << " x " << HEAP_PAGE_SIZE << "\n";
+        std::cout << "Large objects     : " << largeObjectsCount << ", " << largeObjectsBytes << " bytes\n";
+        std::cout << "External storage  : " << externalBytes << " bytes\n";
+        for (size_t i = 0; i < HEAP_SIZE_CLASSES; i++) {
+            auto &pages = sizeClasses[i].pages;
+            if (pages.empty()) {
+                continue;
+            }
+            size_t live = 0;
+            for (auto &page: pages) {
+                live += page->liveCount;
+            }
+            std::cout << "  " << (i + 1) * HEAP_SIZE_CLASS_STEP << " bytes: " << pages.size()
+                      << " page(s), " << live << " object(s)\n";
+        }
+        std::cout << "\n";
+    }
+
+    /**
+     * Memory taken by the heap: pages and large objects, and the
+     * storage of objects outside of it (see resizeExternal).
+     * Atomic, since the background sweeper frees large objects.
+     * */
+    std::atomic<size_t> bytesAllocated{0};
+
+    /**
+     * Memory taken by all the objects allocated so far (their slots,
+     * and their external storage), the GC pacer measures the
+     * allocation since a cycle with it.
+     * */
+    size_t objectBytesAllocated = 0;
+
+    /**
+     * Storage of the objects outside of the heap (e.g. array items).
+     * */
+    size_t externalBytes = 0;
+
+    std::atomic<size_t> largeObjectsBytes{0};
+
+    std::atomic<size_t> largeObjectsCount{0};
+
+    std::array<SizeClass, HEAP_SIZE_CLASSES> sizeClasses{};
+
+    /**
+     * Large objects in allocation (intrusive list).
+     * */
+    LargeObject *largeObjects = nullptr;
+
+    /**
+     * Mark bit of new objects: set while a GC cycle is in progress (allocate black).
+     * */
+    bool allocationMark = false;
+
+    /**
+     * Allocations per object type (for the GC telemetry).
+     * */
+    std::array<AllocationCounter, HEAP_MAX_OBJECT_TYPES> allocations{};
+
+private:
+    static Page *pageOf(void *object) {
+        return (Page *) ((uintptr_t) object & ~((uintptr_t) HEAP_PAGE_SIZE - 1));
+    }
+
+    Page *allocatePage(size_t sizeClass) {
+        auto memory = std::aligned_alloc(HEAP_PAGE_SIZE, HEAP_PAGE_SIZE);
+        if (memory == nullptr) {
+            throw std::bad_alloc();
+        }
+        bytesAllocated += HEAP_PAGE_SIZE;
+        return new(memory) Page(sizeClass, (sizeClass + 1) * HEAP_SIZE_CLASS_STEP);
+    }
+
+    void releasePage(Page *page) {
+        bytesAllocated -= HEAP_PAGE_SIZE;
+        page->~Page();
+        std::free(page);
+    }
+};
+
+thread_local Heap *Heap::current = nullptr;
+
+#endif
@@ -0,0 +1,176 @@
+#ifndef EVA_VM_HEAPPROFILER_H
+#define EVA_VM_HEAPPROFILER_H
+
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <ostream>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+
+/**
+ * Default mean distance (in bytes) between two samples.
+ * */
+#define HEAP_PROFILE_RATE (32 * 1024)
+
+/**
+ * Allocations attributed to one allocation site (call stack).
+ *
+ * Bytes and objects are estimates: each sample is scaled
+ * by the inverse of its probability of being sampled.
+ * */
+struct AllocationSite {
+    double totalBytes = 0;
+
+    double totalObjects = 0;
+
+    double liveBytes = 0;
+
+    double liveObjects = 0;
+};
+
+/**
+ * Sampling heap profiler.
+ *
+ * Allocations are sampled on average once every `rate` bytes: the
+ * distance to the next sample is random (uniform in [1, 2 * rate]), so
+ * periodic allocation patterns don't skew the profile. An object is
+ * sampled with probability ~size / rate, and so stands for `rate` bytes
+ * (or its own size if larger). A sampled object records the stack of the
+ * allocating code, and stays accounted as live until it's freed.
+ *
+ * When disabled, the allocation path only pays for one subtraction and
+ * a never-taken branch: the countdown starts at the maximum value.
+ * */
+struct HeapProfiler {
+    /**
+     * Returns the current stack, as `;`-separated frames (root first).
+     * */
+    using StackProvider = std::function<std::string()>;
+
+    /**
+     * Starts sampling the allocations of this thread (the VM running there).
+     * */
+    static void start(size_t sampleRate, StackProvider stack) {
+        rate = sampleRate;
+        stackTrace = std::move(stack);
+        bytesUntilSample = nextSample();
+    }
+
+    /**
+     * Records a sampled allocation (called once the countdown
+     * is over), and draws the distance to the next one.
+     * */
+    static void sample(const void *object, size_t size) {
+        bytesUntilSample = nextSample();
+
+        auto weight = (double) std::max(size, rate);
+
+        std::lock_guard<std::mutex> guard(lock);
+        auto &site = sites[stackTrace()];
+        site.totalBytes += weight;
+        site.totalObjects += weight / size;
+        site.liveBytes += weight;
+        site.liveObjects += weight / size;
+
+        samples[object] = Sample{&site, weight, weight / size};
+    }
+
+    /**
+     * Sampled object is freed (may be called by the background sweeper).
+     * */
+    static void free(const void *object) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = samples.find(object);
+        if (it == samples.end()) {
+            return;
+        }
+        it->second.site->liveBytes -= it->second.bytes;
+        it->second.site->liveObjects -= it->second.objects;
+        samples.erase(it);
+    }
+
+    /**
+     * Sampled object is relocated by the compaction.
+     * */
+    static void move(const void *from, const void *to) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = samples.find(from);
+        if (it == samples.end()) {
+            return;
+        }
+        samples[to] = it->second;
+        samples.erase(it);
+    }
+
+    /**
+     * Writes the profile in the collapsed stack format (one
+     * `frame;frame;frame bytes` line per site), e.g. for flamegraph.pl
+     * or `pprof -collapsed`. Live bytes if `live` is set, otherwise
+     * all the bytes allocated.
+     * */
+    static void writeCollapsed(std::ostream &out, bool live) {
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto &entry: sites) {
+            auto bytes = live ? entry.second.liveBytes : entry.second.totalBytes;
+            if (bytes >= 1) {
+                out << entry.first << " " << (uint64_t) bytes << "\n";
+            }
+        }
+    }
+
+    /**
+     * Bytes to allocate before the next sample (decremented on each
+     * allocation). Per thread, as the VMs allocate in parallel.
+     * */
+    static thread_local int64_t bytesUntilSample;
+
+private:
+    struct Sample {
+        AllocationSite *site;
+
+        double bytes;
+
+        double objects;
+    };
+
+    static int64_t nextSample() {
+        // xorshift64: <random> can't be used here, it pulls in <cmath>
+        // which conflicts with the `log` macro (Logger.h).
+        static thread_local uint64_t state = 0x9E3779B97F4A7C15ull ^ (uint64_t) &state;
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return (int64_t) (state % (2 * rate)) + 1;
+    }
+
+    static size_t rate;
+
+    static thread_local StackProvider stackTrace;
+
+    /**
+     * Protects the sites and samples: objects
+     * are also freed by the background sweeper.
+     * */
+    static std::mutex lock;
+
+    static std::unordered_map<std::string, AllocationSite> sites;
+
+    static std::unordered_map<const void *, Sample> samples;
+};
+
+thread_local int64_t HeapProfiler::bytesUntilSample{std::numeric_limits<int64_t>::max()};
+
+size_t HeapProfiler::rate{HEAP_PROFILE_RATE};
+
+thread_local HeapProfiler::StackProvider HeapProfiler::stackTrace{};
+
+std::mutex HeapProfiler::lock{};
+
+std::unordered_map<std::string, AllocationSite> HeapProfiler::sites{};
+
+std::unordered_map<const void *, HeapProfiler::Sample> HeapProfiler::samples{};
+
+#endif
@@ -0,0 +1,267 @@
+#ifndef EVA_VM_HEAPSNAPSHOT_H
+#define EVA_VM_HEAPSNAPSHOT_H
+
+#include <deque>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include "../vm/EvaValue.h"
+
+/**
+ * Max length of a string object value shown as the node name.
+ * */
+#define HEAP_SNAPSHOT_NAME_LENGTH 40
+
+/**
+ * Heap snapshot: the object graph reachable from the roots.
+ *
+ * Text format, one record per line (names and labels take
+ * the rest of the line, newlines are escaped):
+ *
+ *   eva-heap-snapshot 1
+ *   r <to> <label>                   root
+ *   n <id> <type> <size> <name>      object (node)
+ *   e <from> <to> <label>            reference (edge)
+ *
+ * Ids are assigned in the traversal order. The size is the object's
+ * own memory: heap cell, plus the out-of-line strings, vectors and maps
+ * (estimated). The name is the class name of instances, the function
+ * name of functions and code, the value of strings.
+ *
+ * Uses its own visited set (not the mark bits), so it can
+ * be taken at any point, also in the middle of a GC cycle.
+ * */
+struct HeapSnapshot {
+    explicit HeapSnapshot(std::ostream &out) : out(out) {
+        out << "eva-heap-snapshot 1\n";
+    }
+
+    /**
+     * Adds a root.
+     * */
+    void addRoot(const std::string &label, const EvaValue &value) {
+        if (IS_OBJECT(value)) {
+            addRoot(label, (Traceable *) value.object);
+        }
+    }
+
+    void addRoot(const std::string &label, Traceable *object) {
+        if (object != nullptr) {
+            out << "r " << idOf(object) << " " << escape(label) << "\n";
+        }
+    }
+
+    /**
+     * Writes all the objects reachable from the roots added so far,
+     * returns the number of objects written.
+     * */
+    size_t write() {
+        while (!queue.empty()) {
+            auto object = queue.front();
+            queue.pop_front();
+            writeObject(object);
+        }
+        return ids.size();
+    }
+
+private:
+    void writeObject(Traceable *object) {
+        auto id = ids[object];
+        auto type = ((Object *) object)->type;
+
+        out << "n " << id << " " << objectTypeName(type) << " " << sizeOf(object) << " ";
+
+        switch (type) {
+            case ObjectType::STRING: {
+                auto &string = ((StringObject *) object)->string;
+                out << escape(string.substr(0, HEAP_SNAPSHOT_NAME_LENGTH)) << "\n";
+                break;
+            }
+            case ObjectType::CODE: {
+                auto code = (CodeObject *) object;
+                out << escape(code->name) << "\n";
+                for (size_t i = 0; i < code->constants.size(); i++) {
+                    edge(id, code->constants[i], "constant[" + std::to_string(i) + "]");
+                }
+                break;
+            }
+            case ObjectType::NATIVE:
+                out << escape(((NativeObject *) object)->name) << "\n";
+                break;
+            case ObjectType::FUNCTION: {
+                auto function = (FunctionObject *) object;
+                out << escape(function->co->name) << "\n";
+                edge(id, function->co, "code");
+                auto &cellNames = function->co->cellNames;
+                for (size_t i = 0; i < function->cells.size(); i++) {
+                    edge(id, function->cells[i], i < cellNames.size() ? cellNames[i] : "cell[" + std::to_string(i) + "]");
+                }
+                break;
+            }
+            case ObjectType::CELL:
+                out << "\n";
+                edge(id, ((CellObject *) object)->value, "value");
+                break;
+            case ObjectType::CLASS: {
+                auto cls = (ClassObject *) object;
+                out << escape(cls->name) << "\n";
+                edge(id, cls->superClass, "super");
+                for (auto &prop: cls->properties) {
+                    edge(id, prop.second, prop.first);
+                }
+                break;
+            }
+            case ObjectType::INSTANCE: {
+                auto instance = (InstanceObject *) object;
+                out << escape(instance->cls->name) << "\n";
+                edge(id, instance->cls, "class");
+                for (auto &prop: instance->properties) {
+                    edge(id, prop.second, prop.first);
+                }
+                break;
+            }
+            case ObjectType::COROUTINE: {
+                auto coroutine = (CoroutineObject *) object;
+                out << escape(coroutine->function->co->name) << "\n";
+                edge(id, coroutine->function, "function");
+                for (auto slot = coroutine->stackBase; slot != coroutine->sp; slot++) {
+                    edge(id, *slot, "stack[" + std::to_string(slot - coroutine->stackBase) + "]");
+                }
+                for (size_t i = 0; i < coroutine->callStack.size(); i++) {
+                    edge(id, coroutine->callStack[i].fn, "frame[" + std::to_string(i) + "]");
+                }
+                edge(id, coroutine->fn, "fn");
+                edge(id, coroutine->resumer, "resumer");
+                break;
+            }
+            case ObjectType::CHANNEL:
+            case ObjectType::FLOAT64_ARRAY:
+                out << "\n";
+                break;
+            case ObjectType::ARRAY: {
+                out << "\n";
+                auto &items = ((ArrayObject *) object)->items;
+                for (size_t i = 0; i < items.size(); i++) {
+                    edge(id, items[i], "[" + std::to_string(i) + "]");
+                }
+                break;
+            }
+            case ObjectType::MAP:
+                out << "\n";
+                ((MapObject *) object)->forEach([&](const EvaValue &key, const EvaValue &value) {
+                    edge(id, key, "key");
+                    edge(id, value, "{" + evaValueToConstantString(key) + "}");
+                });
+                break;
+        }
+    }
+
+    void edge(size_t from, const EvaValue &value, const std::string &label) {
+        if (IS_OBJECT(value)) {
+            edge(from, (Traceable *) value.object, label);
+        }
+    }
+
+    void edge(size_t from, Traceable *to, const std::string &label) {
+        if (to != nullptr) {
+            out << "e " << from << " " << idOf(to) << " " << escape(label) << "\n";
+        }
+    }
+
+    /**
+     * Id of the object, new ones are queued for writing.
+     * */
+    size_t idOf(Traceable *object) {
+        auto it = ids.find(object);
+        if (it != ids.end()) {
+            return it->second;
+        }
+        auto id = ids.size() + 1;
+        ids[object] = id;
+        queue.push_back(object);
+        return id;
+    }
+
+    /**
+     * Own memory of the object (approximate for the containers).
+     * */
+    static size_t sizeOf(Traceable *object) {
+        // Node of a std::map<std::string, EvaValue> (tree links + color).
+        const size_t mapNode = 4 * sizeof(void *) + sizeof(std::string) + sizeof(EvaValue);
+
+        auto size = object->size();
+        switch (((Object *) object)->type) {
+            case ObjectType::STRING:
+                return size + outOfLine(((StringObject *) object)->string);
+            case ObjectType::CODE: {
+                auto code = (CodeObject *) object;
+                size += code->constants.capacity() * sizeof(EvaValue) + code->code.capacity() +
+                        code->locals.capacity() * sizeof(LocalVar) + code->cellNames.capacity() * sizeof(std::string);
+                return size + outOfLine(code->name);
+            }
+            case ObjectType::NATIVE:
+                return size + outOfLine(((NativeObject *) object)->name);
+            case ObjectType::FUNCTION:
+                return size + ((FunctionObject *) object)->cells.capacity() * sizeof(CellObject *);
+            case ObjectType::CELL:
+                return size;
+            case ObjectType::CLASS: {
+                auto cls = (ClassObject *) object;
+                for (auto &prop: cls->properties) {
+                    size += mapNode + outOfLine(prop.first);
+                }
+                return size + outOfLine(cls->name);
+            }
+            case ObjectType::INSTANCE:
+                for (auto &prop: ((InstanceObject *) object)->properties) {
+                    size += mapNode + outOfLine(prop.first);
+                }
+                return size;
+            case ObjectType::COROUTINE: {
+                auto coroutine = (CoroutineObject *) object;
+                return size + coroutine->stack.capacity() * sizeof(EvaValue) +
+                       coroutine->callStack.capacity() * sizeof(Frame);
+            }
+            case ObjectType::CHANNEL:
+                return size;
+            case ObjectType::ARRAY:
+                return size + ((ArrayObject *) object)->items.capacity() * sizeof(EvaValue);
+            case ObjectType::FLOAT64_ARRAY:
+                return size + ((Float64ArrayObject *) object)->items.capacity() * sizeof(double);
+            case ObjectType::MAP:
+                return size + ((MapObject *) object)->slots.capacity() * sizeof(MapObject::Slot);
+        }
+        return size;
+    }
+
+    /**
+     * Heap memory of the string (0 if stored inline, SSO).
+     * */
+    static size_t outOfLine(const std::string &string) {
+        auto data = (const char *) string.data();
+        auto self = (const char *) &string;
+        return data >= self && data < self + sizeof(std::string) ? 0 : string.capacity() + 1;
+    }
+
+    static std::string escape(const std::string &string) {
+        std::string escaped;
+        for (auto c: string) {
+            if (c == '\n') {
+                escaped += "\\n";
+            } else if (c == '\r') {
+                escaped += "\\r";
+            } else {
+                escaped += c;
+            }
+        }
+        return escaped;
+    }
+
+    std::ostream &out;
+
+    std::unordered_map<Traceable *, size_t> ids;
+
+    std::deque<Traceable *> queue;
+};
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef EVA_VM_HISTOGRAM_H
+#define EVA_VM_HISTOGRAM_H
+
+#include <array>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+/**
+ * Log2 histogram of durations in microseconds.
+ *
+ * Bucket N counts samples in [2^(N-1), 2^N) us,
+ * bucket 0 is everything below 1us.
+ * */
+struct Histogram {
+    static constexpr size_t BUCKETS = 32;
+
+    /**
+     * Records a sample.
+     * */
+    void record(uint64_t micros) {
+        size_t bucket = 0;
+        while (bucket < BUCKETS - 1 && micros >= (1ull << bucket)) {
+            bucket++;
+        }
+        buckets[bucket]++;
+        count++;
+        total += micros;
+        if (micros > max) {
+            max = micros;
+        }
+    }
+
+    /**
+     * Prints non-empty buckets.
+     * */
+    void print(const std::string &title) const {
+        std::cout << "------------------------------\n";
+        std::cout << title << ":\n\n";
+        std::cout << "Samples : " << std::dec << count << "\n";
+        std::cout << "Total   : " << total << "us\n";
+        std::cout << "Max     : " << max << "us\n\n";
+
+        if (count == 0) {
+            return;
+        }
+
+        for (size_t i = 0; i < BUCKETS; i++) {
+            if (buckets[i] == 0) {
+                continue;
+            }
+            auto from = i == 0 ? 0 : (1ull << (i - 1));
+            auto to = 1ull << i;
+            std::cout << std::right << std::setw(8) << from << " - " << std::left << std::setw(8) << to
+                      << "us : " << std::string(1 + buckets[i] * 40 / count, '#') << " " << buckets[i] << "\n";
+        }
+        std::cout << "\n";
+    }
+
+    /**
+     * Writes the histogram as a JSON object
+     * (buckets up to the last non-empty one).
+     * */
+    void writeJSON(std::ostream &out) const {
+        out << "{\"count\": " << count << ", \"totalMicros\": " << total
+            << ", \"maxMicros\": " << max << ", \"buckets\": [";
+
+        size_t used = BUCKETS;
+        while (used > 0 && buckets[used - 1] == 0) {
+            used--;
+        }
+        for (size_t i = 0; i < used; i++) {
+            out << (i == 0 ? "" : ", ") << buckets[i];
+        }
+        out << "]}";
+    }
+
+    std::array<uint64_t, BUCKETS> buckets{};
+
+    uint64_t count = 0;
+
+    uint64_t total = 0;
+
+    uint64_t max = 0;
+};
+
+#endif
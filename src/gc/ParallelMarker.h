@@ -0,0 +1,325 @@
+#ifndef EVA_VM_PARALLELMARKER_H
+#define EVA_VM_PARALLELMARKER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "../vm/EvaValue.h"
+
+/**
+ * Initial number of slots of a mark deque (a power of 2).
+ * */
+#define MARK_DEQUE_CAPACITY 1024
+
+/**
+ * Lock-free deque of grey objects owned by one marking thread
+ * (Chase-Lev work-stealing deque).
+ *
+ * The owner pushes and pops at the bottom (LIFO, keeps the traversal
+ * depth-first) with plain loads and stores; only taking the last item
+ * races with thieves. Thieves steal from the top with a CAS.
+ *
+ * A full deque grows into a buffer twice the size. The old buffers
+ * may still be read by a thief, so they are only freed by `reclaim`,
+ * while no marking is in progress.
+ * */
+struct MarkDeque {
+    MarkDeque() : buffer(new Buffer(MARK_DEQUE_CAPACITY)) {}
+
+    ~MarkDeque() {
+        reclaim();
+        delete buffer.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Owner: pushes a grey object.
+     * */
+    void push(Traceable *object) {
+        auto b = bottom.load(std::memory_order_relaxed);
+        auto t = top.load(std::memory_order_acquire);
+        auto slots = buffer.load(std::memory_order_relaxed);
+        if (b - t > (int64_t) slots->mask) {
+            slots = grow(slots, t, b);
+        }
+        slots->put(b, object);
+        bottom.store(b + 1, std::memory_order_release);
+    }
+
+    /**
+     * Owner: pops the last pushed object.
+     * */
+    bool pop(Traceable *&object) {
+        auto b = bottom.load(std::memory_order_relaxed) - 1;
+        auto slots = buffer.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto t = top.load(std::memory_order_relaxed);
+
+        if (t > b) {
+            // Empty.
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+        object = slots->get(b);
+        if (t == b) {
+            // The last item: a thief may be taking it too.
+            auto won = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                                   std::memory_order_relaxed);
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    /**
+     * Thief: takes the oldest object.
+     * */
+    bool steal(Traceable *&object) {
+        auto t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto b = bottom.load(std::memory_order_acquire);
+        if (t >= b) {
+            return false;
+        }
+        object = buffer.load(std::memory_order_acquire)->get(t);
+        return top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                           std::memory_order_relaxed);
+    }
+
+    bool empty() {
+        return bottom.load(std::memory_order_acquire) <= top.load(std::memory_order_acquire);
+    }
+
+    /**
+     * Frees the buffers outgrown during marking (no thief can be
+     * reading them once the marking threads are done).
+     * */
+    void reclaim() {
+        for (auto &slots: retired) {
+            delete slots;
+        }
+        retired.clear();
+    }
+
+private:
+    /**
+     * Circular array of slots, indexed by the (ever growing) positions.
+     * */
+    struct Buffer {
+        explicit Buffer(size_t capacity)
+                : mask(capacity - 1), slots(new std::atomic<Traceable *>[capacity]) {}
+
+        Traceable *get(int64_t i) { return slots[i & mask].load(std::memory_order_relaxed); }
+
+        void put(int64_t i, Traceable *object) { slots[i & mask].store(object, std::memory_order_relaxed); }
+
+        size_t mask;
+
+        std::unique_ptr<std::atomic<Traceable *>[]> slots;
+    };
+
+    Buffer *grow(Buffer *slots, int64_t t, int64_t b) {
+        auto grown = new Buffer((slots->mask + 1) * 2);
+        for (auto i = t; i < b; i++) {
+            grown->put(i, slots->get(i));
+        }
+        retired.push_back(slots);
+        buffer.store(grown, std::memory_order_release);
+        return grown;
+    }
+
+    /**
+     * Position of the oldest item (thieves), and past the newest one (owner).
+     * */
+    std::atomic<int64_t> top{0};
+
+    std::atomic<int64_t> bottom{0};
+
+    std::atomic<Buffer *> buffer;
+
+    /**
+     * Outgrown buffers (owner only).
+     * */
+    std::vector<Buffer *> retired;
+};
+
+/**
+ * Parallel marking: a pool of GC threads draining
+ * grey objects with work stealing.
+ *
+ * The calling thread takes part in marking as worker 0,
+ * so a marker of N threads spawns N - 1 helpers.
+ * */
+class ParallelMarker {
+public:
+    explicit ParallelMarker(size_t threadsCount) {
+        for (size_t i = 0; i < threadsCount; i++) {
+            deques.push_back(std::make_unique<MarkDeque>());
+        }
+        for (size_t i = 1; i < threadsCount; i++) {
+            threads.emplace_back([this, i]() { workerLoop(i); });
+        }
+    }
+
+    ~ParallelMarker() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wakeUp.notify_all();
+        for (auto &thread: threads) {
+            thread.join();
+        }
+    }
+
+    /**
+     * Traces everything reachable from the grey objects
+     * (already marked), leaving all of them black.
+     * */
+    void drain(std::vector<Traceable *> &grey) {
+        idle = 0;
+        for (auto &deque: deques) {
+            deque->reclaim();
+        }
+        for (size_t i = 0; i < grey.size(); i++) {
+            deques[i % deques.size()]->push(grey[i]);
+        }
+        grey.clear();
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            epoch++;
+            finished = 0;
+        }
+        wakeUp.notify_all();
+
+        work(0);
+
+        std::unique_lock<std::mutex> guard(lock);
+        allDone.wait(guard, [this]() { return finished == threads.size(); });
+    }
+
+    /**
+     * Number of marking threads (including the caller).
+     * */
+    size_t size() { return deques.size(); }
+
+    /**
+     * Atomically sets the mark bit, returns true
+     * if this thread is the one which marked it.
+     * */
+    static bool tryMark(Traceable *object) {
+        if (object->marked.load(std::memory_order_relaxed)) {
+            return false;
+        }
+        return !object->marked.exchange(true, std::memory_order_acq_rel);
+    }
+
+private:
+    /**
+     * Helper thread: waits for a new marking epoch and joins it.
+     * */
+    void workerLoop(size_t id) {
+        size_t seenEpoch = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                wakeUp.wait(guard, [&]() { return stopping || epoch != seenEpoch; });
+                if (stopping) {
+                    return;
+                }
+                seenEpoch = epoch;
+            }
+
+            work(id);
+
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                finished++;
+            }
+            allDone.notify_one();
+        }
+    }
+
+    /**
+     * Drains own deque, then steals from the others until
+     * there are no grey objects left anywhere.
+     *
+     * A thread out of work goes idle, and leaves it when it sees
+     * grey objects in some deque. Only a busy thread pushes (to its
+     * own deque), so once all the threads are idle, marking is complete.
+     * */
+    void work(size_t id) {
+        auto &own = *deques[id];
+        auto shadeChild = makeObjectVisitor([&own](Traceable *child) {
+            if (tryMark(child)) {
+                own.push(child);
+            }
+        });
+
+        for (;;) {
+            Traceable *object;
+            if (own.pop(object) || steal(id, object)) {
+                traceObject(object, shadeChild);
+                continue;
+            }
+
+            idle.fetch_add(1, std::memory_order_acq_rel);
+            for (;;) {
+                if (idle.load(std::memory_order_acquire) == deques.size()) {
+                    return;
+                }
+                if (hasWork()) {
+                    idle.fetch_sub(1, std::memory_order_acq_rel);
+                    break;
+                }
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    bool hasWork() {
+        for (auto &deque: deques) {
+            if (!deque->empty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool steal(size_t id, Traceable *&object) {
+        for (size_t i = 1; i < deques.size(); i++) {
+            if (deques[(id + i) % deques.size()]->steal(object)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::vector<std::unique_ptr<MarkDeque>> deques;
+
+    std::vector<std::thread> threads;
+
+    /**
+     * Marking threads out of work.
+     * */
+    std::atomic<size_t> idle{0};
+
+    std::mutex lock;
+
+    std::condition_variable wakeUp;
+
+    std::condition_variable allDone;
+
+    size_t epoch = 0;
+
+    size_t finished = 0;
+
+    bool stopping = false;
+};
+
+#endif
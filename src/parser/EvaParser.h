@@ -90,6 +90,16 @@ struct Exp {
   // Lists:
   Exp(std::vector<Exp> list) : type(ExpType::LIST), list(list) {}
 
+  // Source location (of the opening paren for lists), 0 if unknown:
+  int line = 0;
+  int column = 0;
+
+  Exp& at(int line, int column) {
+    this->line = line;
+    this->column = column;
+    return *this;
+  }
+
 };
 
 using Value = Exp;  // clang-format on
@@ -542,6 +552,13 @@ class EvaParser {
    */
   int previousState;
 
+  /**
+   * Location of the last shifted token, for the semantic actions.
+   */
+  int yylineno = 0;
+
+  int yycolumn = 0;
+
   /**
    * Parses a string.
    */
@@ -593,6 +610,8 @@ class EvaParser {
         auto production = productions_[productionNumber];
 
         tokenizer.yytext = shiftedToken->value;
+        yylineno = shiftedToken->startLine;
+        yycolumn = shiftedToken->startColumn;
 
         auto rhsLength = production.rhsLength;
         while (rhsLength > 0) {
@@ -702,7 +721,7 @@ void _handler4(yyparse& parser) {
 // Semantic action prologue.
 auto _1 = POP_T();
 
-auto __ = Exp(std::stoi(_1)) ;
+auto __ = Exp(std::stoi(_1)).at(parser.yylineno, parser.yycolumn) ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -713,7 +732,7 @@ void _handler5(yyparse& parser) {
 // Semantic action prologue.
 auto _1 = POP_T();
 
-auto __ = Exp(_1) ;
+auto __ = Exp(_1).at(parser.yylineno, parser.yycolumn) ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -724,7 +743,7 @@ void _handler6(yyparse& parser) {
 // Semantic action prologue.
 auto _1 = POP_T();
 
-auto __ = Exp(_1) ;
+auto __ = Exp(_1).at(parser.yylineno, parser.yycolumn) ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -748,7 +767,7 @@ void _handler8(yyparse& parser) {
 // Semantic action prologue.
 
 
-auto __ = Exp(std::vector<Exp>{}) ;
+auto __ = Exp(std::vector<Exp>{}).at(parser.yylineno, parser.yycolumn) ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -0,0 +1,749 @@
+#ifndef EVA_VM_EVAACTORS_H
+#define EVA_VM_EVAACTORS_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "./EvaValue.h"
+#include "./Global.h"
+#include "./Logger.h"
+
+/**
+ * Max number of jumps and calls an actor runs before
+ * giving way to the other ready actors of its worker.
+ * */
+#define ACTOR_TIME_SLICE 10000
+
+/**
+ * How often a thread waiting on a channel checks whether an actor failed (ms).
+ * */
+#define ACTOR_FAILURE_POLL_MS 20
+
+class EvaVM;
+
+/**
+ * Values copied out of a VM heap, to be created in another one: a
+ * heap-neutral graph of nodes, in which shared objects (and cycles)
+ * stay shared.
+ *
+ * Code objects are frozen (see EvaProgram), so they're referenced as
+ * is, natives by name (all the VMs have the same ones), and channels
+ * are shared. Coroutines can't be copied.
+ * */
+struct Message {
+    static constexpr size_t NO_NODE = std::numeric_limits<size_t>::max();
+
+    /**
+     * Copied value: numbers and booleans as is, objects as nodes.
+     * */
+    struct Slot {
+        EvaValue value;
+
+        size_t node;
+    };
+
+    struct Node {
+        ObjectType type;
+
+        /* String value, class or native name */
+        std::string string;
+
+        /* Code of a function */
+        CodeObject *co = nullptr;
+
+        /* Cells of a function, class of an instance, super class of a class */
+        std::vector<size_t> refs;
+
+        /* Properties of a class or instance, the value of a cell (no name) */
+        std::vector<std::pair<std::string, Slot>> properties;
+
+        /* Elements of an array (keys and values of a map, in pairs), or of a typed one */
+        std::vector<Slot> items;
+
+        std::vector<double> numbers;
+
+        std::shared_ptr<Channel> channel;
+    };
+
+    /**
+     * Copies the values (of the current VM heap).
+     * */
+    static Message copy(const std::vector<EvaValue> &values) {
+        Message message;
+        std::unordered_map<Object *, size_t> nodes;
+        std::vector<Object *> objects;
+
+        auto slotOf = [&](const EvaValue &value) -> Slot {
+            if (!IS_OBJECT(value)) {
+                return {value, NO_NODE};
+            }
+            auto it = nodes.find(value.object);
+            if (it != nodes.end()) {
+                return {value, it->second};
+            }
+            nodes[value.object] = objects.size();
+            objects.push_back(value.object);
+            return {value, objects.size() - 1};
+        };
+        auto nodeOf = [&](Object *object) {
+            return object == nullptr ? NO_NODE : slotOf(OBJECT(object)).node;
+        };
+
+        for (auto &value: values) {
+            message.roots.push_back(slotOf(value));
+        }
+
+        // New objects are queued by slotOf.
+        for (size_t i = 0; i < objects.size(); i++) {
+            auto object = objects[i];
+            Node node;
+            node.type = object->type;
+
+            switch (object->type) {
+                case ObjectType::STRING:
+                    node.string = ((StringObject *) object)->string;
+                    break;
+                case ObjectType::CODE:
+                    node.co = (CodeObject *) object;
+                    break;
+                case ObjectType::NATIVE:
+                    node.string = ((NativeObject *) object)->name;
+                    break;
+                case ObjectType::FUNCTION: {
+                    auto function = (FunctionObject *) object;
+                    node.co = function->co;
+                    for (auto cell: function->cells) {
+                        node.refs.push_back(nodeOf(cell));
+                    }
+                    break;
+                }
+                case ObjectType::CELL:
+                    node.properties.push_back({"", slotOf(((CellObject *) object)->value)});
+                    break;
+                case ObjectType::CLASS: {
+                    auto cls = (ClassObject *) object;
+                    node.string = cls->name;
+                    node.refs.push_back(nodeOf(cls->superClass));
+                    for (auto &prop: cls->properties) {
+                        node.properties.push_back({prop.first, slotOf(prop.second)});
+                    }
+                    break;
+                }
+                case ObjectType::INSTANCE: {
+                    auto instance = (InstanceObject *) object;
+                    node.refs.push_back(nodeOf(instance->cls));
+                    for (auto &prop: instance->properties) {
+                        node.properties.push_back({prop.first, slotOf(prop.second)});
+                    }
+                    break;
+                }
+                case ObjectType::CHANNEL:
+                    node.channel = ((ChannelObject *) object)->channel;
+                    break;
+                case ObjectType::ARRAY:
+                    for (auto &item: ((ArrayObject *) object)->items) {
+                        node.items.push_back(slotOf(item));
+                    }
+                    break;
+                case ObjectType::FLOAT64_ARRAY:
+                    node.numbers = ((Float64ArrayObject *) object)->items;
+                    break;
+                case ObjectType::MAP:
+                    ((MapObject *) object)->forEach([&](const EvaValue &key, const EvaValue &value) {
+                        node.items.push_back(slotOf(key));
+                        node.items.push_back(slotOf(value));
+                    });
+                    break;
+                case ObjectType::COROUTINE:
+                    DIE << "can't copy the coroutine " << ((CoroutineObject *) object)->function->co->name
+                        << " to another actor";
+            }
+
+            message.nodes.push_back(std::move(node));
+        }
+        return message;
+    }
+
+    /**
+     * Creates the values in the current heap, natives are taken from
+     * the globals. No GC happens here (the objects are not rooted yet).
+     * */
+    std::vector<EvaValue> create(Global &globals) const {
+        std::vector<Object *> objects(nodes.size());
+        for (size_t i = 0; i < nodes.size(); i++) {
+            auto &node = nodes[i];
+            switch (node.type) {
+                case ObjectType::STRING:
+                    objects[i] = AS_OBJECT(ALLOC_STRING(node.string));
+                    break;
+                case ObjectType::CODE:
+                    objects[i] = node.co;
+                    break;
+                case ObjectType::NATIVE: {
+                    auto index = globals.getGlobalIndex(node.string);
+                    if (index == -1) {
+                        DIE << "no native " << node.string << " in the actor";
+                    }
+                    objects[i] = AS_OBJECT(globals.get(index).value);
+                    break;
+                }
+                case ObjectType::FUNCTION:
+                    objects[i] = AS_OBJECT(ALLOC_FUNCTION(node.co));
+                    break;
+                case ObjectType::CELL:
+                    objects[i] = AS_OBJECT(ALLOC_CELL(BOOLEAN(false)));
+                    break;
+                case ObjectType::CLASS:
+                    objects[i] = AS_OBJECT(ALLOC_CLASS(node.string, nullptr));
+                    break;
+                case ObjectType::INSTANCE:
+                    objects[i] = AS_OBJECT(ALLOC_INSTANCE(nullptr));
+                    break;
+                case ObjectType::CHANNEL:
+                    objects[i] = AS_OBJECT(ALLOC_CHANNEL(node.channel));
+                    break;
+                case ObjectType::ARRAY:
+                    objects[i] = AS_OBJECT(ALLOC_ARRAY(std::vector<EvaValue>(node.items.size())));
+                    break;
+                case ObjectType::FLOAT64_ARRAY:
+                    objects[i] = AS_OBJECT(ALLOC_FLOAT64_ARRAY(node.numbers));
+                    break;
+                case ObjectType::MAP:
+                    objects[i] = AS_OBJECT(ALLOC_MAP());
+                    ((MapObject *) objects[i])->reserve(node.items.size() / 2);
+                    break;
+                case ObjectType::COROUTINE:
+                    break;
+            }
+        }
+
+        auto valueOf = [&objects](const Slot &slot) {
+            return slot.node == NO_NODE ? slot.value : OBJECT(objects[slot.node]);
+        };
+        auto objectOf = [&objects](size_t node) {
+            return node == NO_NODE ? nullptr : objects[node];
+        };
+
+        // Links the objects.
+        for (size_t i = 0; i < nodes.size(); i++) {
+            auto &node = nodes[i];
+            switch (node.type) {
+                case ObjectType::FUNCTION:
+                    for (auto cell: node.refs) {
+                        ((FunctionObject *) objects[i])->cells.push_back((CellObject *) objectOf(cell));
+                    }
+                    break;
+                case ObjectType::CELL:
+                    ((CellObject *) objects[i])->value = valueOf(node.properties[0].second);
+                    break;
+                case ObjectType::CLASS: {
+                    auto cls = (ClassObject *) objects[i];
+                    cls->superClass = (ClassObject *) objectOf(node.refs[0]);
+                    for (auto &prop: node.properties) {
+                        cls->properties[prop.first] = valueOf(prop.second);
+                    }
+                    break;
+                }
+                case ObjectType::INSTANCE: {
+                    auto instance = (InstanceObject *) objects[i];
+                    instance->cls = (ClassObject *) objectOf(node.refs[0]);
+                    for (auto &prop: node.properties) {
+                        instance->properties[prop.first] = valueOf(prop.second);
+                    }
+                    break;
+                }
+                case ObjectType::ARRAY: {
+                    auto &items = ((ArrayObject *) objects[i])->items;
+                    for (size_t k = 0; k < node.items.size(); k++) {
+                        items[k] = valueOf(node.items[k]);
+                    }
+                    break;
+                }
+                case ObjectType::MAP: {
+                    auto map = (MapObject *) objects[i];
+                    for (size_t k = 0; k < node.items.size(); k += 2) {
+                        map->set(valueOf(node.items[k]), valueOf(node.items[k + 1]));
+                    }
+                    break;
+                }
+                default:
+                    break;
+            }
+        }
+
+        std::vector<EvaValue> values;
+        for (auto &root: roots) {
+            values.push_back(valueOf(root));
+        }
+        return values;
+    }
+
+    /**
+     * Copied values.
+     * */
+    std::vector<Slot> roots;
+
+    std::vector<Node> nodes;
+};
+
+/**
+ * Why the actor's run returned.
+ * */
+enum class ActorExit {
+    /* Its function returned */
+    DONE,
+    /* Waits for a channel, until woken up */
+    PARKED,
+    /* Its time slice is over */
+    PREEMPTED
+};
+
+enum class ActorState {
+    READY,
+    RUNNING,
+    PARKED
+};
+
+class ActorScheduler;
+
+/**
+ * Actor: a function run by its own VM (with its own heap and globals),
+ * in time slices, on the worker threads of the scheduler. Actors only
+ * share the channels.
+ * */
+struct Actor : public std::enable_shared_from_this<Actor> {
+    /**
+     * Runs the actor until it's done, parks or is preempted.
+     * */
+    std::function<ActorExit()> run;
+
+    std::shared_ptr<EvaVM> vm;
+
+    ActorScheduler *scheduler = nullptr;
+
+    /**
+     * Handed over on the wake up: the start message (the function and
+     * the globals), or the received one; none once a send is complete.
+     * */
+    Message inbox;
+
+    bool received = false;
+
+    /**
+     * Makes the parked actor ready again.
+     * */
+    void wake();
+
+    std::mutex lock;
+
+    ActorState state = ActorState::READY;
+
+    /**
+     * Woken up while still running (before it left the worker).
+     * */
+    bool wakePending = false;
+
+    /**
+     * Dropped by the scheduler, never runs again.
+     * */
+    bool cancelled = false;
+};
+
+/**
+ * Run queue of one worker: the owner takes actors from the front,
+ * thieves steal from the back.
+ * */
+struct ActorDeque {
+    void push(std::shared_ptr<Actor> actor) {
+        std::lock_guard<std::mutex> guard(lock);
+        items.push_back(std::move(actor));
+    }
+
+    bool pop(std::shared_ptr<Actor> &actor) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (items.empty()) {
+            return false;
+        }
+        actor = std::move(items.front());
+        items.pop_front();
+        return true;
+    }
+
+    bool steal(std::shared_ptr<Actor> &actor) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (items.empty()) {
+            return false;
+        }
+        actor = std::move(items.back());
+        items.pop_back();
+        return true;
+    }
+
+    std::mutex lock;
+
+    std::deque<std::shared_ptr<Actor>> items;
+};
+
+/**
+ * Runs the actors of a program on a pool of worker threads. Actors spawned or woken up by a worker are queued
+ * by it, idle workers steal from the others.
+ *
+ * Actors not done when the scheduler is destroyed are dropped: the
+ * running ones are stopped at the end of their time slice.
+ *
+ * An actor failing (DIE) is cancelled, and its error kept for the VM
+ * which runs the program to raise (see EvaVM::checkActors).
+ * */
+class ActorScheduler {
+public:
+    explicit ActorScheduler(size_t threadsCount) {
+        threadsCount = std::max<size_t>(threadsCount, 1);
+        for (size_t i = 0; i < threadsCount; i++) {
+            deques.push_back(std::make_unique<ActorDeque>());
+        }
+        for (size_t i = 0; i < threadsCount; i++) {
+            threads.emplace_back([this, i]() { workerLoop(i); });
+        }
+    }
+
+    ~ActorScheduler() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wakeUp.notify_all();
+        for (auto &thread: threads) {
+            thread.join();
+        }
+
+        // Parked actors may be in the waiting lists of the channels,
+        // which are kept by the heaps (theirs, or the ones of others).
+        auto dropped = std::move(actors);
+        for (auto &entry: dropped) {
+            std::lock_guard<std::mutex> guard(entry.second->lock);
+            entry.second->cancelled = true;
+        }
+        deques.clear();
+        for (auto &entry: dropped) {
+            entry.second->vm = nullptr;
+        }
+    }
+
+    ActorScheduler(const ActorScheduler &) = delete;
+
+    ActorScheduler &operator=(const ActorScheduler &) = delete;
+
+    /**
+     * Starts a new actor.
+     * */
+    void spawn(const std::shared_ptr<Actor> &actor) {
+        actor->scheduler = this;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            actors[actor.get()] = actor;
+            spawned++;
+        }
+        enqueue(actor);
+    }
+
+    /**
+     * Queues the parked actor (if it's still running, once it parks).
+     * */
+    void wake(const std::shared_ptr<Actor> &actor) {
+        {
+            std::lock_guard<std::mutex> guard(actor->lock);
+            if (actor->cancelled) {
+                return;
+            }
+            if (actor->state == ActorState::RUNNING) {
+                actor->wakePending = true;
+                return;
+            }
+            actor->state = ActorState::READY;
+        }
+        enqueue(actor);
+    }
+
+    /**
+     * Actors started, and stolen by idle workers.
+     * */
+    size_t spawned = 0;
+
+    std::atomic<size_t> steals{0};
+
+    /**
+     * Whether an actor failed, and the error of the first one (set once).
+     * */
+    std::atomic<bool> failed{false};
+
+    std::string error;
+
+private:
+    void enqueue(const std::shared_ptr<Actor> &actor) {
+        auto worker = currentScheduler == this ? currentWorker : nextWorker++ % deques.size();
+        deques[worker]->push(actor);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            ready++;
+        }
+        wakeUp.notify_one();
+    }
+
+    /**
+     * Worker thread: runs its actors, then steals, sleeps when none is ready.
+     * */
+    void workerLoop(size_t id) {
+        currentScheduler = this;
+        currentWorker = id;
+
+        for (;;) {
+            std::shared_ptr<Actor> actor;
+            if (!take(id, actor)) {
+                std::unique_lock<std::mutex> guard(lock);
+                wakeUp.wait(guard, [this]() { return stopping || ready != 0; });
+                if (stopping) {
+                    return;
+                }
+                continue;
+            }
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                ready--;
+                if (stopping) {
+                    return;
+                }
+            }
+
+            {
+                std::lock_guard<std::mutex> guard(actor->lock);
+                actor->state = ActorState::RUNNING;
+            }
+
+            ActorExit exit;
+            auto error = recover([&]() { exit = actor->run(); });
+            if (!error.empty()) {
+                fail(actor, error);
+                continue;
+            }
+
+            if (exit == ActorExit::DONE) {
+                // The VM is released here, by the worker.
+                actor->vm = nullptr;
+                std::lock_guard<std::mutex> guard(lock);
+                actors.erase(actor.get());
+                continue;
+            }
+
+            {
+                std::lock_guard<std::mutex> guard(actor->lock);
+                if (exit == ActorExit::PARKED && !actor->wakePending) {
+                    actor->state = ActorState::PARKED;
+                    continue;
+                }
+                actor->wakePending = false;
+                actor->state = ActorState::READY;
+            }
+            enqueue(actor);
+        }
+    }
+
+    /**
+     * Cancels the actor which failed with the error.
+     * */
+    void fail(const std::shared_ptr<Actor> &actor, std::string &message) {
+        {
+            std::lock_guard<std::mutex> guard(actor->lock);
+            actor->cancelled = true;
+        }
+        actor->vm = nullptr;
+
+        std::lock_guard<std::mutex> guard(lock);
+        actors.erase(actor.get());
+        if (!failed.load()) {
+            error = std::move(message);
+            failed.store(true);
+        }
+    }
+
+    bool take(size_t id, std::shared_ptr<Actor> &actor) {
+        if (deques[id]->pop(actor)) {
+            return true;
+        }
+        for (size_t i = 1; i < deques.size(); i++) {
+            if (deques[(id + i) % deques.size()]->steal(actor)) {
+                steals++;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::vector<std::unique_ptr<ActorDeque>> deques;
+
+    std::vector<std::thread> threads;
+
+    /**
+     * Actors not done yet.
+     * */
+    std::unordered_map<Actor *, std::shared_ptr<Actor>> actors;
+
+    /**
+     * Number of queued actors.
+     * */
+    size_t ready = 0;
+
+    std::atomic<size_t> nextWorker{0};
+
+    bool stopping = false;
+
+    std::mutex lock;
+
+    std::condition_variable wakeUp;
+
+    /**
+     * Scheduler and worker of the current thread.
+     * */
+    static thread_local ActorScheduler *currentScheduler;
+
+    static thread_local size_t currentWorker;
+};
+
+thread_local ActorScheduler *ActorScheduler::currentScheduler = nullptr;
+
+thread_local size_t ActorScheduler::currentWorker = 0;
+
+void Actor::wake() {
+    {
+        // The scheduler may be gone.
+        std::lock_guard<std::mutex> guard(lock);
+        if (cancelled) {
+            return;
+        }
+    }
+    scheduler->wake(shared_from_this());
+}
+
+/**
+ * Bounded channel of messages: values copied out of the sender's heap,
+ * created in the receiver's one.
+ *
+ * An actor which can't send (full) or receive (empty) parks, and is
+ * woken up by the receive or send completing it. Other threads (the
+ * main program) wait, unless an actor failed (the `abort` flag).
+ * */
+struct Channel {
+    explicit Channel(size_t capacity) : capacity(capacity) {}
+
+    /**
+     * Sends the message. Returns false if the sending actor has to
+     * park: the message is taken by a receiver later (or if a waiting
+     * thread gave up, an actor having failed).
+     * */
+    bool send(Message &message, Actor *sender, const std::atomic<bool> *abort = nullptr) {
+        std::unique_lock<std::mutex> guard(lock);
+        for (;;) {
+            if (!receivers.empty()) {
+                auto receiver = std::move(receivers.front());
+                receivers.pop_front();
+                receiver->inbox = std::move(message);
+                receiver->received = true;
+                guard.unlock();
+                receiver->wake();
+                return true;
+            }
+            if (items.size() < capacity) {
+                items.push_back(std::move(message));
+                changed.notify_all();
+                return true;
+            }
+            if (sender != nullptr) {
+                senders.emplace_back(sender->shared_from_this(), std::move(message));
+                return false;
+            }
+            if (!waitForChange(guard, abort)) {
+                return false;
+            }
+        }
+    }
+
+    /**
+     * Receives a message. Returns false if the receiving actor
+     * has to park: a sender hands the message over later (or
+     * if a waiting thread gave up, as for send).
+     * */
+    bool receive(Message &message, Actor *receiver, const std::atomic<bool> *abort = nullptr) {
+        std::unique_lock<std::mutex> guard(lock);
+        for (;;) {
+            if (!items.empty()) {
+                message = std::move(items.front());
+                items.pop_front();
+                changed.notify_all();
+
+                // Room for a waiting sender.
+                if (!senders.empty()) {
+                    auto sender = std::move(senders.front());
+                    senders.pop_front();
+                    items.push_back(std::move(sender.second));
+                    sender.first->received = false;
+                    guard.unlock();
+                    sender.first->wake();
+                }
+                return true;
+            }
+            if (receiver != nullptr) {
+                receivers.push_back(receiver->shared_from_this());
+                return false;
+            }
+            if (!waitForChange(guard, abort)) {
+                return false;
+            }
+        }
+    }
+
+    /**
+     * Waits (a thread) for the channel to change, returns false
+     * if the abort flag is set: the change may never come.
+     * */
+    bool waitForChange(std::unique_lock<std::mutex> &guard, const std::atomic<bool> *abort) {
+        if (abort == nullptr) {
+            changed.wait(guard);
+            return true;
+        }
+        if (abort->load()) {
+            return false;
+        }
+        changed.wait_for(guard, std::chrono::milliseconds(ACTOR_FAILURE_POLL_MS));
+        return true;
+    }
+
+    size_t capacity;
+
+    std::mutex lock;
+
+    /**
+     * Signals the threads waiting (not the actors).
+     * */
+    std::condition_variable changed;
+
+    std::deque<Message> items;
+
+    /**
+     * Parked actors: receivers wait for a message, senders for room.
+     * */
+    std::deque<std::shared_ptr<Actor>> receivers;
+
+    std::deque<std::pair<std::shared_ptr<Actor>, Message>> senders;
+};
+
+#endif
@@ -0,0 +1,523 @@
+#ifndef EVA_VM_EVAEVENTLOOP_H
+#define EVA_VM_EVAEVENTLOOP_H
+
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "./EvaValue.h"
+#include "./Logger.h"
+
+extern char **environ;
+
+/**
+ * Result of an async operation: a number or a string, or an error.
+ * */
+struct AsyncResult {
+    double number = 0;
+
+    std::string text;
+
+    bool isText = false;
+
+    std::string error;
+};
+
+/**
+ * Completed operation, and the task waiting for it (null for the main program).
+ * */
+struct AsyncCompletion {
+    uint64_t id;
+
+    CoroutineObject *task;
+
+    AsyncResult result;
+};
+
+/**
+ * Event loop of a VM: non-blocking timers, pipes and file I/O.
+ *
+ * Timers (timerfd) and the pipes of commands are watched with epoll.
+ * Regular files can't be polled (they are always "ready", and reads
+ * block on the disk), so they are read and written by a worker thread,
+ * which signals the completions through an eventfd watched as well.
+ *
+ * Operations only hold C++ data (paths, buffers): the Eva values are
+ * created by the VM from the completions, on its own thread. Tasks
+ * waiting for operations are GC roots (see trace).
+ * */
+class EvaEventLoop {
+public:
+    EvaEventLoop() {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epollFd < 0 || wakeFd < 0) {
+            DIE << "EvaEventLoop: " << strerror(errno);
+        }
+        watch(wakeFd, EPOLLIN, nullptr);
+    }
+
+    EvaEventLoop(const EvaEventLoop &) = delete;
+
+    EvaEventLoop &operator=(const EvaEventLoop &) = delete;
+
+    ~EvaEventLoop() {
+        cancelAll();
+        if (worker.joinable()) {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                stopping = true;
+            }
+            wakeWorker.notify_one();
+            worker.join();
+        }
+        close(wakeFd);
+        close(epollFd);
+    }
+
+    /**
+     * Completes after the given number of milliseconds (with it).
+     * */
+    uint64_t sleep(double ms, CoroutineObject *task) {
+        auto op = start(task);
+        op->result.number = ms;
+
+        op->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (op->timerFd < 0) {
+            DIE << "sleep: " << strerror(errno);
+        }
+        // A zero value disarms the timer, expire in 1ns instead.
+        auto ns = std::max<int64_t>((int64_t) (ms * 1e6), 1);
+        itimerspec spec{};
+        spec.it_value.tv_sec = ns / 1000000000;
+        spec.it_value.tv_nsec = ns % 1000000000;
+        timerfd_settime(op->timerFd, 0, &spec, nullptr);
+
+        watch(op->timerFd, EPOLLIN, op);
+        return op->id;
+    }
+
+    /**
+     * Completes with the contents of the file.
+     * */
+    uint64_t readFile(const std::string &path, CoroutineObject *task) {
+        auto op = start(task);
+        op->kind = Operation::READ_FILE;
+        op->path = path;
+        submit(op);
+        return op->id;
+    }
+
+    /**
+     * Completes with the number of bytes written to the file.
+     * */
+    uint64_t writeFile(const std::string &path, const std::string &data, CoroutineObject *task) {
+        auto op = start(task);
+        op->kind = Operation::WRITE_FILE;
+        op->path = path;
+        op->data = data;
+        submit(op);
+        return op->id;
+    }
+
+    /**
+     * Runs the shell command with the input on its stdin,
+     * completes with its stdout once it exits.
+     * */
+    uint64_t runCommand(const std::string &command, const std::string &input, CoroutineObject *task) {
+        auto op = start(task);
+        op->kind = Operation::COMMAND;
+        op->data = input;
+        op->result.isText = true;
+
+        // Writes to a command which exited must fail (EPIPE), not kill the VM.
+        static std::once_flag ignoreSigpipe;
+        std::call_once(ignoreSigpipe, []() { signal(SIGPIPE, SIG_IGN); });
+
+        int in[2], out[2];
+        if (pipe2(in, O_CLOEXEC) != 0 || pipe2(out, O_CLOEXEC) != 0) {
+            DIE << "run-command: " << strerror(errno);
+        }
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+
+        const char *argv[] = {"sh", "-c", command.c_str(), nullptr};
+        auto error = posix_spawn(&op->pid, "/bin/sh", &actions, nullptr, (char *const *) argv, environ);
+        posix_spawn_file_actions_destroy(&actions);
+        close(in[0]);
+        close(out[1]);
+        if (error != 0) {
+            DIE << "run-command: can't run " << command << ": " << strerror(error);
+        }
+
+        op->inFd = in[1];
+        op->outFd = out[0];
+        fcntl(op->inFd, F_SETFL, O_NONBLOCK);
+        fcntl(op->outFd, F_SETFL, O_NONBLOCK);
+
+        watch(op->outFd, EPOLLIN, op);
+        if (op->data.empty()) {
+            closeInput(op);
+        } else {
+            watch(op->inFd, EPOLLOUT, op);
+        }
+        return op->id;
+    }
+
+    /**
+     * Number of operations in progress.
+     * */
+    size_t pending() { return operations.size(); }
+
+    /**
+     * Handles the ready events (waits for one if `wait`),
+     * the completed operations are added to `completed`.
+     * */
+    void poll(bool wait) {
+        epoll_event events[64];
+        auto count = epoll_wait(epollFd, events, 64, wait ? -1 : 0);
+        if (count < 0 && errno != EINTR) {
+            DIE << "EvaEventLoop: epoll_wait(): " << strerror(errno);
+        }
+
+        for (auto i = 0; i < count; i++) {
+            auto fd = events[i].data.fd;
+            if (fd == wakeFd) {
+                collectFinished();
+                continue;
+            }
+            auto it = watched.find(fd);
+            if (it == watched.end()) {
+                continue;
+            }
+            auto op = it->second;
+            if (fd == op->timerFd) {
+                complete(op);
+            } else if (fd == op->outFd) {
+                readOutput(op);
+            } else if (fd == op->inFd) {
+                writeInput(op);
+            }
+        }
+    }
+
+    /**
+     * Waits for the operation (of the main program), the other
+     * completions are kept in `completed`.
+     * */
+    AsyncResult wait(uint64_t id) {
+        for (;;) {
+            for (auto it = completed.begin(); it != completed.end(); it++) {
+                if (it->id == id) {
+                    auto result = std::move(it->result);
+                    completed.erase(it);
+                    return result;
+                }
+            }
+            poll(true);
+        }
+    }
+
+    /**
+     * Drops all the operations (kills the commands).
+     * */
+    void cancelAll() {
+        for (auto &entry: operations) {
+            auto &op = entry.second;
+            if (op->timerFd >= 0) {
+                unwatch(op->timerFd);
+            }
+            closeInput(op);
+            if (op->outFd >= 0) {
+                unwatch(op->outFd);
+                op->outFd = -1;
+            }
+            if (op->pid > 0) {
+                kill(op->pid, SIGKILL);
+                waitpid(op->pid, nullptr, 0);
+            }
+        }
+        operations.clear();
+        completed.clear();
+    }
+
+    /**
+     * Visits the waiting tasks (in place).
+     * */
+    template<typename Visitor>
+    void trace(Visitor &visit) {
+        for (auto &entry: operations) {
+            visit(entry.second->task);
+        }
+        for (auto &completion: completed) {
+            visit(completion.task);
+        }
+    }
+
+    /**
+     * Completed operations, not dispatched yet.
+     * */
+    std::deque<AsyncCompletion> completed;
+
+private:
+    struct Operation {
+        enum Kind {
+            TIMER,
+            READ_FILE,
+            WRITE_FILE,
+            COMMAND
+        };
+
+        uint64_t id;
+
+        Kind kind = TIMER;
+
+        CoroutineObject *task;
+
+        std::string path;
+
+        /* Data to write (file, or command input) */
+        std::string data;
+
+        size_t written = 0;
+
+        int timerFd = -1;
+
+        /* Command pipes (our ends) and process */
+        int inFd = -1;
+
+        int outFd = -1;
+
+        pid_t pid = -1;
+
+        AsyncResult result;
+    };
+
+    using OperationPtr = std::shared_ptr<Operation>;
+
+    OperationPtr start(CoroutineObject *task) {
+        auto op = std::make_shared<Operation>();
+        op->id = ++lastId;
+        op->task = task;
+        operations[op->id] = op;
+        return op;
+    }
+
+    void complete(const OperationPtr &op) {
+        if (op->timerFd >= 0) {
+            unwatch(op->timerFd);
+            op->timerFd = -1;
+        }
+        completed.push_back({op->id, op->task, std::move(op->result)});
+        operations.erase(op->id);
+    }
+
+    void watch(int fd, uint32_t events, const OperationPtr &op) {
+        epoll_event event{};
+        event.events = events;
+        event.data.fd = fd;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            DIE << "EvaEventLoop: epoll_ctl(): " << strerror(errno);
+        }
+        if (op != nullptr) {
+            watched[fd] = op;
+        }
+    }
+
+    void unwatch(int fd) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        watched.erase(fd);
+        close(fd);
+    }
+
+    // ----------------------------------------------
+    // Commands:
+
+    void readOutput(const OperationPtr &op) {
+        char buffer[65536];
+        for (;;) {
+            auto count = read(op->outFd, buffer, sizeof(buffer));
+            if (count > 0) {
+                op->result.text.append(buffer, count);
+                continue;
+            }
+            if (count < 0 && (errno == EAGAIN || errno == EINTR)) {
+                return;
+            }
+            // EOF (or error): the command is done with its output.
+            unwatch(op->outFd);
+            op->outFd = -1;
+            finishCommand(op);
+            return;
+        }
+    }
+
+    void writeInput(const OperationPtr &op) {
+        while (op->written < op->data.size()) {
+            auto count = write(op->inFd, op->data.data() + op->written, op->data.size() - op->written);
+            if (count < 0) {
+                if (errno == EAGAIN || errno == EINTR) {
+                    return;
+                }
+                // The command doesn't read its input (EPIPE).
+                break;
+            }
+            op->written += count;
+        }
+        closeInput(op);
+        finishCommand(op);
+    }
+
+    void closeInput(const OperationPtr &op) {
+        if (op->inFd < 0) {
+            return;
+        }
+        if (watched.count(op->inFd) != 0) {
+            unwatch(op->inFd);
+        } else {
+            close(op->inFd);
+        }
+        op->inFd = -1;
+    }
+
+    void finishCommand(const OperationPtr &op) {
+        if (op->inFd >= 0 || op->outFd >= 0) {
+            return;
+        }
+        int status = 0;
+        waitpid(op->pid, &status, 0);
+        op->pid = -1;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            op->result.error = "run-command: the command failed (status " + std::to_string(WEXITSTATUS(status)) + ")";
+        }
+        complete(op);
+    }
+
+    // ----------------------------------------------
+    // Files (worker thread):
+
+    void submit(const OperationPtr &op) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            jobs.push_back(op);
+        }
+        if (!worker.joinable()) {
+            worker = std::thread([this]() { workerLoop(); });
+        }
+        wakeWorker.notify_one();
+    }
+
+    void workerLoop() {
+        for (;;) {
+            OperationPtr op;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                wakeWorker.wait(guard, [this]() { return stopping || !jobs.empty(); });
+                if (stopping) {
+                    return;
+                }
+                op = jobs.front();
+                jobs.pop_front();
+            }
+
+            runFileOperation(*op);
+
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                finished.push_back(op);
+            }
+            uint64_t one = 1;
+            write(wakeFd, &one, sizeof(one));
+        }
+    }
+
+    static void runFileOperation(Operation &op) {
+        if (op.kind == Operation::READ_FILE) {
+            std::ifstream file(op.path, std::ios::binary);
+            if (!file) {
+                op.result.error = "read-file: can't read " + op.path;
+                return;
+            }
+            std::stringstream buffer;
+            buffer << file.rdbuf();
+            op.result.text = buffer.str();
+            op.result.isText = true;
+        } else {
+            std::ofstream file(op.path, std::ios::binary);
+            if (!file || !file.write(op.data.data(), op.data.size())) {
+                op.result.error = "write-file: can't write " + op.path;
+                return;
+            }
+            op.result.number = op.data.size();
+        }
+    }
+
+    /**
+     * Completes the operations done by the worker (the
+     * cancelled ones are not in the operations anymore).
+     * */
+    void collectFinished() {
+        uint64_t counter;
+        read(wakeFd, &counter, sizeof(counter));
+
+        std::vector<OperationPtr> done;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            done.swap(finished);
+        }
+        for (auto &op: done) {
+            if (operations.count(op->id) != 0) {
+                complete(op);
+            }
+        }
+    }
+
+    int epollFd;
+
+    /**
+     * Signalled by the worker.
+     * */
+    int wakeFd;
+
+    uint64_t lastId = 0;
+
+    std::unordered_map<uint64_t, OperationPtr> operations;
+
+    /**
+     * Operations by the watched file descriptor.
+     * */
+    std::unordered_map<int, OperationPtr> watched;
+
+    std::thread worker;
+
+    std::mutex lock;
+
+    std::condition_variable wakeWorker;
+
+    std::deque<OperationPtr> jobs;
+
+    std::vector<OperationPtr> finished;
+
+    bool stopping = false;
+};
+
+#endif
@@ -0,0 +1,345 @@
+#ifndef EVA_VM_EVAEXECUTOR_H
+#define EVA_VM_EVAEXECUTOR_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "./EvaProgram.h"
+#include "./EvaVM.h"
+
+/**
+ * One run of a compiled program.
+ * */
+struct EvaJob {
+    std::shared_ptr<const EvaProgram> program;
+
+    EvaBindings bindings;
+};
+
+/**
+ * Result of a job.
+ * */
+struct EvaJobResult {
+    /* Result value (as printed in the constant pool dumps) */
+    std::string value;
+
+    /* Error the job failed with (empty if it succeeded) */
+    std::string error;
+
+    /* Time the job ran, and from the batch start to its completion */
+    uint64_t runMicros = 0;
+
+    uint64_t latencyMicros = 0;
+
+    /* Worker which ran the job */
+    size_t worker = 0;
+};
+
+/**
+ * Throughput and latency of a batch.
+ * */
+struct EvaBatchStats {
+    size_t jobs = 0;
+
+    size_t failed = 0;
+
+    double seconds = 0;
+
+    /**
+     * Job run time percentiles (us).
+     * */
+    uint64_t p50 = 0;
+
+    uint64_t p90 = 0;
+
+    uint64_t p99 = 0;
+
+    uint64_t max = 0;
+
+    /**
+     * Jobs run by each worker.
+     * */
+    std::vector<size_t> perWorker;
+
+    void record(const std::vector<EvaJobResult> &results, size_t workers, double batchSeconds) {
+        jobs = results.size();
+        failed = 0;
+        seconds = batchSeconds;
+        perWorker.assign(workers, 0);
+
+        std::vector<uint64_t> times;
+        for (auto &result: results) {
+            failed += !result.error.empty();
+            times.push_back(result.runMicros);
+            perWorker[result.worker]++;
+        }
+        std::sort(times.begin(), times.end());
+
+        auto percentile = [&times](double p) {
+            return times.empty() ? 0 : times[std::min(times.size() - 1, (size_t) (p * times.size()))];
+        };
+        p50 = percentile(0.5);
+        p90 = percentile(0.9);
+        p99 = percentile(0.99);
+        max = times.empty() ? 0 : times.back();
+    }
+
+    void print() const {
+        std::cout << "------------------------------\n";
+        std::cout << "Batch:\n\n";
+        std::cout << "Jobs       : " << std::dec << jobs << " in " << seconds * 1000 << "ms";
+        if (seconds > 0) {
+            std::cout << " (" << (uint64_t) (jobs / seconds) << " jobs/s)";
+        }
+        if (failed != 0) {
+            std::cout << ", " << failed << " failed";
+        }
+        std::cout << "\n";
+        std::cout << "Run time   : p50 " << p50 << "us, p90 " << p90 << "us, p99 " << p99
+                  << "us, max " << max << "us\n";
+        std::cout << "Per worker :";
+        for (auto &count: perWorker) {
+            std::cout << " " << count;
+        }
+        std::cout << "\n\n";
+    }
+};
+
+/**
+ * Queue of job indices owned by one worker.
+ *
+ * The owner takes jobs from the front (submission order),
+ * thieves steal from the back.
+ * */
+struct JobDeque {
+    bool pop(size_t &job) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (items.empty()) {
+            return false;
+        }
+        job = items.front();
+        items.pop_front();
+        return true;
+    }
+
+    bool steal(size_t &job) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (items.empty()) {
+            return false;
+        }
+        job = items.back();
+        items.pop_back();
+        return true;
+    }
+
+    std::mutex lock;
+
+    std::deque<size_t> items;
+};
+
+/**
+ * Runs batches of jobs on a fixed pool of worker threads.
+ *
+ * Every worker owns a VM, reused (warm) for all its jobs: each run gets
+ * fresh globals, while the heap and the collector stay. Jobs of a batch
+ * are dealt out round-robin, and idle workers steal from the others.
+ * Results are returned in the submission order.
+ *
+ * A job failing with an error gets it in its result, and the
+ * worker resets its VM before going on with the next job.
+ * */
+class EvaExecutor {
+public:
+    /**
+     * Sets up a worker VM (e.g. the GC options).
+     * */
+    using Configure = std::function<void(EvaVM &)>;
+
+    explicit EvaExecutor(size_t threadsCount, const Configure &configure = nullptr) {
+        threadsCount = std::max<size_t>(threadsCount, 1);
+        for (size_t i = 0; i < threadsCount; i++) {
+            auto vm = std::make_unique<EvaVM>();
+            vm->disassemble = false;
+            if (configure) {
+                configure(*vm);
+            }
+            vms.push_back(std::move(vm));
+            deques.push_back(std::make_unique<JobDeque>());
+        }
+        baseGlobals = vms[0]->getBaseGlobals();
+
+        for (size_t i = 0; i < threadsCount; i++) {
+            threads.emplace_back([this, i]() { workerLoop(i); });
+        }
+    }
+
+    ~EvaExecutor() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wakeUp.notify_all();
+        for (auto &thread: threads) {
+            thread.join();
+        }
+    }
+
+    /**
+     * Compiles a program for the workers (can be called while a batch runs).
+     * */
+    std::shared_ptr<const EvaProgram> compile(const std::string &source,
+                                              const std::vector<std::string> &inputs = {}) {
+        return EvaProgram::compile(source, baseGlobals, inputs);
+    }
+
+    /**
+     * Runs the jobs, returns their results in order. One batch at a time.
+     * */
+    std::vector<EvaJobResult> run(const std::vector<EvaJob> &jobs) {
+        std::lock_guard<std::mutex> batchGuard(batchLock);
+
+        batch = &jobs;
+        results.assign(jobs.size(), EvaJobResult{});
+        for (size_t i = 0; i < jobs.size(); i++) {
+            deques[i % deques.size()]->items.push_back(i);
+        }
+
+        batchStart = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            epoch++;
+            finished = 0;
+        }
+        wakeUp.notify_all();
+
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            allDone.wait(guard, [this]() { return finished == threads.size(); });
+        }
+
+        auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - batchStart).count();
+        stats.record(results, threads.size(), seconds);
+
+        batch = nullptr;
+        return std::move(results);
+    }
+
+    /**
+     * Number of workers.
+     * */
+    size_t size() { return vms.size(); }
+
+    /**
+     * Stats of the last batch.
+     * */
+    EvaBatchStats stats;
+
+    /**
+     * Worker VMs (e.g. for their GC stats once the batches are done).
+     * */
+    std::vector<std::unique_ptr<EvaVM>> vms;
+
+private:
+    /**
+     * Worker thread: waits for a new batch and joins it.
+     * */
+    void workerLoop(size_t id) {
+        size_t seenEpoch = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                wakeUp.wait(guard, [&]() { return stopping || epoch != seenEpoch; });
+                if (stopping) {
+                    return;
+                }
+                seenEpoch = epoch;
+            }
+
+            work(id);
+
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                finished++;
+            }
+            allDone.notify_one();
+        }
+    }
+
+    /**
+     * Runs own jobs, then steals from the others until no job is left
+     * (jobs don't spawn jobs, so empty deques mean the batch is done).
+     * */
+    void work(size_t id) {
+        auto &vm = *vms[id];
+        size_t index;
+        while (deques[id]->pop(index) || steal(id, index)) {
+            auto &job = (*batch)[index];
+            auto &result = results[index];
+
+            auto start = std::chrono::steady_clock::now();
+            result.error = recover([&]() {
+                result.value = evaValueToConstantString(vm.run(job.program, job.bindings));
+            });
+            auto end = std::chrono::steady_clock::now();
+            if (!result.error.empty()) {
+                vm.reset();
+            }
+
+            result.runMicros = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+            result.latencyMicros = std::chrono::duration_cast<std::chrono::microseconds>(end - batchStart).count();
+            result.worker = id;
+        }
+    }
+
+    bool steal(size_t id, size_t &job) {
+        for (size_t i = 1; i < deques.size(); i++) {
+            if (deques[(id + i) % deques.size()]->steal(job)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::vector<std::unique_ptr<JobDeque>> deques;
+
+    std::vector<std::thread> threads;
+
+    /**
+     * Natives and constants of the worker VMs (all the same).
+     * */
+    std::vector<GlobalVar> baseGlobals;
+
+    /**
+     * Batch being run, and its results (each one written by one worker).
+     * */
+    const std::vector<EvaJob> *batch = nullptr;
+
+    std::vector<EvaJobResult> results;
+
+    std::chrono::steady_clock::time_point batchStart;
+
+    std::mutex batchLock;
+
+    std::mutex lock;
+
+    std::condition_variable wakeUp;
+
+    std::condition_variable allDone;
+
+    size_t epoch = 0;
+
+    size_t finished = 0;
+
+    bool stopping = false;
+};
+
+#endif
@@ -0,0 +1,438 @@
+#ifndef EVA_VM_EVAPARALLEL_H
+#define EVA_VM_EVAPARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../bytecode/OpCode.h"
+#include "./EvaActors.h"
+#include "./EvaProgram.h"
+#include "./EvaValue.h"
+
+/**
+ * Chunks per worker thread a parallel native splits its range into:
+ * workers claim chunks one by one, so the uneven ones are balanced.
+ * */
+#define PARALLEL_CHUNKS_PER_THREAD 8
+
+/**
+ * Stack of a numeric kernel call (locals and temporaries).
+ * */
+#define KERNEL_STACK_LIMIT 64
+
+/**
+ * Pure numeric function (e.g. `(lambda (x) (* x x))`), run over its own
+ * bytecode without the VM: no frames, no allocation, no GC safe points.
+ *
+ * Only functions without cells, globals, calls or objects qualify: their
+ * code reads and writes the parameters and locals, does the arithmetic and
+ * comparisons of numbers, and branches. Such a call has no side effects,
+ * so if it meets a value the kernel doesn't handle (e.g. adding booleans),
+ * it bails out and the call is made again by the VM.
+ * */
+struct NumericKernel {
+    /**
+     * Kernel of the function, or null if it doesn't qualify.
+     * */
+    static std::unique_ptr<NumericKernel> of(const EvaValue &function) {
+        if (!IS_FUNCTION(function)) {
+            return nullptr;
+        }
+        auto co = AS_FUNCTION(function)->co;
+        if (co->freeCount != 0 || !co->cellNames.empty()) {
+            return nullptr;
+        }
+
+        auto &code = co->code;
+        // Instruction start offsets, jumps may only land on those.
+        std::vector<bool> starts(code.size(), false);
+        std::vector<size_t> targets;
+        size_t offset = 0;
+        while (offset < code.size()) {
+            starts[offset] = true;
+            auto opcode = code[offset++];
+            switch (opcode) {
+                case OP_ADD:
+                case OP_SUB:
+                case OP_MUL:
+                case OP_DIV:
+                case OP_POP:
+                case OP_RETURN:
+                    break;
+                case OP_CONST: {
+                    if (offset >= code.size() || code[offset] >= co->constants.size()) {
+                        return nullptr;
+                    }
+                    auto &constant = co->constants[code[offset]];
+                    if (!IS_NUMBER(constant) && !IS_BOOLEAN(constant)) {
+                        return nullptr;
+                    }
+                    offset++;
+                    break;
+                }
+                case OP_GET_LOCAL:
+                case OP_SET_LOCAL:
+                    // Slot 0 is the function itself.
+                    if (offset >= code.size() || code[offset] == 0) {
+                        return nullptr;
+                    }
+                    offset++;
+                    break;
+                case OP_COMPARE:
+                case OP_SCOPE_EXIT:
+                    offset++;
+                    break;
+                case OP_JMP_IF_FALSE:
+                case OP_JMP: {
+                    if (offset + 1 >= code.size()) {
+                        return nullptr;
+                    }
+                    size_t target = ((size_t) code[offset] << 8) | code[offset + 1];
+                    if (target >= code.size()) {
+                        return nullptr;
+                    }
+                    targets.push_back(target);
+                    offset += 2;
+                    break;
+                }
+                default:
+                    return nullptr;
+            }
+        }
+        for (auto target: targets) {
+            if (!starts[target]) {
+                return nullptr;
+            }
+        }
+
+        auto kernel = std::make_unique<NumericKernel>();
+        kernel->co = co;
+        return kernel;
+    }
+
+    /**
+     * Calls the function with the arguments (its arity), returns
+     * false if it bailed out (the VM has to make the call).
+     * */
+    bool call(const EvaValue *args, EvaValue &result) const {
+        EvaValue stack[KERNEL_STACK_LIMIT];
+        auto bp = &stack[0];
+        auto sp = bp + 1 + co->arity;
+        auto limit = &stack[KERNEL_STACK_LIMIT];
+        std::copy(args, args + co->arity, bp + 1);
+
+        auto code = &co->code[0];
+        auto ip = code;
+        for (;;) {
+            switch (*ip++) {
+                case OP_CONST:
+                    if (sp == limit) {
+                        return false;
+                    }
+                    *sp++ = co->constants[*ip++];
+                    break;
+                case OP_ADD:
+                case OP_SUB:
+                case OP_MUL:
+                case OP_DIV: {
+                    auto &op1 = sp[-2];
+                    auto &op2 = sp[-1];
+                    if (!IS_NUMBER(op1) || !IS_NUMBER(op2)) {
+                        return false;
+                    }
+                    switch (ip[-1]) {
+                        case OP_ADD:
+                            op1.number += op2.number;
+                            break;
+                        case OP_SUB:
+                            op1.number -= op2.number;
+                            break;
+                        case OP_MUL:
+                            op1.number *= op2.number;
+                            break;
+                        default:
+                            op1.number /= op2.number;
+                    }
+                    sp--;
+                    break;
+                }
+                case OP_COMPARE: {
+                    auto &op1 = sp[-2];
+                    auto &op2 = sp[-1];
+                    if (!IS_NUMBER(op1) || !IS_NUMBER(op2)) {
+                        return false;
+                    }
+                    auto v1 = op1.number;
+                    auto v2 = op2.number;
+                    bool res;
+                    switch (*ip++) {
+                        case 0:
+                            res = v1 < v2;
+                            break;
+                        case 1:
+                            res = v1 > v2;
+                            break;
+                        case 2:
+                            res = v1 == v2;
+                            break;
+                        case 3:
+                            res = v1 >= v2;
+                            break;
+                        case 4:
+                            res = v1 <= v2;
+                            break;
+                        default:
+                            res = v1 != v2;
+                    }
+                    op1 = BOOLEAN(res);
+                    sp--;
+                    break;
+                }
+                case OP_JMP_IF_FALSE: {
+                    auto cond = *--sp;
+                    if (!IS_BOOLEAN(cond)) {
+                        return false;
+                    }
+                    ip += 2;
+                    if (!cond.boolean) {
+                        ip = code + ((ip[-2] << 8) | ip[-1]);
+                    }
+                    break;
+                }
+                case OP_JMP:
+                    ip = code + ((ip[0] << 8) | ip[1]);
+                    break;
+                case OP_GET_LOCAL: {
+                    auto index = *ip++;
+                    if (sp == limit || bp + index >= sp) {
+                        return false;
+                    }
+                    *sp = bp[index];
+                    sp++;
+                    break;
+                }
+                case OP_SET_LOCAL: {
+                    auto index = *ip++;
+                    if (bp + index >= sp) {
+                        return false;
+                    }
+                    bp[index] = sp[-1];
+                    break;
+                }
+                case OP_POP:
+                    sp--;
+                    break;
+                case OP_SCOPE_EXIT: {
+                    auto count = *ip++;
+                    if (sp - 1 - count < bp) {
+                        return false;
+                    }
+                    *(sp - 1 - count) = sp[-1];
+                    sp -= count;
+                    break;
+                }
+                case OP_RETURN:
+                    result = sp[-1];
+                    return true;
+                default:
+                    return false;
+            }
+        }
+    }
+
+    CodeObject *co = nullptr;
+};
+
+/**
+ * Data-parallel operation over a range.
+ * */
+enum class ParallelOp {
+    FOR,
+    MAP,
+    REDUCE
+};
+
+/**
+ * One call of a parallel native, shared by its workers.
+ * */
+struct ParallelJob {
+    ParallelOp op;
+
+    /**
+     * The callback, the combine function, the initial value, then the
+     * globals of the calling VM (copied to the workers which need a VM).
+     * */
+    Message start;
+
+    std::shared_ptr<const EvaProgram> program;
+
+    /**
+     * Kernels of the callback and the combine function (if numeric),
+     * and the initial value (if not an object).
+     * */
+    std::unique_ptr<NumericKernel> map;
+
+    std::unique_ptr<NumericKernel> combine;
+
+    EvaValue init;
+
+    /**
+     * Elements of the float64 array the job runs over (null for a range),
+     * and the mapped numbers (each element written by one worker).
+     * */
+    const double *input = nullptr;
+
+    std::vector<double> numbers;
+
+    /**
+     * Results of each chunk (each one written by one worker): the mapped
+     * values, or the chunk reduced to one value.
+     * */
+    std::vector<std::vector<Message>> results;
+
+    /**
+     * Whether the VM of the worker is set up for the job.
+     * */
+    std::vector<char> ready;
+};
+
+/**
+ * Pool of threads for the data-parallel natives.
+ *
+ * A run splits into tasks (chunks of the range), claimed by the workers
+ * through one atomic counter: a chunk is taken without locking, and each
+ * writes its own result slot, so nothing is merged under a lock. The
+ * caller waits until all the tasks are done.
+ * */
+class ParallelPool {
+public:
+    /**
+     * Runs one task on the worker.
+     * */
+    using Task = std::function<void(size_t worker, size_t task)>;
+
+    explicit ParallelPool(size_t threadsCount) {
+        threadsCount = std::max<size_t>(threadsCount, 1);
+        for (size_t i = 0; i < threadsCount; i++) {
+            threads.emplace_back([this, i]() { workerLoop(i); });
+        }
+    }
+
+    ~ParallelPool() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wakeUp.notify_all();
+        for (auto &thread: threads) {
+            thread.join();
+        }
+    }
+
+    /**
+     * Runs the tasks, returns once all of them are done. A task failing
+     * (see recover) cancels the ones not started yet: returns its error,
+     * empty if none, for the caller to raise.
+     * */
+    std::string run(size_t tasksCount, const Task &task) {
+        if (tasksCount == 0) {
+            return "";
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            current = &task;
+            tasks = tasksCount;
+            next.store(0, std::memory_order_relaxed);
+            finished = 0;
+            error.clear();
+            epoch++;
+        }
+        wakeUp.notify_all();
+
+        std::unique_lock<std::mutex> guard(lock);
+        allDone.wait(guard, [this]() { return finished == threads.size(); });
+        current = nullptr;
+        return std::move(error);
+    }
+
+    /**
+     * Number of workers.
+     * */
+    size_t size() { return threads.size(); }
+
+private:
+    /**
+     * Worker thread: waits for a run and takes its tasks until none is left.
+     * */
+    void workerLoop(size_t id) {
+        size_t seenEpoch = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                wakeUp.wait(guard, [&]() { return stopping || epoch != seenEpoch; });
+                if (stopping) {
+                    return;
+                }
+                seenEpoch = epoch;
+            }
+
+            for (;;) {
+                auto index = next.fetch_add(1, std::memory_order_relaxed);
+                if (index >= tasks) {
+                    break;
+                }
+                auto failure = recover([&]() { (*current)(id, index); });
+                if (!failure.empty()) {
+                    next.store(tasks, std::memory_order_relaxed);
+                    std::lock_guard<std::mutex> guard(lock);
+                    if (error.empty()) {
+                        error = std::move(failure);
+                    }
+                    break;
+                }
+            }
+
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                finished++;
+            }
+            allDone.notify_one();
+        }
+    }
+
+    std::vector<std::thread> threads;
+
+    /**
+     * Tasks of the current run, and the next one to take.
+     * */
+    const Task *current = nullptr;
+
+    size_t tasks = 0;
+
+    std::atomic<size_t> next{0};
+
+    /**
+     * Error of the first task which failed in the current run (under the lock).
+     * */
+    std::string error;
+
+    std::mutex lock;
+
+    std::condition_variable wakeUp;
+
+    std::condition_variable allDone;
+
+    size_t epoch = 0;
+
+    size_t finished = 0;
+
+    bool stopping = false;
+};
+
+#endif
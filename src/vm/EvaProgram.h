@@ -0,0 +1,191 @@
+#ifndef EVA_VM_EVAPROGRAM_H
+#define EVA_VM_EVAPROGRAM_H
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "../compiler/EvaCompiler.h"
+#include "../disassembler/EvaDisassembler.h"
+#include "../gc/Heap.h"
+#include "../parser/EvaParser.h"
+#include "./EvaValue.h"
+#include "./Global.h"
+#include "./Logger.h"
+
+/**
+ * Values of the program inputs for one run (input name -> value).
+ * */
+using EvaBindings = std::map<std::string, double>;
+
+/**
+ * Compiled program: compiled once, run by any number of VMs.
+ *
+ * The code objects, their constants and the class templates live in
+ * the program's own heap, and are frozen once compiled: never modified,
+ * and permanently marked, so the collectors of the VMs running the
+ * program never trace, sweep or move them (frozen objects only point
+ * to each other). VMs on parallel threads can so share one program.
+ *
+ * Mutable state is instantiated by every VM running the program: the
+ * globals, the classes (with their methods), and the functions, which
+ * are created at runtime from the shared code objects.
+ * */
+struct EvaProgram {
+    EvaProgram() : heap(std::make_unique<Heap>()) {}
+
+    EvaProgram(const EvaProgram &) = delete;
+
+    EvaProgram &operator=(const EvaProgram &) = delete;
+
+    ~EvaProgram() {
+        Traceable::cleanup(*heap);
+    }
+
+    /**
+     * Compiles the source. Globals are resolved against the base globals
+     * of the VMs (natives and constants), of which only the names are used.
+     * Inputs are globals set by every run (0 if not bound).
+     * */
+    static std::shared_ptr<const EvaProgram> compile(const std::string &source,
+                                                     const std::vector<GlobalVar> &base,
+                                                     const std::vector<std::string> &inputs = {}) {
+        auto program = std::make_shared<EvaProgram>();
+        Heap::Scope scope(*program->heap);
+
+        program->globals = std::make_shared<Global>();
+        for (auto &global: base) {
+            program->globals->globals.push_back({global.name, NUMBER(0)});
+        }
+        program->baseGlobals = base.size();
+        for (auto &input: inputs) {
+            if (program->globals->exists(input)) {
+                DIE << "EvaProgram: input " << input << " is already a VM global";
+            }
+            program->globals->define(input);
+        }
+        program->inputs = inputs;
+
+        syntax::EvaParser parser;
+        auto ast = parser.parse("(begin " + source + ")");
+
+        EvaCompiler compiler(program->globals);
+
+        // Compile errors are reported at the compiled line.
+        auto context = std::move(ErrorLogMessage::context);
+        ErrorLogMessage::context = [&compiler]() {
+            auto line = compiler.currentLine();
+            return line == 0 ? std::string() : "    at line " + std::to_string(line);
+        };
+        compiler.compile(ast);
+        ErrorLogMessage::context = std::move(context);
+
+        program->main = compiler.getMainFunction()->co;
+        program->codeObjects = compiler.getCodeObjects();
+
+        // Freeze.
+        program->heap->forEachObject([](void *object) { ((Traceable *) object)->marked = true; });
+
+        return program;
+    }
+
+    /**
+     * Sets the VM globals up for a run: keeps the base globals (natives
+     * and constants) of the VM, and replaces the rest (if any, from the
+     * previous run) with fresh copies of the program globals, and the
+     * bound inputs. Allocates in the current heap, no GC happens here.
+     * */
+    void instantiate(Global &vmGlobals, const EvaBindings &bindings = {}) const {
+        auto &entries = vmGlobals.globals;
+        if (entries.size() < baseGlobals) {
+            DIE << "EvaProgram: the VM has " << entries.size() << " base globals, " << baseGlobals << " expected";
+        }
+        for (size_t i = 0; i < baseGlobals; i++) {
+            if (entries[i].name != globals->globals[i].name) {
+                DIE << "EvaProgram: compiled for other VM globals (" << globals->globals[i].name
+                    << " instead of " << entries[i].name << ")";
+            }
+        }
+        entries.erase(entries.begin() + baseGlobals, entries.end());
+
+        std::map<ClassObject *, ClassObject *> classes;
+        for (size_t i = baseGlobals; i < globals->globals.size(); i++) {
+            auto value = globals->globals[i].value;
+            if (IS_CLASS(value)) {
+                value = CLASS(instantiateClass(AS_CLASS(value), classes));
+            }
+            entries.push_back({globals->globals[i].name, value});
+        }
+
+        for (auto &binding: bindings) {
+            if (std::find(inputs.begin(), inputs.end(), binding.first) == inputs.end()) {
+                DIE << "EvaProgram: " << binding.first << " is not an input of the program";
+            }
+            vmGlobals.set(vmGlobals.getGlobalIndex(binding.first), NUMBER(binding.second));
+        }
+    }
+
+    /**
+     * Prints the bytecode of all the code objects.
+     * */
+    void disassemble() const {
+        EvaDisassembler disassembler(globals);
+        for (auto &co: codeObjects) {
+            disassembler.disassemble(co);
+        }
+    }
+
+    /**
+     * Heap of the frozen objects.
+     * */
+    std::unique_ptr<Heap> heap;
+
+    /**
+     * Global variables layout: the base globals, then the ones
+     * defined by the program, with their initial values.
+     * */
+    std::shared_ptr<Global> globals;
+
+    size_t baseGlobals = 0;
+
+    /**
+     * Names of the inputs.
+     * */
+    std::vector<std::string> inputs;
+
+    /**
+     * Entry point.
+     * */
+    CodeObject *main = nullptr;
+
+    /**
+     * All the code objects (for the disassembly).
+     * */
+    std::vector<CodeObject *> codeObjects;
+
+private:
+    /**
+     * Copies the class template (and its super classes) to the current
+     * heap. Methods become new functions of the same code objects.
+     * */
+    static ClassObject *instantiateClass(ClassObject *cls, std::map<ClassObject *, ClassObject *> &classes) {
+        auto it = classes.find(cls);
+        if (it != classes.end()) {
+            return it->second;
+        }
+
+        auto superClass = cls->superClass == nullptr ? nullptr : instantiateClass(cls->superClass, classes);
+        auto copy = AS_CLASS(ALLOC_CLASS(cls->name, superClass));
+        for (auto &prop: cls->properties) {
+            copy->properties[prop.first] = IS_FUNCTION(prop.second)
+                                           ? ALLOC_FUNCTION(AS_FUNCTION(prop.second)->co)
+                                           : prop.second;
+        }
+
+        classes[cls] = copy;
+        return copy;
+    }
+};
+
+#endif
@@ -0,0 +1,345 @@
+#ifndef EVA_VM_EVASERVER_H
+#define EVA_VM_EVASERVER_H
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "./EvaProgram.h"
+#include "./EvaVM.h"
+#include "./Logger.h"
+
+/**
+ * Max number of compiled programs kept by the server.
+ * */
+#define EVA_SERVER_CACHE_SIZE 256
+
+/**
+ * Compiled programs by source, least recently used evicted first.
+ * */
+struct ProgramCache {
+    explicit ProgramCache(size_t capacity) : capacity(capacity) {}
+
+    std::shared_ptr<const EvaProgram> get(const std::string &source) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = entries.find(source);
+        if (it == entries.end()) {
+            misses++;
+            return nullptr;
+        }
+        hits++;
+        order.splice(order.begin(), order, it->second.second);
+        return it->second.first;
+    }
+
+    void put(const std::string &source, std::shared_ptr<const EvaProgram> program) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (entries.count(source) != 0) {
+            return;
+        }
+        order.push_front(source);
+        entries[source] = {std::move(program), order.begin()};
+        if (entries.size() > capacity) {
+            entries.erase(order.back());
+            order.pop_back();
+        }
+    }
+
+    size_t capacity;
+
+    size_t hits = 0;
+
+    size_t misses = 0;
+
+private:
+    std::mutex lock;
+
+    /**
+     * Sources, most recently used first.
+     * */
+    std::list<std::string> order;
+
+    std::unordered_map<std::string,
+            std::pair<std::shared_ptr<const EvaProgram>, std::list<std::string>::iterator>> entries;
+};
+
+/**
+ * Resident VM server on a Unix domain socket.
+ *
+ * Protocol: one request per connection. The client sends a command
+ * line, then (for `run`) the source, and closes its side:
+ *
+ *   run\n<source>  ->  <value>\ncached=<0|1> compile-us=<n> run-us=<n> worker=<n>\n
+ *                  or  error=<message>\n
+ *   stop\n         ->  stopping\n
+ *
+ * Worker threads each own a warm VM. Programs are compiled once per
+ * source (the cache is shared by the workers), and every run starts
+ * from a reset heap: once the response is sent, the worker drops the
+ * run globals and collects, off the request latency. A script failing
+ * (an error, or a syntax error) gets the error as its response.
+ * */
+class EvaServer {
+public:
+    using Configure = std::function<void(EvaVM &)>;
+
+    EvaServer(const std::string &socketPath, size_t threadsCount, const Configure &configure = nullptr)
+            : socketPath(socketPath), cache(EVA_SERVER_CACHE_SIZE) {
+        threadsCount = std::max<size_t>(threadsCount, 1);
+        for (size_t i = 0; i < threadsCount; i++) {
+            auto vm = std::make_unique<EvaVM>();
+            vm->disassemble = false;
+            if (configure) {
+                configure(*vm);
+            }
+            vms.push_back(std::move(vm));
+        }
+        baseGlobals = vms[0]->getBaseGlobals();
+
+        auto address = socketAddress(socketPath);
+        listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listenFd < 0) {
+            DIE << "EvaServer: socket(): " << strerror(errno);
+        }
+        // A socket file left by a previous server.
+        unlink(socketPath.c_str());
+        if (bind(listenFd, (sockaddr *) &address, sizeof(address)) != 0) {
+            DIE << "EvaServer: can't bind " << socketPath << ": " << strerror(errno);
+        }
+        if (listen(listenFd, SOMAXCONN) != 0) {
+            DIE << "EvaServer: listen(): " << strerror(errno);
+        }
+    }
+
+    ~EvaServer() {
+        close(listenFd);
+        unlink(socketPath.c_str());
+    }
+
+    /**
+     * Accepts and serves requests until a `stop` request.
+     * */
+    void serve() {
+        for (size_t i = 0; i < vms.size(); i++) {
+            threads.emplace_back([this, i]() { workerLoop(i); });
+        }
+
+        while (!stopping.load()) {
+            auto fd = accept(listenFd, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                // Shut down by `stop`.
+                break;
+            }
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                pending.push_back(fd);
+            }
+            wakeUp.notify_one();
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wakeUp.notify_all();
+        for (auto &thread: threads) {
+            thread.join();
+        }
+        threads.clear();
+    }
+
+    /**
+     * Sends a request to the server at the path, returns the response.
+     * */
+    static std::string request(const std::string &socketPath, const std::string &command,
+                               const std::string &source = "") {
+        auto address = socketAddress(socketPath);
+        auto fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, (sockaddr *) &address, sizeof(address)) != 0) {
+            DIE << "EvaServer: can't connect to " << socketPath << ": " << strerror(errno);
+        }
+        writeAll(fd, command + "\n" + source);
+        shutdown(fd, SHUT_WR);
+        auto response = readAll(fd);
+        close(fd);
+        return response;
+    }
+
+    void printStats() {
+        std::cout << "------------------------------\n";
+        std::cout << "Server:\n\n";
+        std::cout << "Requests   : " << std::dec << requests.load() << "\n";
+        std::cout << "Code cache : " << cache.hits << " hits, " << cache.misses << " misses\n\n";
+    }
+
+    /**
+     * Worker VMs.
+     * */
+    std::vector<std::unique_ptr<EvaVM>> vms;
+
+private:
+    /**
+     * Worker thread: serves the accepted connections.
+     * */
+    void workerLoop(size_t id) {
+        for (;;) {
+            int fd;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                wakeUp.wait(guard, [this]() { return stopping || !pending.empty(); });
+                if (pending.empty()) {
+                    return;
+                }
+                fd = pending.front();
+                pending.pop_front();
+            }
+
+            handle(id, fd);
+        }
+    }
+
+    void handle(size_t id, int fd) {
+        auto message = readAll(fd);
+        auto newline = message.find('\n');
+        auto command = message.substr(0, newline);
+
+        if (command == "stop") {
+            writeAll(fd, "stopping\n");
+            close(fd);
+            stopping = true;
+            // Wakes up the accept() of serve().
+            shutdown(listenFd, SHUT_RDWR);
+            return;
+        }
+        if (command != "run") {
+            writeAll(fd, "unknown command: " + command + "\n");
+            close(fd);
+            return;
+        }
+        requests++;
+
+        auto source = newline == std::string::npos ? std::string() : message.substr(newline + 1);
+        auto &vm = *vms[id];
+
+        auto start = std::chrono::steady_clock::now();
+        auto compiled = start;
+        auto cached = false;
+        std::string value;
+        auto error = recover([&]() {
+            auto program = cache.get(source);
+            cached = program != nullptr;
+            if (!cached) {
+                program = EvaProgram::compile(source, baseGlobals);
+                cache.put(source, program);
+            }
+            compiled = std::chrono::steady_clock::now();
+            value = evaValueToConstantString(vm.run(program));
+        });
+        auto end = std::chrono::steady_clock::now();
+
+        auto micros = [](std::chrono::steady_clock::duration duration) {
+            return std::to_string(std::chrono::duration_cast<std::chrono::microseconds>(duration).count());
+        };
+        if (!error.empty()) {
+            writeAll(fd, "error=" + error + "\n");
+        } else {
+            writeAll(fd, value + "\ncached=" + (cached ? "1" : "0")
+                         + " compile-us=" + micros(compiled - start)
+                         + " run-us=" + micros(end - compiled)
+                         + " worker=" + std::to_string(id) + "\n");
+        }
+        close(fd);
+
+        vm.reset();
+    }
+
+    static sockaddr_un socketAddress(const std::string &socketPath) {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(address.sun_path)) {
+            DIE << "EvaServer: socket path too long: " << socketPath;
+        }
+        strcpy(address.sun_path, socketPath.c_str());
+        return address;
+    }
+
+    static std::string readAll(int fd) {
+        std::string data;
+        char buffer[4096];
+        ssize_t count;
+        while ((count = read(fd, buffer, sizeof(buffer))) != 0) {
+            if (count < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            data.append(buffer, count);
+        }
+        return data;
+    }
+
+    /**
+     * Writes the data, a peer gone is ignored (no SIGPIPE).
+     * */
+    static void writeAll(int fd, const std::string &data) {
+        size_t written = 0;
+        while (written < data.size()) {
+            auto count = send(fd, data.data() + written, data.size() - written, MSG_NOSIGNAL);
+            if (count < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            written += count;
+        }
+    }
+
+    std::string socketPath;
+
+    int listenFd = -1;
+
+    ProgramCache cache;
+
+    /**
+     * Natives and constants of the worker VMs (all the same).
+     * */
+    std::vector<GlobalVar> baseGlobals;
+
+    std::vector<std::thread> threads;
+
+    /**
+     * Accepted connections, not served yet.
+     * */
+    std::deque<int> pending;
+
+    std::mutex lock;
+
+    std::condition_variable wakeUp;
+
+    std::atomic<bool> stopping{false};
+
+    std::atomic<size_t> requests{0};
+};
+
+#endif
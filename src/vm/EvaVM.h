@@ -2,19 +2,26 @@
 #define EVA_VM_EVAVM_H
 
 #include "../bytecode/OpCode.h"
-#include "../compiler/EvaCompiler.h"
 #include "../gc/EvaCollector.h"
-#include "../parser/EvaParser.h"
+#include "../gc/HeapSnapshot.h"
+#include "./CPUProfiler.h"
+#include "./EvaActors.h"
+#include "./EvaEventLoop.h"
+#include "./EvaParallel.h"
+#include "./Float64Kernels.h"
+#include "./EvaProgram.h"
 #include "./EvaValue.h"
 #include "./Global.h"
 #include "./Logger.h"
+#include "./OpcodeStats.h"
 #include <array>
+#include <deque>
+#include <fstream>
 #include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
-using syntax::EvaParser;
-
 /**
  * Reads the current byte in the bytecode
  * and advances ip pointer.
@@ -42,9 +49,9 @@ using syntax::EvaParser;
 #define STACK_LIMIT 512
 
 /**
- * Memory threshold after which GC is triggered.
+ * Innermost and outermost frames shown in the error stack traces.
  * */
-#define GC_THRESHOLD 1024
+#define ERROR_TRACE_FRAMES 10
 
 /**
  * Runtime allocation, can call GC.
@@ -96,48 +103,38 @@ using syntax::EvaParser;
     push(BOOLEAN(res));                                                        \
   } while (false);
 
-/**
- * Stack frame for function calls.
- * */
-struct Frame {
-    /**
-     * Return address of the caller.
-     * */
-    uint8_t *ra;
-
-    /**
-     * Base pointer of the caller.
-     * */
-    EvaValue *bp;
-
-    /**
-     * Reference to the running function:
-     * contains code, locals, etc.
-     * */
-    FunctionObject *fn;
-};
-
 /**
  * Eva Virtual Machine
  * */
 class EvaVM {
 public:
     EvaVM()
-            : globals(std::make_shared<Global>()),
-              parser(std::make_unique<EvaParser>()),
-              compiler(std::make_unique<EvaCompiler>(globals)),
-              collector(std::make_unique<EvaCollector>()) {
+            : heap(std::make_unique<Heap>()),
+              globals(std::make_shared<Global>()),
+              collector(std::make_unique<EvaCollector>(*heap)) {
+        Heap::Scope scope(*heap);
         setGlobalVariables();
+        baseGlobals = globals->globals.size();
     }
 
     /* VM shutdown */
-    ~EvaVM() { Traceable::cleanup(); }
+    ~EvaVM() {
+        dropActors();
+        parallelPool = nullptr;
+        ErrorLogMessage::context = nullptr;
+        // Pages being swept incrementally are detached from the heap.
+        if (collector->phase != GCPhase::IDLE) {
+            collector->gc(gcRoots);
+        }
+        collector->finishSweep();
+        Traceable::cleanup(*heap);
+    }
 
     /**
      * Push value onto the stack.
      * */
     void push(const EvaValue &value) {
-        if ((size_t) (sp - stack.begin()) == STACK_LIMIT) {
+        if (sp == stackLimit) {
             DIE << "push(): Stack overflow.\n";
         }
         *sp = value;
@@ -148,7 +145,7 @@ public:
      * Pop value from the stack.
      * */
     EvaValue pop() {
-        if (sp == stack.begin()) {
+        if (sp == stackBase) {
             DIE << "pop(): empty stack.\n";
         }
         --sp;
@@ -168,25 +165,83 @@ public:
     /**
      * Execute program
      * */
-    EvaValue exec(const std::string &program) {
-        // 1. Parse the program
-        auto ast = parser->parse("(begin " + program + ")");
+    EvaValue exec(const std::string &source) {
+        return run(compile(source));
+    }
+
+    /**
+     * Compiles the source to a program, which can be run
+     * by this VM, or any other one (see EvaProgram).
+     * */
+    std::shared_ptr<const EvaProgram> compile(const std::string &source,
+                                              const std::vector<std::string> &inputs = {}) {
+        auto program = EvaProgram::compile(source, getBaseGlobals(), inputs);
+
+        if (disassemble) {
+            program->disassemble();
+        }
+        return program;
+    }
+
+    /**
+     * Natives and constants of the VM (programs are compiled against them).
+     * */
+    std::vector<GlobalVar> getBaseGlobals() {
+        return {globals->globals.begin(), globals->globals.begin() + baseGlobals};
+    }
+
+    /**
+     * Runs the compiled program with fresh globals, and the given inputs.
+     * */
+    EvaValue run(std::shared_ptr<const EvaProgram> compiled, const EvaBindings &bindings = {}) {
+        dropActors();
 
-        // 2. Compile to Eva bytecode
-        compiler->compile(ast);
+        // Objects of this VM go to its own heap.
+        Heap::Scope scope(*heap);
+        ErrorLogMessage::context = [this]() { return errorLocation(); };
 
-        fn = compiler->getMainFunction();
+        dropTasks();
+        program = std::move(compiled);
+        program->instantiate(*globals, bindings);
+
+        fn = AS_FUNCTION(ALLOC_FUNCTION(program->main));
 
         // Set instruction pointer to beginning
         ip = &fn->co->code[0];
         // Init the stack
-        sp = &stack[0];
+        useMainStack();
         // Init the base (frame) pointer
         bp = sp;
+        callStack.clear();
+
+        auto result = eval();
+        checkActors();
+        return result;
+    }
 
-        compiler->disassembleBytecode();
+    /**
+     * Drops the state of the last run (program globals, stack, frames),
+     * and collects the heap: only the natives and constants stay, so the
+     * next run starts from the same heap as a fresh VM.
+     * */
+    void reset() {
+        Heap::Scope scope(*heap);
 
-        return eval();
+        globals->globals.erase(globals->globals.begin() + baseGlobals, globals->globals.end());
+        dropActors();
+        dropTasks();
+        useMainStack();
+        bp = sp;
+        callStack.clear();
+        fn = nullptr;
+        program = nullptr;
+
+        // A cycle in progress may keep the old objects (allocated black), complete it first.
+        if (collector->phase != GCPhase::IDLE) {
+            collector->gc(gcRoots);
+        }
+        collector->gc(gcRoots);
+        collector->finishSweep();
     }
 
     /**
@@ -195,7 +250,18 @@ public:
     EvaValue eval() {
         for (;;) {
             //            dumpStack();
+
+            // Safe point: no object pointers live outside of the roots here.
+            if (collector->compactionRequested) {
+                collector->compact(gcRoots, [this](const Forwarding &forward) { relocateRoots(forward); });
+            }
+
+            if (CPUProfiler::sampleRequested.load(std::memory_order_relaxed)) {
+                CPUProfiler::sample(stackTrace(false));
+            }
+
             int opcode = READ_BYTE();
+            OPCODE_STATS(opcode);
             switch (opcode) {
                 case OP_HALT:
                     return pop();
@@ -257,6 +323,10 @@ public:
                 case OP_JMP: {
                     auto address = READ_SHORT();
                     ip = TO_ADDRESS(address);
+                    if (actor != nullptr && --sliceBudget == 0) {
+                        actorExit = ActorExit::PREEMPTED;
+                        return BOOLEAN(false);
+                    }
                     break;
                 }
                 case OP_GET_GLOBAL: {
@@ -266,7 +336,8 @@ public:
                 }
                 case OP_SET_GLOBAL: {
                     auto globalIndex = (int) READ_BYTE();
-                    auto value = pop();
+                    auto value = peek(0);
+                    collector->writeBarrier(value);
                     globals->set(globalIndex, value);
                     break;
                 }
@@ -300,6 +371,7 @@ public:
                 case OP_SET_CELL: {
                     auto cellIndex = READ_BYTE();
                     auto value = peek(0);
+                    collector->writeBarrier(value);
 
                     // Allocate the cell if it's not there yet
                     if (fn->cells.size() <= cellIndex) {
@@ -325,7 +397,9 @@ public:
 
                     // Capture
                     for (auto i = 0; i < cellsCount; i++) {
-                        fn->cells.push_back(AS_CELL(pop()));
+                        auto cell = pop();
+                        collector->writeBarrier(cell);
+                        fn->cells.push_back(AS_CELL(cell));
                     }
 
                     push(fnValue);
@@ -362,13 +436,23 @@ public:
                         auto result = pop();
                         popN(argsCount + 1);
                         push(result);
+                        if (asyncRequest == AsyncRequest::BLOCK) {
+                            // The actor waits for a channel, runActor continues.
+                            asyncRequest = AsyncRequest::NONE;
+                            pop();
+                            actorExit = ActorExit::PARKED;
+                            return BOOLEAN(false);
+                        }
+                        if (asyncRequest != AsyncRequest::NONE) {
+                            handleAsyncRequest();
+                        }
                         break;
                     }
 
                     // 2. User-defined function
                     auto callee = AS_FUNCTION(fnValue);
 
-                    callStack.push(Frame{ip, bp, fn});
+                    callStack.push_back(Frame{ip, bp, fn});
 
                     // To access locals, etc:
                     fn = callee;
@@ -382,16 +466,30 @@ public:
 
                     ip = &callee->co->code[0];
 
+                    if (actor != nullptr && --sliceBudget == 0) {
+                        actorExit = ActorExit::PREEMPTED;
+                        return BOOLEAN(false);
+                    }
                     break;
                 }
                     /* Return from function */
                 case OP_RETURN: {
-                    auto callerFrame = callStack.top();
+                    // Return from the function of a coroutine, or of an actor.
+                    if (callStack.empty()) {
+                        if (coroutine == nullptr) {
+                            actorExit = ActorExit::DONE;
+                            return pop();
+                        }
+                        suspend(pop(), true);
+                        break;
+                    }
+
+                    auto callerFrame = callStack.back();
                     ip = callerFrame.ra;
                     bp = callerFrame.bp;
                     fn = callerFrame.fn;
 
-                    callStack.pop();
+                    callStack.pop_back();
                     break;
                 }
                 case OP_NEW: {
@@ -426,9 +524,69 @@ public:
                     auto prop = AS_CPPSTRING(GET_CONST());
                     auto instance = AS_INSTANCE(pop());
                     auto value = pop();
+                    collector->writeBarrier(value);
                     push(instance->properties[prop] = value);
                     break;
                 }
+                case OP_GET_INDEX: {
+                    auto index = pop();
+                    auto array = pop();
+                    if (IS_ARRAY(array)) {
+                        auto &items = AS_ARRAY(array)->items;
+                        push(items[indexOf(index, items.size())]);
+                    } else if (IS_FLOAT64_ARRAY(array)) {
+                        auto &items = AS_FLOAT64_ARRAY(array)->items;
+                        push(NUMBER(items[indexOf(index, items.size())]));
+                    } else if (IS_MAP(array)) {
+                        auto value = AS_MAP(array)->find(index);
+                        if (value == nullptr) {
+                            DIE << "index: " << evaValueToConstantString(index) << " is not a key of the map";
+                        }
+                        push(*value);
+                    } else {
+                        DIE << "index: " << evaValueToConstantString(array) << " is not an array";
+                    }
+                    break;
+                }
+                case OP_SET_INDEX: {
+                    auto index = pop();
+                    auto array = pop();
+                    auto value = pop();
+                    if (IS_ARRAY(array)) {
+                        auto &items = AS_ARRAY(array)->items;
+                        collector->writeBarrier(value);
+                        items[indexOf(index, items.size())] = value;
+                    } else if (IS_FLOAT64_ARRAY(array)) {
+                        auto &items = AS_FLOAT64_ARRAY(array)->items;
+                        items[indexOf(index, items.size())] = float64Item(value, "index");
+                    } else if (IS_MAP(array)) {
+                        setKey(AS_MAP(array), index, value, "index");
+                    } else {
+                        DIE << "index: " << evaValueToConstantString(array) << " is not an array";
+                    }
+                    push(value);
+                    break;
+                }
+                case OP_YIELD: {
+                    auto value = pop();
+                    if (coroutine == nullptr) {
+                        DIE << "yield: not in a coroutine";
+                    }
+                    suspend(value, false);
+                    break;
+                }
+                case OP_RESUME: {
+                    auto value = pop();
+                    auto target = pop();
+                    if (!IS_COROUTINE(target)) {
+                        DIE << "resume: " << evaValueToConstantString(target) << " is not a coroutine";
+                    }
+                    if (AS_COROUTINE(target)->task) {
+                        DIE << "resume: the coroutine is a task, run by the event loop";
+                    }
+                    resume(AS_COROUTINE(target), value);
+                    break;
+                }
                 default:
                     DIE << "Unknown opcode: " << std::hex << opcode;
             }
@@ -458,148 +616,1539 @@ public:
                 },
                 2);
 
-        /* Global variables */
-        globals->addConst("VERSION", 1);
-        globals->addConst("y", 20);
-    }
+        // GC metric by name, e.g. (gc-stat "cycles")
+        globals->addNativeFunction(
+                "gc-stat",
+                [&]() {
+                    auto name = AS_CPPSTRING(peek(0));
+                    push(NUMBER(collector->stat(name)));
+                },
+                1);
 
-    void popN(size_t count) {
-        if (stack.size() == 0) {
-            DIE << "popN(): empty stack.\n";
-        }
-        sp -= count;
-    }
+        // Writes a heap snapshot, returns the number of objects, e.g. (heap-snapshot "before.heap")
+        globals->addNativeFunction(
+                "heap-snapshot",
+                [&]() {
+                    auto fileName = AS_CPPSTRING(peek(0));
+                    std::ofstream file(fileName);
+                    if (!file) {
+                        DIE << "heap-snapshot: can't write " << fileName;
+                    }
+                    push(NUMBER((double) writeHeapSnapshot(file)));
+                },
+                1);
 
-    // ----------------------------------------------
-    // GC Operations:
+        // Coroutine running the function, started by the first resume,
+        // e.g. (var gen (coroutine numbers)) (resume gen 10)
+        globals->addNativeFunction(
+                "coroutine",
+                [&]() {
+                    auto function = peek(0);
+                    if (!IS_FUNCTION(function) || AS_FUNCTION(function)->co->arity > 1) {
+                        DIE << "coroutine: a function of at most one parameter expected";
+                    }
+                    push(MEM(ALLOC_COROUTINE, AS_FUNCTION(function)));
+                },
+                1);
 
-    std::set<Traceable *> getStackGCRoots() {
-        std::set<Traceable *> roots;
-        auto stackEntry = sp;
-        while (stackEntry-- != stack.begin()) {
-            if (IS_OBJECT(*stackEntry)) {
-                roots.insert((Traceable *) stackEntry->object);
-            }
-        }
-        return roots;
-    }
+        // Whether the function of the coroutine has returned.
+        globals->addNativeFunction(
+                "coroutine-done",
+                [&]() {
+                    auto value = peek(0);
+                    if (!IS_COROUTINE(value)) {
+                        DIE << "coroutine-done: " << evaValueToConstantString(value) << " is not a coroutine";
+                    }
+                    push(BOOLEAN(AS_COROUTINE(value)->done));
+                },
+                1);
 
-    std::set<Traceable *> getConstantGCRoots() {
-        return compiler->getConstantObjects();
-    }
+        // Starts a task: a coroutine run by the event loop, e.g. (go (lambda () (sleep 10)))
+        globals->addNativeFunction(
+                "go",
+                [&]() {
+                    auto function = peek(0);
+                    if (!IS_FUNCTION(function) || AS_FUNCTION(function)->co->arity != 0) {
+                        DIE << "go: a function without parameters expected";
+                    }
+                    auto task = MEM(ALLOC_COROUTINE, AS_FUNCTION(function));
+                    AS_COROUTINE(task)->task = true;
+                    readyTasks.push_back({AS_COROUTINE(task), BOOLEAN(false)});
+                    push(task);
+                },
+                1);
 
-    std::set<Traceable *> getGlobalGCRoots() {
-        std::set<Traceable *> roots;
-        for (const auto& global : globals->globals) {
-            if (IS_OBJECT(global.value)) {
-                roots.insert((Traceable*)global.value.object);
-            }
-        }
-        return roots;
-    }
+        // Runs the tasks until all are done, returns their number.
+        globals->addNativeFunction(
+                "run-loop",
+                [&]() {
+                    if (coroutine != nullptr) {
+                        DIE << "run-loop: must be called by the main program";
+                    }
+                    asyncRequest = AsyncRequest::SCHEDULE;
+                    push(BOOLEAN(false));
+                },
+                0);
 
-    /**
-     * Obtain GC roots: variables on the stack, globals, constants.
-     * */
-    std::set<Traceable *> getGCRoots() {
-        // Stack:
-        auto roots = getStackGCRoots();
+        /* Actors: park the calling actor, the main program waits. */
+
+        // Starts an actor running the function, with a copy of the globals,
+        // e.g. (spawn (lambda () (send results (work 10))))
+        globals->addNativeFunction(
+                "spawn",
+                [&]() {
+                    auto function = peek(0);
+                    if (!IS_FUNCTION(function) || AS_FUNCTION(function)->co->arity != 0) {
+                        DIE << "spawn: a function without parameters expected";
+                    }
+                    spawnActor(AS_FUNCTION(function));
+                    push(BOOLEAN(true));
+                },
+                1);
+
+        // Channel of the given capacity, e.g. (var results (channel 16))
+        globals->addNativeFunction(
+                "channel",
+                [&]() {
+                    auto capacity = AS_NUMBER(peek(0));
+                    if (capacity < 1) {
+                        DIE << "channel: the capacity must be at least 1";
+                    }
+                    push(MEM(ALLOC_CHANNEL, std::make_shared<Channel>((size_t) capacity)));
+                },
+                1);
 
-        // Constant pool
-        auto constantRoots = getConstantGCRoots();
-        roots.insert(constantRoots.begin(), constantRoots.end());
+        // (send channel value) -> true, waits while the channel is full
+        globals->addNativeFunction(
+                "send",
+                [&]() {
+                    auto channel = channelOf(peek(1), "send");
+                    auto message = Message::copy({peek(0)});
+                    if (channel->send(message, actor, actorFailure())) {
+                        push(BOOLEAN(true));
+                        return;
+                    }
+                    checkActors();
+                    asyncRequest = AsyncRequest::BLOCK;
+                    push(BOOLEAN(false));
+                },
+                2);
 
-        // Global
-        auto globalRoots = getGlobalGCRoots();
-        roots.insert(globalRoots.begin(), globalRoots.end());
+        // (receive channel) -> value, waits while the channel is empty
+        globals->addNativeFunction(
+                "receive",
+                [&]() {
+                    auto channel = channelOf(peek(0), "receive");
+                    Message message;
+                    if (channel->receive(message, actor, actorFailure())) {
+                        maybeGC();
+                        push(message.create(*globals)[0]);
+                        return;
+                    }
+                    checkActors();
+                    asyncRequest = AsyncRequest::BLOCK;
+                    push(BOOLEAN(false));
+                },
+                1);
 
-        return roots;
-    }
+        /* Data-parallel natives over the range [0, n), or the elements x
+         * of a float64 array (instead of i): the caller waits. */
 
-    /**
-     * Spawns a pottential GC cycle.
-     * */
-    void maybeGC() {
-        if (Traceable::bytesAllocated < GC_THRESHOLD) {
-            return;
-        }
+        // (parallel-for n f) -> n, calls (f i) for every i
+        globals->addNativeFunction(
+                "parallel-for",
+                [&]() {
+                    checkCallback(peek(0), 1, "parallel-for");
+                    push(parallel(ParallelOp::FOR, peek(1), peek(0), BOOLEAN(false), BOOLEAN(false), "parallel-for"));
+                },
+                2);
 
-        auto roots = getGCRoots();
+        // (parallel-map n f) -> array of the results of (f i), a float64 array over one
+        globals->addNativeFunction(
+                "parallel-map",
+                [&]() {
+                    checkCallback(peek(0), 1, "parallel-map");
+                    push(parallel(ParallelOp::MAP, peek(1), peek(0), BOOLEAN(false), BOOLEAN(false), "parallel-map"));
+                },
+                2);
 
-        if (roots.size() == 0) {
-            return;
-        }
+        // (parallel-reduce n f combine init) -> (combine (combine init (f 0)) (f 1)) ...,
+        // combine has to be associative, and init its identity (e.g. + and 0)
+        globals->addNativeFunction(
+                "parallel-reduce",
+                [&]() {
+                    checkCallback(peek(2), 1, "parallel-reduce");
+                    checkCallback(peek(1), 2, "parallel-reduce");
+                    push(parallel(ParallelOp::REDUCE, peek(3), peek(2), peek(1), peek(0), "parallel-reduce"));
+                },
+                4);
 
-        std::cout << "---------------- Before GC stats ----------------\n";
-        Traceable::printStats();
+        /* Arrays */
 
-        collector->gc(roots);
+        // (array n value) -> array of n times the value, e.g. (array 0 false)
+        globals->addNativeFunction(
+                "array",
+                [&]() {
+                    auto count = countOf(peek(1), "array");
+                    push(MEM(ALLOC_ARRAY, std::vector<EvaValue>(count, peek(0))));
+                },
+                2);
 
-        std::cout << "---------------- After GC stats ----------------\n";
-        Traceable::printStats();
-    }
+        // (float64-array n) -> n zeros; (float64-array array) -> its numbers, unboxed
+        globals->addNativeFunction(
+                "float64-array",
+                [&]() {
+                    auto value = peek(0);
+                    if (!IS_ARRAY(value)) {
+                        push(MEM(ALLOC_FLOAT64_ARRAY, std::vector<double>(countOf(value, "float64-array"))));
+                        return;
+                    }
+                    std::vector<double> numbers;
+                    numbers.reserve(AS_ARRAY(value)->items.size());
+                    for (auto &item: AS_ARRAY(value)->items) {
+                        numbers.push_back(float64Item(item, "float64-array"));
+                    }
+                    push(MEM(ALLOC_FLOAT64_ARRAY, std::move(numbers)));
+                },
+                1);
 
-    /**
-     * Global object
-     * */
-    std::shared_ptr<Global> globals;
+        // (length array) -> number of elements (also of a string, or a map)
+        globals->addNativeFunction(
+                "length",
+                [&]() {
+                    auto value = peek(0);
+                    if (IS_ARRAY(value)) {
+                        push(NUMBER((double) AS_ARRAY(value)->items.size()));
+                    } else if (IS_FLOAT64_ARRAY(value)) {
+                        push(NUMBER((double) AS_FLOAT64_ARRAY(value)->items.size()));
+                    } else if (IS_STRING(value)) {
+                        push(NUMBER((double) AS_CPPSTRING(value).size()));
+                    } else if (IS_MAP(value)) {
+                        push(NUMBER((double) AS_MAP(value)->count));
+                    } else {
+                        DIE << "length: " << evaValueToConstantString(value) << " is not an array";
+                    }
+                },
+                1);
 
-    /**
-     * Parser
-     * */
-    std::unique_ptr<EvaParser> parser;
+        // (push array value) -> new length
+        globals->addNativeFunction(
+                "push",
+                [&]() {
+                    auto array = peek(1);
+                    auto value = peek(0);
+                    if (IS_ARRAY(array)) {
+                        collector->writeBarrier(value);
+                        AS_ARRAY(array)->items.push_back(value);
+                        AS_ARRAY(array)->itemsResized();
+                        push(NUMBER((double) AS_ARRAY(array)->items.size()));
+                    } else if (IS_FLOAT64_ARRAY(array)) {
+                        AS_FLOAT64_ARRAY(array)->items.push_back(float64Item(value, "push"));
+                        AS_FLOAT64_ARRAY(array)->itemsResized();
+                        push(NUMBER((double) AS_FLOAT64_ARRAY(array)->items.size()));
+                    } else {
+                        DIE << "push: " << evaValueToConstantString(array) << " is not an array";
+                    }
+                },
+                2);
 
-    /**
-     * Compiler
-     * */
-    std::unique_ptr<EvaCompiler> compiler;
+        /* Float64 array kernels (vectorized, see Float64Kernels.h) */
 
-    /**
-     * Garbage collector
-     * */
-    std::unique_ptr<EvaCollector> collector;
+        // (float64-sum a) -> sum of the elements
+        globals->addNativeFunction(
+                "float64-sum",
+                [&]() {
+                    auto &a = float64Of(peek(0), "float64-sum");
+                    push(NUMBER(float64::sum(a.data(), a.size())));
+                },
+                1);
 
-    /**
-     * Instruction pointer.
-     * */
-    uint8_t *ip;
+        // (float64-dot a b) -> dot product (same lengths)
+        globals->addNativeFunction(
+                "float64-dot",
+                [&]() {
+                    auto &a = float64Of(peek(1), "float64-dot");
+                    auto &b = float64Of(peek(0), "float64-dot");
+                    if (a.size() != b.size()) {
+                        DIE << "float64-dot: arrays of " << a.size() << " and " << b.size() << " elements";
+                    }
+                    push(NUMBER(float64::dot(a.data(), b.data(), a.size())));
+                },
+                2);
 
-    /**
-     * Stack pointer.
-     * */
-    EvaValue *sp;
+        // (float64-scale a k) -> a, with its elements multiplied by k (in place)
+        globals->addNativeFunction(
+                "float64-scale",
+                [&]() {
+                    auto &a = float64Of(peek(1), "float64-scale");
+                    float64::scale(a.data(), a.size(), float64Item(peek(0), "float64-scale"));
+                    push(peek(1));
+                },
+                2);
 
-    /**
-     * Base pointer (aka Frame pointer).
-     * */
-    EvaValue *bp;
+        // (float64-min a), (float64-max a) -> min/max of the elements (non-empty)
+        globals->addNativeFunction(
+                "float64-min",
+                [&]() {
+                    auto &a = float64Of(peek(0), "float64-min", true);
+                    push(NUMBER(float64::min(a.data(), a.size())));
+                },
+                1);
 
-    /**
-     * Operands stack.
-     * */
-    std::array<EvaValue, STACK_LIMIT> stack;
+        globals->addNativeFunction(
+                "float64-max",
+                [&]() {
+                    auto &a = float64Of(peek(0), "float64-max", true);
+                    push(NUMBER(float64::max(a.data(), a.size())));
+                },
+                1);
 
-    /**
-     * Separate stack for the calls. Keeps return address.
-     * */
-    std::stack<Frame> callStack;
+        // (float64-less a x), (float64-greater a x) -> mask: 1 where a[i] < x (> x), else 0,
+        // e.g. count: (float64-sum (float64-less a x)), sum of those: (float64-dot a (float64-less a x))
+        globals->addNativeFunction(
+                "float64-less",
+                [&]() {
+                    push(float64Compare(float64::Compare::LESS, "float64-less"));
+                },
+                2);
 
-    /**
-     * Currently executing function.
+        globals->addNativeFunction(
+                "float64-greater",
+                [&]() {
+                    push(float64Compare(float64::Compare::GREATER, "float64-greater"));
+                },
+                2);
+
+        /* Hash maps: keys are numbers, booleans or strings; (index m key) reads
+         * a value (the key must be in the map), (set (index m key) value) sets it */
+
+        // (hash-map) -> new empty map
+        globals->addNativeFunction(
+                "hash-map",
+                [&]() {
+                    push(MEM(ALLOC_MAP));
+                },
+                0);
+
+        // (map-get m key default) -> value of the key, or the default if it's not in the map
+        globals->addNativeFunction(
+                "map-get",
+                [&]() {
+                    auto value = mapOf(peek(2), "map-get")->find(peek(1));
+                    push(value != nullptr ? *value : peek(0));
+                },
+                3);
+
+        // (map-set m key value) -> value
+        globals->addNativeFunction(
+                "map-set",
+                [&]() {
+                    setKey(mapOf(peek(2), "map-set"), peek(1), peek(0), "map-set");
+                    push(peek(0));
+                },
+                3);
+
+        // (map-add m key x) -> value of the key (0 if it's not in the map) + x, stored
+        // with one lookup, e.g. group-by counts: (map-add counts key 1)
+        globals->addNativeFunction(
+                "map-add",
+                [&]() {
+                    auto map = mapOf(peek(2), "map-add");
+                    checkKey(peek(1), "map-add");
+                    auto x = peek(0);
+                    if (!IS_NUMBER(x)) {
+                        DIE << "map-add: " << evaValueToConstantString(x) << " is not a number";
+                    }
+                    // A new key is inserted as 0, only an existing one can hold a non-number.
+                    auto &value = map->slotOf(peek(1), NUMBER(0));
+                    if (!IS_NUMBER(value)) {
+                        DIE << "map-add: can't add " << evaValueToConstantString(x) << " to "
+                            << evaValueToConstantString(value);
+                    }
+                    value.number += x.number;
+                    collector->writeBarrier(peek(1));
+                    push(value);
+                },
+                3);
+
+        // (map-has m key) -> whether the key is in the map
+        globals->addNativeFunction(
+                "map-has",
+                [&]() {
+                    push(BOOLEAN(mapOf(peek(1), "map-has")->find(peek(0)) != nullptr));
+                },
+                2);
+
+        // (map-delete m key) -> whether the key was in the map
+        globals->addNativeFunction(
+                "map-delete",
+                [&]() {
+                    push(BOOLEAN(mapOf(peek(1), "map-delete")->remove(peek(0))));
+                },
+                2);
+
+        // (map-keys m), (map-values m) -> array of the keys (values), in the same order
+        globals->addNativeFunction(
+                "map-keys",
+                [&]() {
+                    push(mapEntries(true, "map-keys"));
+                },
+                1);
+
+        globals->addNativeFunction(
+                "map-values",
+                [&]() {
+                    push(mapEntries(false, "map-values"));
+                },
+                1);
+
+        /* Async natives: park the calling task, the main program waits. */
+
+        // (sleep ms) -> ms
+        globals->addNativeFunction(
+                "sleep",
+                [&]() {
+                    auto duration = peek(0);
+                    if (!IS_NUMBER(duration) || !(AS_NUMBER(duration) >= 0)) {
+                        DIE << "sleep: " << evaValueToConstantString(duration) << " is not a duration (ms)";
+                    }
+                    auto ms = AS_NUMBER(duration);
+                    async([&](CoroutineObject *task) { return loop().sleep(ms, task); });
+                },
+                1);
+
+        // (read-file path) -> contents
+        globals->addNativeFunction(
+                "read-file",
+                [&]() {
+                    auto path = stringOf(peek(0), "read-file");
+                    async([&](CoroutineObject *task) { return loop().readFile(path, task); });
+                },
+                1);
+
+        // (write-file path data) -> bytes written
+        globals->addNativeFunction(
+                "write-file",
+                [&]() {
+                    auto path = stringOf(peek(1), "write-file");
+                    auto data = stringOf(peek(0), "write-file");
+                    async([&](CoroutineObject *task) { return loop().writeFile(path, data, task); });
+                },
+                2);
+
+        // (run-command "sort" input) -> output of the shell command
+        globals->addNativeFunction(
+                "run-command",
+                [&]() {
+                    auto command = stringOf(peek(1), "run-command");
+                    auto input = stringOf(peek(0), "run-command");
+                    async([&](CoroutineObject *task) { return loop().runCommand(command, input, task); });
+                },
+                2);
+
+        /* Global variables */
+        globals->addConst("VERSION", 1);
+        globals->addConst("y", 20);
+    }
+
+    void popN(size_t count) {
+        if (stack.size() == 0) {
+            DIE << "popN(): empty stack.\n";
+        }
+        sp -= count;
+    }
+
+    // ----------------------------------------------
+    // Coroutines:
+
+    /**
+     * Switches to the coroutine, which gets the value: as the argument of
+     * its function on the first resume, as the result of its yield after.
+     * */
+    void resume(CoroutineObject *target, const EvaValue &value) {
+        if (target->done) {
+            DIE << "resume: the coroutine " << target->function->co->name << " is done";
+        }
+        if (target->running) {
+            DIE << "resume: the coroutine " << target->function->co->name << " is running";
+        }
+
+        swapContext(target);
+        target->resumer = coroutine;
+        target->running = true;
+        coroutine = target;
+
+        if (target->started) {
+            push(value);
+            return;
+        }
+
+        // Call the function on the new stack.
+        target->started = true;
+        fn = target->function;
+        push(OBJECT((Object *) fn));
+        if (fn->co->arity == 1) {
+            push(value);
+        }
+        fn->cells.resize(fn->co->freeCount);
+        bp = stackBase;
+        ip = &fn->co->code[0];
+    }
+
+    /**
+     * Switches from the running coroutine back to its resumer, which
+     * gets the value (yielded, or returned if the coroutine is done).
+     * */
+    void suspend(const EvaValue &value, bool done) {
+        auto current = coroutine;
+
+        swapContext(current);
+        coroutine = current->resumer;
+        current->resumer = nullptr;
+        current->running = false;
+
+        if (done) {
+            current->done = true;
+            current->stackBase = current->sp = current->bp = nullptr;
+            current->fn = nullptr;
+            current->stack = {};
+        }
+
+        // Back in the scheduler: a task yielding gives way to the others.
+        if (current->task) {
+            if (done) {
+                tasksDone++;
+            } else if (!parking) {
+                readyTasks.push_back({current, BOOLEAN(false)});
+            }
+            parking = false;
+            schedule();
+            return;
+        }
+
+        push(value);
+    }
+
+    /**
+     * Swaps the VM registers with the context saved in the coroutine.
+     *
+     * The context which is saved leaves the roots for the coroutine
+     * object, which may be black already: its values are shaded.
+     * */
+    void swapContext(CoroutineObject *target) {
+        std::swap(stackBase, target->stackBase);
+        std::swap(sp, target->sp);
+        std::swap(bp, target->bp);
+        std::swap(ip, target->ip);
+        std::swap(fn, target->fn);
+        callStack.swap(target->callStack);
+        stackLimit = stackBase + (stackBase == &stack[0] ? STACK_LIMIT : COROUTINE_STACK_LIMIT);
+
+        if (collector->phase == GCPhase::MARK) {
+            auto shade = makeObjectVisitor([this](Traceable *object) {
+                collector->writeBarrier(OBJECT((Object *) object));
+            });
+            target->trace(shade);
+        }
+    }
+
+    /**
+     * Runs on the main stack (no coroutine).
+     * */
+    void useMainStack() {
+        stackBase = &stack[0];
+        stackLimit = stackBase + STACK_LIMIT;
+        sp = stackBase;
+        coroutine = nullptr;
+    }
+
+    // ----------------------------------------------
+    // Event loop:
+
+    /**
+     * Event loop of the VM, created on the first use.
+     * */
+    EvaEventLoop &loop() {
+        if (eventLoop == nullptr) {
+            eventLoop = std::make_unique<EvaEventLoop>();
+        }
+        return *eventLoop;
+    }
+
+    /**
+     * String argument of a native (dies if the value is not a string).
+     * */
+    std::string stringOf(const EvaValue &value, const char *native) {
+        if (!IS_STRING(value)) {
+            DIE << native << ": " << evaValueToConstantString(value) << " is not a string";
+        }
+        return AS_CPPSTRING(value);
+    }
+
+    /**
+     * Runs an async operation for a native: a task is parked until the
+     * operation completes, and then resumed with its result (as the
+     * result of the native). The main program just waits for it.
+     * */
+    void async(const std::function<uint64_t(CoroutineObject *task)> &start) {
+        if (coroutine == nullptr) {
+            auto result = loop().wait(start(nullptr));
+            push(asyncValue(result));
+            return;
+        }
+        if (!coroutine->task) {
+            DIE << "async call in a coroutine which is not a task (see go)";
+        }
+        start(coroutine);
+        asyncRequest = AsyncRequest::PARK;
+        push(BOOLEAN(false));
+    }
+
+    /**
+     * Context switch requested by a native, done once the native
+     * call is complete (its placeholder result is dropped).
+     * */
+    void handleAsyncRequest() {
+        auto request = asyncRequest;
+        asyncRequest = AsyncRequest::NONE;
+        pop();
+
+        if (request == AsyncRequest::PARK) {
+            parking = true;
+            suspend(BOOLEAN(false), false);
+        } else {
+            schedule();
+        }
+    }
+
+    /**
+     * Switches to the next ready task, waiting for the event loop if no
+     * task is ready. Once no task is ready or waiting, the main program
+     * continues: run-loop returns the number of tasks done.
+     * */
+    void schedule() {
+        for (;;) {
+            if (!readyTasks.empty()) {
+                auto next = readyTasks.front();
+                readyTasks.pop_front();
+                resume(next.first, next.second);
+                return;
+            }
+            if (eventLoop == nullptr || (eventLoop->pending() == 0 && eventLoop->completed.empty())) {
+                push(NUMBER((double) tasksDone));
+                tasksDone = 0;
+                return;
+            }
+            if (eventLoop->completed.empty()) {
+                eventLoop->poll(true);
+            }
+
+            // Waiting tasks become ready with the results.
+            auto &completed = eventLoop->completed;
+            while (!completed.empty()) {
+                // Allocates: the task stays a root (in completed) until queued.
+                auto value = asyncValue(completed.front().result);
+                readyTasks.push_back({completed.front().task, value});
+                completed.pop_front();
+            }
+        }
+    }
+
+    /**
+     * Eva value of the result (dies on the errors).
+     * */
+    EvaValue asyncValue(AsyncResult &result) {
+        if (!result.error.empty()) {
+            DIE << result.error;
+        }
+        if (result.isText) {
+            return MEM(ALLOC_STRING, result.text);
+        }
+        return NUMBER(result.number);
+    }
+
+    /**
+     * Drops the tasks and the operations of the previous run.
+     * */
+    void dropTasks() {
+        readyTasks.clear();
+        if (eventLoop != nullptr) {
+            eventLoop->cancelAll();
+        }
+        asyncRequest = AsyncRequest::NONE;
+        parking = false;
+        tasksDone = 0;
+    }
+
+    // ----------------------------------------------
+    // Actors:
+
+    /**
+     * Scheduler of the actors, created by the first spawn
+     * of the main VM (its actors share it).
+     * */
+    ActorScheduler &actors() {
+        if (scheduler == nullptr) {
+            ownScheduler = std::make_unique<ActorScheduler>(actorThreads);
+            scheduler = ownScheduler.get();
+        }
+        return *scheduler;
+    }
+
+    /**
+     * New VM for the same program, with the GC options of this one
+     * (the marking and sweeping threads are per VM).
+     * */
+    std::shared_ptr<EvaVM> childVM() {
+        auto vm = std::make_shared<EvaVM>();
+        vm->disassemble = false;
+        vm->program = program;
+
+        vm->collector->incremental = collector->incremental;
+        vm->collector->stepBudget = collector->stepBudget;
+        vm->collector->stepTimeBudget = collector->stepTimeBudget;
+        vm->collector->compactEvery = collector->compactEvery;
+        vm->collector->pacer.growthFactor = collector->pacer.growthFactor;
+        vm->collector->pacer.minHeap = collector->pacer.minHeap;
+        vm->collector->pacer.maxHeap = collector->pacer.maxHeap;
+        vm->collector->pacer.cpuTarget = collector->pacer.cpuTarget;
+        return vm;
+    }
+
+    /**
+     * Program globals of this VM (after the base ones).
+     * */
+    void appendGlobals(std::vector<EvaValue> &values) {
+        for (size_t i = baseGlobals; i < globals->globals.size(); i++) {
+            values.push_back(globals->globals[i].value);
+        }
+    }
+
+    /**
+     * Replaces the program globals with the values (copied from
+     * the VM running the same program).
+     * */
+    void setProgramGlobals(const std::vector<EvaValue> &values, size_t from) {
+        globals->globals.erase(globals->globals.begin() + baseGlobals, globals->globals.end());
+        for (size_t i = from; i < values.size(); i++) {
+            globals->globals.push_back({program->globals->globals[baseGlobals + i - from].name, values[i]});
+        }
+    }
+
+    /**
+     * Starts an actor: a new VM running the function, with a
+     * copy of the program globals (a snapshot of this VM's ones).
+     * */
+    void spawnActor(FunctionObject *function) {
+        std::vector<EvaValue> start{OBJECT((Object *) function)};
+        appendGlobals(start);
+
+        auto vm = childVM();
+        vm->scheduler = &actors();
+
+        auto spawned = std::make_shared<Actor>();
+        spawned->inbox = Message::copy(start);
+        spawned->vm = vm;
+        spawned->run = [vm = vm.get()]() { return vm->runActor(); };
+        vm->actor = spawned.get();
+
+        scheduler->spawn(spawned);
+    }
+
+    /**
+     * Runs the actor for a time slice (on a worker thread): calls its
+     * function on the first run, otherwise continues where it parked
+     * (with the received value, or the completed send) or was preempted.
+     * */
+    ActorExit runActor() {
+        Heap::Scope scope(*heap);
+        ErrorLogMessage::context = [this]() { return errorLocation(); };
+
+        if (fn == nullptr) {
+            auto start = actor->inbox.create(*globals);
+            actor->inbox = {};
+            setProgramGlobals(start, 1);
+
+            fn = AS_FUNCTION(start[0]);
+            useMainStack();
+            push(start[0]);
+            bp = stackBase;
+            fn->cells.resize(fn->co->freeCount);
+            ip = &fn->co->code[0];
+            callStack.clear();
+        } else if (actorExit == ActorExit::PARKED) {
+            maybeGC();
+            if (actor->received) {
+                push(actor->inbox.create(*globals)[0]);
+                actor->inbox = {};
+                actor->received = false;
+            } else {
+                push(BOOLEAN(true));
+            }
+        }
+
+        sliceBudget = ACTOR_TIME_SLICE;
+        eval();
+        ErrorLogMessage::context = nullptr;
+        return actorExit;
+    }
+
+    /**
+     * Raises the error of an actor which failed (cancelled by the
+     * scheduler), in the VM running the program.
+     * */
+    void checkActors() {
+        if (ownScheduler != nullptr && ownScheduler->failed.load()) {
+            DIE << "actor: " << ownScheduler->error;
+        }
+    }
+
+    /**
+     * Flag a thread waiting on a channel gives up on: an actor failed
+     * (null for the actors, which park instead of waiting).
+     * */
+    const std::atomic<bool> *actorFailure() {
+        return actor == nullptr && ownScheduler != nullptr ? &ownScheduler->failed : nullptr;
+    }
+
+    /**
+     * Stops the actors of the previous run (the main VM).
+     * */
+    void dropActors() {
+        if (ownScheduler != nullptr) {
+            ownScheduler = nullptr;
+            scheduler = nullptr;
+        }
+    }
+
+    /**
+     * Channel of the value (dies if it's not one).
+     * */
+    Channel *channelOf(const EvaValue &value, const char *native) {
+        if (!IS_CHANNEL(value)) {
+            DIE << native << ": " << evaValueToConstantString(value) << " is not a channel";
+        }
+        return AS_CHANNEL(value)->channel.get();
+    }
+
+    // ----------------------------------------------
+    // Data-parallel natives:
+
+    /**
+     * Workers of the parallel natives, created by the first call: a
+     * pool of threads, each with its own VM (reused for all the calls).
+     * */
+    ParallelPool &parallelWorkers() {
+        if (parallelPool == nullptr) {
+            parallelPool = std::make_unique<ParallelPool>(actorThreads);
+            for (size_t i = 0; i < parallelPool->size(); i++) {
+                parallelVMs.push_back(childVM());
+            }
+        }
+        return *parallelPool;
+    }
+
+    /**
+     * Runs the callback for every i of the range [0, count), split into
+     * chunks run by the workers. Numeric callbacks run as kernels, the
+     * others by the VM of the worker, with a copy of the globals (as the
+     * actors). Mapped values, and the values the chunks are reduced to,
+     * are copied back as messages; the chunks are combined in order.
+     * */
+    EvaValue parallel(ParallelOp op, const EvaValue &range, const EvaValue &function,
+                      const EvaValue &combine, const EvaValue &init, const char *native) {
+        // A float64 array is read in place: the caller waits, and its GC doesn't run.
+        const double *input = nullptr;
+        size_t count;
+        if (IS_FLOAT64_ARRAY(range)) {
+            input = AS_FLOAT64_ARRAY(range)->items.data();
+            count = AS_FLOAT64_ARRAY(range)->items.size();
+        } else {
+            count = countOf(range, native);
+        }
+
+        if (count == 0) {
+            switch (op) {
+                case ParallelOp::FOR:
+                    return NUMBER(0);
+                case ParallelOp::MAP:
+                    return input != nullptr ? MEM(ALLOC_FLOAT64_ARRAY, std::vector<double>())
+                                            : MEM(ALLOC_ARRAY, std::vector<EvaValue>());
+                default:
+                    return init;
+            }
+        }
+
+        auto &pool = parallelWorkers();
+        auto chunksCount = pool.size() * PARALLEL_CHUNKS_PER_THREAD;
+        auto chunkSize = std::max<size_t>(1, (count + chunksCount - 1) / chunksCount);
+        chunksCount = (count + chunkSize - 1) / chunkSize;
+
+        ParallelJob job;
+        job.op = op;
+        std::vector<EvaValue> start{function, combine, init};
+        appendGlobals(start);
+        job.start = Message::copy(start);
+        job.program = program;
+        job.map = NumericKernel::of(function);
+        job.combine = NumericKernel::of(combine);
+        job.init = IS_OBJECT(init) ? BOOLEAN(false) : init;
+        job.input = input;
+        job.results.resize(chunksCount);
+        job.ready.assign(pool.size(), false);
+        if (op == ParallelOp::MAP && input != nullptr) {
+            job.numbers.resize(count);
+        }
+
+        auto error = pool.run(chunksCount, [&](size_t worker, size_t chunk) {
+            auto from = chunk * chunkSize;
+            parallelVMs[worker]->runChunk(job, worker, chunk, from, std::min(count, from + chunkSize));
+        });
+
+        Message reduced;
+        if (op == ParallelOp::REDUCE && error.empty()) {
+            error = pool.run(1, [&](size_t worker, size_t) {
+                reduced = parallelVMs[worker]->combineChunks(job, worker);
+            });
+        }
+
+        // The workers drop the values of the job.
+        for (size_t i = 0; i < pool.size(); i++) {
+            if (job.ready[i]) {
+                parallelVMs[i]->releaseJob();
+            }
+        }
+
+        // An error of a worker is raised by the caller.
+        if (!error.empty()) {
+            DIE << native << ": " << error;
+        }
+
+        maybeGC();
+        switch (op) {
+            case ParallelOp::FOR:
+                return NUMBER((double) count);
+            case ParallelOp::MAP: {
+                if (input != nullptr) {
+                    return ALLOC_FLOAT64_ARRAY(std::move(job.numbers));
+                }
+                // No GC until the array holds the values.
+                std::vector<EvaValue> items;
+                items.reserve(count);
+                for (auto &chunk: job.results) {
+                    for (auto &value: chunk) {
+                        items.push_back(value.create(*globals)[0]);
+                    }
+                }
+                return ALLOC_ARRAY(std::move(items));
+            }
+            default:
+                return reduced.create(*globals)[0];
+        }
+    }
+
+    /**
+     * Runs the chunk [from, to) of the job (on the worker thread).
+     * */
+    void runChunk(ParallelJob &job, size_t worker, size_t chunk, size_t from, size_t to) {
+        Heap::Scope scope(*heap);
+        ErrorLogMessage::context = [this]() { return errorLocation(); };
+
+        // An object accumulator is kept in the pinned slot 3 while f runs.
+        auto acc = job.init;
+        if (job.op == ParallelOp::REDUCE && IS_OBJECT(job.start.roots[2].value)) {
+            prepareJob(job, worker);
+            acc = pinned[2];
+        }
+
+        auto &results = job.results[chunk];
+        for (auto i = from; i < to; i++) {
+            auto ready = job.ready[worker];
+            if (ready) {
+                pinned[3] = acc;
+            }
+            EvaValue args[]{NUMBER(job.input != nullptr ? job.input[i] : (double) i)};
+            auto value = applyCallback(job, worker, job.map.get(), 0, args);
+            if (ready) {
+                acc = pinned[3];
+            }
+
+            if (job.op == ParallelOp::MAP && job.input != nullptr) {
+                job.numbers[i] = float64Item(value, "parallel-map");
+            } else if (job.op == ParallelOp::MAP) {
+                results.push_back(Message::copy({value}));
+            } else if (job.op == ParallelOp::REDUCE) {
+                EvaValue pair[]{acc, value};
+                acc = applyCallback(job, worker, job.combine.get(), 1, pair);
+            }
+        }
+
+        if (job.op == ParallelOp::REDUCE) {
+            results.push_back(Message::copy({acc}));
+        }
+        ErrorLogMessage::context = nullptr;
+    }
+
+    /**
+     * Combines the reduced chunks in order (on a worker thread).
+     * */
+    Message combineChunks(ParallelJob &job, size_t worker) {
+        Heap::Scope scope(*heap);
+        ErrorLogMessage::context = [this]() { return errorLocation(); };
+
+        // No GC between the calls: the accumulator is only held by the C++ code there.
+        auto valueOf = [&](const Message &message) {
+            if (message.roots[0].node == Message::NO_NODE) {
+                return message.roots[0].value;
+            }
+            prepareJob(job, worker);
+            return message.create(*globals)[0];
+        };
+
+        auto acc = valueOf(job.results[0][0]);
+        for (size_t i = 1; i < job.results.size(); i++) {
+            EvaValue pair[]{acc, valueOf(job.results[i][0])};
+            acc = applyCallback(job, worker, job.combine.get(), 1, pair);
+        }
+
+        ErrorLogMessage::context = nullptr;
+        return Message::copy({acc});
+    }
+
+    /**
+     * Calls the callback (0) or the combine function (1) of the job:
+     * as a kernel if it's one, otherwise (or if the kernel bails out)
+     * on the VM.
+     * */
+    EvaValue applyCallback(ParallelJob &job, size_t worker, const NumericKernel *kernel,
+                           size_t callback, const EvaValue *args) {
+        EvaValue result;
+        if (kernel != nullptr && kernel->call(args, result)) {
+            return result;
+        }
+        prepareJob(job, worker);
+        return callFunction(pinned[callback], args, callback + 1);
+    }
+
+    /**
+     * Sets the worker VM up for the job, once: the program, a copy of the
+     * globals, and the pinned callback, combine function and initial value.
+     * */
+    void prepareJob(ParallelJob &job, size_t worker) {
+        if (job.ready[worker]) {
+            return;
+        }
+        program = job.program;
+        auto start = job.start.create(*globals);
+        setProgramGlobals(start, 3);
+        pinned.assign(start.begin(), start.begin() + 3);
+        pinned.push_back(BOOLEAN(false));
+
+        useMainStack();
+        bp = sp;
+        callStack.clear();
+        job.ready[worker] = true;
+    }
+
+    /**
+     * Drops the values of the job (called once the workers are idle).
+     * */
+    void releaseJob() {
+        pinned.clear();
+        globals->globals.erase(globals->globals.begin() + baseGlobals, globals->globals.end());
+        useMainStack();
+        fn = nullptr;
+        program = nullptr;
+    }
+
+    /**
+     * Calls the function with the arguments from native code, on the main
+     * stack (no other call running): returns once the function does.
+     * */
+    EvaValue callFunction(const EvaValue &function, const EvaValue *args, size_t argsCount) {
+        auto base = sp;
+        push(function);
+        for (size_t i = 0; i < argsCount; i++) {
+            push(args[i]);
+        }
+
+        if (IS_NATIVE(function)) {
+            AS_NATIVE(function)->function();
+            auto result = pop();
+            sp = base;
+            return result;
+        }
+
+        fn = AS_FUNCTION(function);
+        fn->cells.resize(fn->co->freeCount);
+        bp = base;
+        ip = &fn->co->code[0];
+        return eval();
+    }
+
+    /**
+     * Number of elements (dies if the value is not a non-negative number).
+     * */
+    size_t countOf(const EvaValue &value, const char *native) {
+        if (!IS_NUMBER(value) || !(AS_NUMBER(value) >= 0)) {
+            DIE << native << ": " << evaValueToConstantString(value) << " is not a count";
+        }
+        return (size_t) AS_NUMBER(value);
+    }
+
+    /**
+     * Dies if the value is not a function (or a native) of the arity.
+     * */
+    void checkCallback(const EvaValue &value, size_t arity, const char *native) {
+        if ((IS_FUNCTION(value) && AS_FUNCTION(value)->co->arity == arity) ||
+            (IS_NATIVE(value) && AS_NATIVE(value)->arity == arity)) {
+            return;
+        }
+        DIE << native << ": " << evaValueToConstantString(value) << " is not a function of "
+            << arity << (arity == 1 ? " parameter" : " parameters");
+    }
+
+    // ----------------------------------------------
+    // Arrays:
+
+    /**
+     * Position of the element (dies if the index is out of the bounds).
+     * */
+    size_t indexOf(const EvaValue &index, size_t size) {
+        if (!IS_NUMBER(index) || !(AS_NUMBER(index) >= 0 && AS_NUMBER(index) < size)) {
+            DIE << "index: " << evaValueToConstantString(index) << " is out of the bounds of the array ("
+                << size << " elements)";
+        }
+        return (size_t) AS_NUMBER(index);
+    }
+
+    /**
+     * Elements of the float64 array (dies if it's not one, or is empty if nonEmpty).
+     * */
+    std::vector<double> &float64Of(const EvaValue &value, const char *native, bool nonEmpty = false) {
+        if (!IS_FLOAT64_ARRAY(value)) {
+            DIE << native << ": " << evaValueToConstantString(value) << " is not a float64 array";
+        }
+        auto &items = AS_FLOAT64_ARRAY(value)->items;
+        if (nonEmpty && items.empty()) {
+            DIE << native << ": the array is empty";
+        }
+        return items;
+    }
+
+    /**
+     * Element of a float64 array (dies if the value is not a number).
+     * */
+    double float64Item(const EvaValue &value, const char *native) {
+        if (!IS_NUMBER(value)) {
+            DIE << native << ": " << evaValueToConstantString(value) << " is not a number (float64 array)";
+        }
+        return AS_NUMBER(value);
+    }
+
+    /**
+     * Mask of (float64-less a x) or (float64-greater a x).
+     * */
+    EvaValue float64Compare(float64::Compare compare, const char *native) {
+        auto x = float64Item(peek(0), native);
+        auto mask = MEM(ALLOC_FLOAT64_ARRAY, std::vector<double>(float64Of(peek(1), native).size()));
+        auto &a = float64Of(peek(1), native);
+        float64::compare(a.data(), a.size(), x, compare, AS_FLOAT64_ARRAY(mask)->items.data());
+        return mask;
+    }
+
+    // ----------------------------------------------
+    // Maps:
+
+    /**
+     * Map of a native (dies if the value is not one).
+     * */
+    MapObject *mapOf(const EvaValue &value, const char *native) {
+        if (!IS_MAP(value)) {
+            DIE << native << ": " << evaValueToConstantString(value) << " is not a map";
+        }
+        return AS_MAP(value);
+    }
+
+    /**
+     * Dies if the value can't be a key.
+     * */
+    void checkKey(const EvaValue &key, const char *native) {
+        if (!MapObject::isKey(key)) {
+            DIE << native << ": " << evaValueToConstantString(key)
+                << " is not a valid key (a number, a boolean or a string)";
+        }
+    }
+
+    /**
+     * Sets the value of the key (through the write barrier).
+     * */
+    void setKey(MapObject *map, const EvaValue &key, const EvaValue &value, const char *native) {
+        checkKey(key, native);
+        collector->writeBarrier(key);
+        collector->writeBarrier(value);
+        map->set(key, value);
+    }
+
+    /**
+     * Array of the keys (or the values) of the map argument.
+     * */
+    EvaValue mapEntries(bool keys, const char *native) {
+        auto array = MEM(ALLOC_ARRAY, std::vector<EvaValue>());
+        auto map = mapOf(peek(0), native);
+        auto &items = AS_ARRAY(array)->items;
+        items.reserve(map->count);
+        map->forEach([&](const EvaValue &key, const EvaValue &value) {
+            items.push_back(keys ? key : value);
+        });
+        AS_ARRAY(array)->itemsResized();
+        return array;
+    }
+
+    // ----------------------------------------------
+    // GC Operations:
+
+    /**
+     * Visits all GC roots in place: stack slots, frames (the caller
+     * functions), the running function and coroutine (which holds the
+     * context of its resumer), the tasks (ready, or waiting for the event
+     * loop), the values pinned by a parallel job and globals (incl. natives).
+     * Objects of the program are frozen, so they're not traced. Calls
+     * visit(EvaValue &) for the values and visit(T *&) for the typed pointers.
+     * */
+    template<typename Visitor>
+    void traceRoots(Visitor &visit) {
+        for (auto stackEntry = stackBase; stackEntry != sp; stackEntry++) {
+            visit(*stackEntry);
+        }
+
+        for (auto &frame: callStack) {
+            visit(frame.fn);
+        }
+        visit(fn);
+        visit(coroutine);
+
+        for (auto &task: readyTasks) {
+            visit(task.first);
+            visit(task.second);
+        }
+        if (eventLoop != nullptr) {
+            eventLoop->trace(visit);
+        }
+
+        for (auto &value: pinned) {
+            visit(value);
+        }
+
+        for (auto &global: globals->globals) {
+            visit(global.value);
+        }
+    }
+
+    /**
+     * Current call stack as `;`-separated `function:line` frames (or just
+     * function names), main first: lines of the calls in the callers, and
+     * of the current instruction in the running function.
+     * */
+    std::string stackTrace(bool lines = true) {
+        if (fn == nullptr) {
+            return "(startup)";
+        }
+
+        std::string trace;
+        for (auto &frame: callStack) {
+            trace += frame.fn->co->name;
+            if (lines) {
+                trace += ":" + std::to_string(lineAt(frame.fn, frame.ra));
+            }
+            trace += ";";
+        }
+        trace += fn->co->name;
+        if (lines) {
+            trace += ":" + std::to_string(lineAt(fn, ip));
+        }
+        return trace;
+    }
+
+    /**
+     * Source location for the error messages: the running
+     * function and its callers (compile errors are located
+     * by EvaProgram::compile). Repeated frames (recursion)
+     * are collapsed, deep stacks keep only the innermost and
+     * outermost ERROR_TRACE_FRAMES.
+     * */
+    std::string errorLocation() {
+        if (fn == nullptr) {
+            return "";
+        }
+
+        // Innermost first: (frame, repeats) runs.
+        std::vector<std::pair<std::string, size_t>> frames;
+        auto push = [&frames](const std::string &frame) {
+            if (!frames.empty() && frames.back().first == frame) {
+                frames.back().second++;
+            } else {
+                frames.push_back({frame, 1});
+            }
+        };
+        push(fn->co->name + " (line " + std::to_string(lineAt(fn, ip)) + ")");
+        for (auto frame = callStack.rbegin(); frame != callStack.rend(); frame++) {
+            push(frame->fn->co->name + " (line " + std::to_string(lineAt(frame->fn, frame->ra)) + ")");
+        }
+
+        std::string location;
+        for (size_t i = 0; i < frames.size(); i++) {
+            if (frames.size() > 2 * ERROR_TRACE_FRAMES && i == ERROR_TRACE_FRAMES) {
+                auto skipped = frames.size() - 2 * ERROR_TRACE_FRAMES;
+                location += "\n    ... " + std::to_string(skipped) + " more frames";
+                i += skipped - 1;
+                continue;
+            }
+            location += "\n    at " + frames[i].first;
+            if (frames[i].second > 1) {
+                location += " x" + std::to_string(frames[i].second);
+            }
+        }
+        return location.substr(1);
+    }
+
+    /**
+     * Source line of the instruction before the address (the
+     * current one for ip, the call for the return addresses).
+     * */
+    static int lineAt(FunctionObject *function, uint8_t *address) {
+        return function->co->lineAt(address - &function->co->code[0] - 1);
+    }
+
+    /**
+     * Calls the visitor for every GC root (no allocation).
+     * */
+    void visitGCRoots(const RootVisitor &visitor) {
+        auto visit = makeObjectVisitor(std::cref(visitor));
+        traceRoots(visit);
+    }
+
+    /**
+     * Updates all object pointers held by the VM
+     * after the objects were relocated.
+     * */
+    void relocateRoots(const Forwarding &forward) {
+        Relocator relocate{forward};
+        traceRoots(relocate);
+    }
+
+    /**
+     * Writes the object graph reachable from the GC roots (see HeapSnapshot),
+     * with globals and stack slots as labelled roots. Returns the number of objects.
+     * */
+    size_t writeHeapSnapshot(std::ostream &out) {
+        HeapSnapshot snapshot(out);
+
+        for (auto &global: globals->globals) {
+            snapshot.addRoot("global " + global.name, global.value);
+        }
+        for (auto stackEntry = stackBase; stackEntry != sp; stackEntry++) {
+            snapshot.addRoot("stack[" + std::to_string(stackEntry - stackBase) + "]", *stackEntry);
+        }
+        for (size_t i = 0; i < callStack.size(); i++) {
+            snapshot.addRoot("frame[" + std::to_string(i) + "]", callStack[i].fn);
+        }
+        snapshot.addRoot("fn", fn);
+        snapshot.addRoot("coroutine", coroutine);
+        for (auto &task: readyTasks) {
+            snapshot.addRoot("ready task", task.first);
+        }
+        if (eventLoop != nullptr) {
+            auto addWaiting = makeObjectVisitor([&snapshot](Traceable *task) { snapshot.addRoot("waiting task", task); });
+            eventLoop->trace(addWaiting);
+        }
+        for (auto &value: pinned) {
+            snapshot.addRoot("pinned", value);
+        }
+
+        return snapshot.write();
+    }
+
+    /**
+     * Spawns a pottential GC cycle.
+     * */
+    void maybeGC() {
+        // Note: an incremental cycle in progress advances on every allocation.
+        if (!collector->shouldCollect()) {
+            return;
+        }
+
+        if (collector->incremental) {
+            collector->step(gcRoots);
+            return;
+        }
+
+        collector->gc(gcRoots);
+    }
+
+    /**
+     * Whether to print the bytecode of the compiled programs.
+     * */
+    bool disassemble = true;
+
+    /**
+     * Heap of this VM (isolate): declared first, so
+     * it's created before and released after anything else.
+     * */
+    std::unique_ptr<Heap> heap;
+
+    /**
+     * Global object
+     * */
+    std::shared_ptr<Global> globals;
+
+    /**
+     * Number of globals set up by the VM (natives and constants),
+     * the program globals follow.
+     * */
+    size_t baseGlobals = 0;
+
+    /**
+     * Program being run: the VM globals and functions
+     * point to its (shared) code and constants.
+     * */
+    std::shared_ptr<const EvaProgram> program;
+
+    /**
+     * Garbage collector
+     * */
+    std::unique_ptr<EvaCollector> collector;
+
+    /**
+     * GC roots provider (visitGCRoots), created once.
+     * */
+    RootsProvider gcRoots = [this](const RootVisitor &visitor) { visitGCRoots(visitor); };
+
+    /**
+     * Instruction pointer.
+     * */
+    uint8_t *ip;
+
+    /**
+     * Stack pointer.
+     * */
+    EvaValue *sp;
+
+    /**
+     * Base pointer (aka Frame pointer).
+     * */
+    EvaValue *bp;
+
+    /**
+     * Operands stack.
+     * */
+    std::array<EvaValue, STACK_LIMIT> stack;
+
+    /**
+     * Bounds of the current stack segment: the main stack,
+     * or the one of the running coroutine.
+     * */
+    EvaValue *stackBase = &stack[0];
+
+    EvaValue *stackLimit = &stack[0] + STACK_LIMIT;
+
+    /**
+     * Separate stack for the calls. Keeps return address.
+     *
+     * Note: a vector, so the GC can walk (and relocate) the frames.
+     * */
+    std::vector<Frame> callStack;
+
+    /**
+     * Currently executing function.
+     * */
+    FunctionObject *fn = nullptr;
+
+    /**
+     * Running coroutine (null on the main stack).
+     * */
+    CoroutineObject *coroutine = nullptr;
+
+    /**
+     * Event loop (see loop()).
+     * */
+    std::unique_ptr<EvaEventLoop> eventLoop;
+
+    /**
+     * Tasks ready to run, with the value they are resumed with.
+     * */
+    std::deque<std::pair<CoroutineObject *, EvaValue>> readyTasks;
+
+    /**
+     * Tasks done since run-loop was called.
+     * */
+    size_t tasksDone = 0;
+
+    /**
+     * Context switch requested by the native being called.
+     * */
+    enum class AsyncRequest {
+        NONE,
+        PARK,
+        SCHEDULE,
+        BLOCK
+    };
+
+    AsyncRequest asyncRequest = AsyncRequest::NONE;
+
+    /**
+     * Whether the task being suspended waits for the event loop.
+     * */
+    bool parking = false;
+
+    /**
+     * Number of the actor worker threads.
+     * */
+    size_t actorThreads = std::max(1u, std::thread::hardware_concurrency());
+
+    /**
+     * Scheduler of the actors: owned by the main VM, shared by its actors.
+     * */
+    ActorScheduler *scheduler = nullptr;
+
+    std::unique_ptr<ActorScheduler> ownScheduler;
+
+    /**
+     * Actor run by this VM (null for the main VM).
+     * */
+    Actor *actor = nullptr;
+
+    /**
+     * Why eval returned for the actor, and what's left of its time slice.
+     * */
+    ActorExit actorExit = ActorExit::DONE;
+
+    size_t sliceBudget = 0;
+
+    /**
+     * Workers of the parallel natives (see parallelWorkers()).
+     * */
+    std::vector<std::shared_ptr<EvaVM>> parallelVMs;
+
+    std::unique_ptr<ParallelPool> parallelPool;
+
+    /**
+     * Values of the parallel job run by this VM (a worker): the callback,
+     * the combine function, the initial value and the accumulator.
      * */
-    FunctionObject *fn;
+    std::vector<EvaValue> pinned;
 
     /**
      * Dumps the current stack
      * */
     void dumpStack() {
         std::cout << "\n---------- Stack ----------\n";
-        if (sp == stack.begin()) {
+        if (sp == stackBase) {
             std::cout << "(empty)";
         }
 
         auto csp = sp - 1;
-        while (csp >= stack.begin()) {
+        while (csp >= stackBase) {
             std::cout << *csp-- << "\n";
         }
         std::cout << "\n";
@@ -1,9 +1,16 @@
 #ifndef EVA_VM_EVAVALUE_H
 #define EVA_VM_EVAVALUE_H
 
+#include <array>
+#include <atomic>
+#include <cstring>
 #include <string>
 #include <functional>
-#include <list>
+#include <map>
+#include <memory>
+#include "../bytecode/LineTable.h"
+#include "../gc/Heap.h"
+#include "../gc/HeapProfiler.h"
 
 /**
  * Eva value type.
@@ -17,84 +24,125 @@ enum class EvaValueType {
 /**
  * Object type.
  * */
-enum class ObjectType {
+enum class ObjectType : uint8_t {
     STRING,
     CODE,
     NATIVE,
     FUNCTION,
     CELL,
     CLASS,
-    INSTANCE
+    INSTANCE,
+    COROUTINE,
+    CHANNEL,
+    ARRAY,
+    FLOAT64_ARRAY,
+    MAP
 };
 
+#define OBJECT_TYPES_COUNT 12
+
 /**
  * Base traceable object
  *
- * Stores object header.
+ * Stores object header, packed into one 8-byte word: mark bit, age,
+ * heap size class, type tag and heap profiler sample flag. The object size is not stored, it
+ * comes from the size class (or the large object header).
  * */
-struct Traceable {
-    /* Whether the object was marked during the trace, used in Mark-Sweep GC. */
-    bool marked;
+struct alignas(8) Traceable {
+    /* Whether the object was marked during the trace, used in Mark-Sweep GC.
+     * Atomic, since it's set by several threads during parallel marking. */
+    std::atomic<bool> marked;
+
+    /* Number of collection cycles the object survived (saturating). */
+    uint8_t age;
+
+    /* Heap size class, HEAP_LARGE_SIZE_CLASS for large objects. */
+    uint8_t sizeClass;
+
+    /* Object type tag (set by Object). */
+    ObjectType type;
 
-    size_t size;
+    /* Whether the allocation was sampled by the heap profiler. */
+    bool sampled;
+
+    Traceable() : marked(Heap::current->allocationMark), age(0), sampled(false) {}
 
     /**
-     * Allocator.
+     * Copies the header, used when the object is relocated.
      * */
-    static void *operator new(size_t size) {
-        void *object = ::operator new(size);
+    Traceable(const Traceable &other)
+            : marked(other.marked.load()),
+              age(other.age),
+              sizeClass(other.sizeClass),
+              type(other.type),
+              sampled(other.sampled) {}
 
-        ((Traceable *) object)->size = size;
-
-        Traceable::objects.push_back((Traceable *) object);
-        Traceable::bytesAllocated += size;
+    /**
+     * Memory taken by the object.
+     * */
+    size_t size() const {
+        return Heap::sizeOf(this, sizeClass);
+    }
 
-        return object;
+    /**
+     * Allocator.
+     * */
+    static void *operator new(size_t size) {
+        return Heap::current->allocate(size);
     }
 
     /**
      * Deallocator.
      * */
     static void operator delete(void *object) {
-        Traceable::bytesAllocated -= ((Traceable *) object)->size;
-        free(object);
-        // Note: remove from the Traceable::object during GC cycle.
+        Heap::free(object, ((Traceable *) object)->sizeClass);
     }
 
-    /* Cleanup for all objects. */
-    static void cleanup() {
-        for (auto &object: objects) {
-            delete object;
-        }
-        objects.clear();
+    /**
+     * Placement (relocation during the compaction).
+     * */
+    static void *operator new(size_t size, void *place) {
+        return place;
     }
 
-    /* Prints memory stats. */
-    static void printStats() {
-        std::cout << "------------------------------\n";
-        std::cout << "Memory stats:\n\n";
-        std::cout << "Objects allocated : " << std::dec << Traceable::objects.size() << "\n";
-        std::cout << "Bytes allocated   : " << std::dec << Traceable::bytesAllocated << "\n\n";
-    }
+    static void operator delete(void *object, void *place) {}
 
-    /* Total number of allocated bytes */
-    static size_t bytesAllocated;
+    /* Cleanup for all objects of the heap. */
+    static void cleanup(Heap &heap);
 
-    /* List of all allocated objects */
-    static std::list<Traceable *> objects;
+    /* Prints memory stats of the heap. */
+    static void printStats(Heap &heap);
 };
 
-size_t Traceable::bytesAllocated{0};
+static_assert(sizeof(Traceable) == 8, "Object header must be one word");
 
-std::list<Traceable *> Traceable::objects{};
+/**
+ * Size of the object of the given type.
+ * */
+size_t objectTypeSize(ObjectType type);
+
+static_assert(OBJECT_TYPES_COUNT <= HEAP_MAX_OBJECT_TYPES, "Heap allocation counters per type");
 
 /**
  * Base object.
  * */
 struct Object : public Traceable {
-    explicit Object(ObjectType type) : type(type) {};
+    explicit Object(ObjectType type) {
+        this->type = type;
 
-    ObjectType type;
+        auto size = objectTypeSize(type);
+        sizeClass = Heap::sizeClassOf(size);
+
+        auto &counter = Heap::current->allocations[(size_t) type];
+        counter.objects++;
+        counter.bytes += size;
+        Heap::current->objectBytesAllocated += this->size();
+
+        if ((HeapProfiler::bytesUntilSample -= size) < 0) {
+            HeapProfiler::sample(this, size);
+            sampled = true;
+        }
+    };
 };
 
 /**
@@ -140,6 +188,17 @@ struct ClassObject : public Object {
     void setProp(const std::string &prop, const EvaValue &value) {
         properties[prop] = value;
     }
+
+    /**
+     * Visits all object pointers (in place).
+     * */
+    template<typename Visitor>
+    void trace(Visitor &visit) {
+        visit(superClass);
+        for (auto &prop: properties) {
+            visit(prop.second);
+        }
+    }
 };
 
 /**
@@ -161,6 +220,17 @@ struct InstanceObject : public Object {
         }
         return cls->getProp(prop);
     }
+
+    /**
+     * Visits all object pointers (in place).
+     * */
+    template<typename Visitor>
+    void trace(Visitor &visit) {
+        visit(cls);
+        for (auto &prop: properties) {
+            visit(prop.second);
+        }
+    }
 };
 
 /**
@@ -239,8 +309,22 @@ struct CodeObject : public Object {
      * */
     size_t freeCount = 0;
 
+    /**
+     * Source lines of the bytecode.
+     * */
+    LineTable lines;
+
     void insertAtOffset(int offset, uint8_t byte) {
-        code.insert((offset < 0 ? code.end() : code.begin()) + offset, byte);
+        auto position = (offset < 0 ? code.end() : code.begin()) + offset;
+        lines.insert(position - code.begin(), 1);
+        code.insert(position, byte);
+    }
+
+    /**
+     * Source line of the instruction containing the offset (0 if unknown).
+     * */
+    int lineAt(size_t offset) const {
+        return lines.lineAt(offset);
     }
 
     void addLocal(const std::string &name) {
@@ -278,6 +362,16 @@ struct CodeObject : public Object {
         }
         return -1;
     }
+
+    /**
+     * Visits all object pointers (in place).
+     * */
+    template<typename Visitor>
+    void trace(Visitor &visit) {
+        for (auto &constant: constants) {
+            visit(constant);
+        }
+    }
 };
 
 /**
@@ -290,6 +384,13 @@ struct CellObject : public Object {
 
     EvaValue value;
 
+    /**
+     * Visits all object pointers (in place).
+     * */
+    template<typename Visitor>
+    void trace(Visitor &visit) {
+        visit(value);
+    }
 };
 
 /**
@@ -301,8 +402,633 @@ struct FunctionObject : public Object {
     CodeObject *co;
 
     std::vector<CellObject *> cells;
+
+    /**
+     * Visits all object pointers (in place).
+     * */
+    template<typename Visitor>
+    void trace(Visitor &visit) {
+        visit(co);
+        for (auto &cell: cells) {
+            visit(cell);
+        }
+    }
+};
+
+/**
+ * Stack frame for function calls.
+ * */
+struct Frame {
+    /**
+     * Return address of the caller.
+     * */
+    uint8_t *ra;
+
+    /**
+     * Base pointer of the caller.
+     * */
+    EvaValue *bp;
+
+    /**
+     * Reference to the running function:
+     * contains code, locals, etc.
+     * */
+    FunctionObject *fn;
+};
+
+/**
+ * Max number of values on the operand stack of a coroutine.
+ * */
+#define COROUTINE_STACK_LIMIT 256
+
+/**
+ * Coroutine: a function run on its own operand stack segment and
+ * frame stack, which can suspend itself (yield) and be resumed.
+ *
+ * The VM runs one context at a time, and switches by swapping its
+ * registers (stack base, sp, bp, ip, fn and frames) with the ones saved
+ * here: while suspended, the coroutine holds its own context; while
+ * running, it holds the context of its resumer (the main program, or
+ * another coroutine), which continues on yield or return.
+ * */
+struct CoroutineObject : public Object {
+    explicit CoroutineObject(FunctionObject *function)
+            : Object(ObjectType::COROUTINE), function(function), stack(COROUTINE_STACK_LIMIT) {
+        stackBase = sp = bp = &stack[0];
+    }
+
+    /**
+     * Function run by the coroutine.
+     * */
+    FunctionObject *function;
+
+    /**
+     * Own operand stack segment (fixed size, saved pointers point into it).
+     * */
+    std::vector<EvaValue> stack;
+
+    /**
+     * Saved context.
+     * */
+    EvaValue *stackBase;
+
+    EvaValue *sp;
+
+    EvaValue *bp;
+
+    uint8_t *ip = nullptr;
+
+    FunctionObject *fn = nullptr;
+
+    std::vector<Frame> callStack;
+
+    /**
+     * Coroutine which resumed this one (null for the main program).
+     * */
+    CoroutineObject *resumer = nullptr;
+
+    /**
+     * Whether the function was entered, is in the chain of
+     * running coroutines (itself or a resumer), has returned.
+     * */
+    bool started = false;
+
+    bool running = false;
+
+    bool done = false;
+
+    /**
+     * Whether it's a task, run by the event loop (see go).
+     * */
+    bool task = false;
+
+    /**
+     * Visits all object pointers (in place).
+     * */
+    template<typename Visitor>
+    void trace(Visitor &visit) {
+        visit(function);
+        for (auto slot = stackBase; slot != sp; slot++) {
+            visit(*slot);
+        }
+        for (auto &frame: callStack) {
+            visit(frame.fn);
+        }
+        visit(fn);
+        visit(resumer);
+    }
+};
+
+struct Channel;
+
+/**
+ * Channel object: a handle to a channel between actors (see EvaActors.h).
+ * Copied to the heap of another VM, it's a handle to the same channel.
+ * */
+struct ChannelObject : public Object {
+    explicit ChannelObject(std::shared_ptr<Channel> channel)
+            : Object(ObjectType::CHANNEL), channel(std::move(channel)) {}
+
+    std::shared_ptr<Channel> channel;
+};
+
+/**
+ * Array: contiguous storage of values.
+ * */
+struct ArrayObject : public Object {
+    explicit ArrayObject(std::vector<EvaValue> items) : Object(ObjectType::ARRAY), items(std::move(items)) {
+        itemsResized();
+    }
+
+    std::vector<EvaValue> items;
+
+    /**
+     * Bytes of the items accounted in the heap (they are allocated outside of it).
+     * */
+    size_t externalBytes = 0;
+
+    /**
+     * Accounts the items in the heap, called once they may have grown.
+     * */
+    void itemsResized() {
+        Heap::current->resizeExternal(externalBytes, items.capacity() * sizeof(EvaValue));
+    }
+
+    /**
+     * Visits all object pointers (in place).
+     * */
+    template<typename Visitor>
+    void trace(Visitor &visit) {
+        for (auto &item: items) {
+            visit(item);
+        }
+    }
+};
+
+/**
+ * Typed array of numbers, stored unboxed (see Float64Kernels.h):
+ * holds no object pointers, so the GC never scans the elements.
+ * */
+struct Float64ArrayObject : public Object {
+    explicit Float64ArrayObject(std::vector<double> items)
+            : Object(ObjectType::FLOAT64_ARRAY), items(std::move(items)) {
+        itemsResized();
+    }
+
+    std::vector<double> items;
+
+    /**
+     * Bytes of the items accounted in the heap (see ArrayObject).
+     * */
+    size_t externalBytes = 0;
+
+    void itemsResized() {
+        Heap::current->resizeExternal(externalBytes, items.capacity() * sizeof(double));
+    }
+};
+
+/**
+ * Number of slots of a map when its first key is set.
+ * */
+#define MAP_MIN_CAPACITY 8
+
+/**
+ * Hash map keyed by numbers, booleans and strings (compared by their
+ * contents, so equal strings are the same key).
+ *
+ * Open addressing with Robin Hood probing, in one array of slots: a key
+ * is inserted at the first slot whose key is closer to its home slot than
+ * this one would be (taking over the slot, the displaced key moving on),
+ * so probe lengths stay short, and a lookup stops as soon as it meets a
+ * closer key. Deletion shifts the next keys back (no tombstones). The
+ * table doubles at 7/8 load: get, set and delete are amortized O(1).
+ * */
+struct MapObject : public Object {
+    MapObject() : Object(ObjectType::MAP) {}
+
+    struct Slot {
+        EvaValue key;
+
+        EvaValue value;
+
+        /* Hash of the key (so the table grows without rehashing). */
+        uint32_t hash;
+
+        /* Distance from the home slot of the key + 1, 0 if the slot is empty. */
+        uint32_t distance;
+    };
+
+    std::vector<Slot> slots;
+
+    /**
+     * Number of keys.
+     * */
+    size_t count = 0;
+
+    /**
+     * Bytes of the slots accounted in the heap (see ArrayObject).
+     * */
+    size_t externalBytes = 0;
+
+    /**
+     * Whether the value can be a key: a number (not NaN), a boolean or a string.
+     * */
+    static bool isKey(const EvaValue &key) {
+        // NaN is not equal to itself, so it could never be found.
+        return (key.type == EvaValueType::NUMBER && key.number == key.number) ||
+               key.type == EvaValueType::BOOLEAN ||
+               (key.type == EvaValueType::OBJECT && key.object->type == ObjectType::STRING);
+    }
+
+    /**
+     * Value of the key, null if it's not in the map.
+     * */
+    EvaValue *find(const EvaValue &key) {
+        auto index = indexOf(key);
+        return index == slots.size() ? nullptr : &slots[index].value;
+    }
+
+    /**
+     * Value of the key, set to the initial value first if
+     * the key is new (the reference is valid until the next insertion).
+     * */
+    EvaValue &slotOf(const EvaValue &key, const EvaValue &initial) {
+        auto value = find(key);
+        if (value != nullptr) {
+            return *value;
+        }
+        if ((count + 1) * 8 > slots.size() * 7) {
+            resize(std::max<size_t>(slots.size() * 2, MAP_MIN_CAPACITY));
+        }
+        count++;
+        return *insert({key, initial, hashOf(key), 1});
+    }
+
+    void set(const EvaValue &key, const EvaValue &value) {
+        slotOf(key, value) = value;
+    }
+
+    /**
+     * Removes the key, returns whether it was in the map.
+     * */
+    bool remove(const EvaValue &key) {
+        auto index = indexOf(key);
+        if (index == slots.size()) {
+            return false;
+        }
+        auto mask = slots.size() - 1;
+        for (;;) {
+            auto &next = slots[(index + 1) & mask];
+            if (next.distance <= 1) {
+                break;
+            }
+            slots[index] = next;
+            slots[index].distance--;
+            index = (index + 1) & mask;
+        }
+        slots[index] = Slot{};
+        count--;
+        return true;
+    }
+
+    /**
+     * Allocates the slots for the number of keys in advance.
+     * */
+    void reserve(size_t keys) {
+        auto capacity = std::max<size_t>(slots.size(), MAP_MIN_CAPACITY);
+        while (keys * 8 > capacity * 7) {
+            capacity *= 2;
+        }
+        if (capacity != slots.size()) {
+            resize(capacity);
+        }
+    }
+
+    /**
+     * Calls fn(key, value) for all the entries (in slot order).
+     * */
+    template<typename Fn>
+    void forEach(Fn fn) {
+        for (auto &slot: slots) {
+            if (slot.distance != 0) {
+                fn(slot.key, slot.value);
+            }
+        }
+    }
+
+    /**
+     * Visits all object pointers (in place).
+     * */
+    template<typename Visitor>
+    void trace(Visitor &visit) {
+        for (auto &slot: slots) {
+            if (slot.distance != 0) {
+                visit(slot.key);
+                visit(slot.value);
+            }
+        }
+    }
+
+private:
+    /**
+     * Slot of the key, slots.size() if it's not in the map.
+     * */
+    size_t indexOf(const EvaValue &key) {
+        if (count == 0) {
+            return slots.size();
+        }
+        auto hash = hashOf(key);
+        auto mask = slots.size() - 1;
+        for (uint32_t distance = 1;; distance++) {
+            auto index = (hash + distance - 1) & mask;
+            auto &slot = slots[index];
+            if (slot.distance < distance) {
+                return slots.size();
+            }
+            if (slot.hash == hash && equal(slot.key, key)) {
+                return index;
+            }
+        }
+    }
+
+    /**
+     * Places the entry (of a new key), returns its value.
+     * */
+    EvaValue *insert(Slot entry) {
+        auto mask = slots.size() - 1;
+        EvaValue *placed = nullptr;
+        for (auto index = (entry.hash + entry.distance - 1) & mask;; index = (index + 1) & mask) {
+            auto &slot = slots[index];
+            if (slot.distance == 0) {
+                slot = entry;
+                return placed != nullptr ? placed : &slot.value;
+            }
+            if (slot.distance < entry.distance) {
+                // Robin Hood: the entry takes the slot of the closer key, which moves on.
+                std::swap(slot, entry);
+                if (placed == nullptr) {
+                    placed = &slot.value;
+                }
+            }
+            entry.distance++;
+        }
+    }
+
+    void resize(size_t capacity) {
+        std::vector<Slot> old(capacity);
+        old.swap(slots);
+        for (auto &slot: old) {
+            if (slot.distance != 0) {
+                slot.distance = 1;
+                insert(slot);
+            }
+        }
+        Heap::current->resizeExternal(externalBytes, slots.capacity() * sizeof(Slot));
+    }
+
+    static uint32_t hashOf(const EvaValue &key) {
+        uint64_t bits;
+        switch (key.type) {
+            case EvaValueType::NUMBER: {
+                auto number = key.number == 0 ? 0.0 : key.number; // -0 is 0
+                std::memcpy(&bits, &number, sizeof(bits));
+                break;
+            }
+            case EvaValueType::BOOLEAN:
+                bits = key.boolean ? 0x9e3779b97f4a7c15ULL : 0x6a09e667f3bcc909ULL;
+                break;
+            default:
+                bits = std::hash<std::string>{}(((StringObject *) key.object)->string);
+        }
+        // Mixes all the bits into the low ones (the slot index).
+        bits ^= bits >> 33;
+        bits *= 0xff51afd7ed558ccdULL;
+        bits ^= bits >> 33;
+        bits *= 0xc4ceb9fe1a85ec53ULL;
+        bits ^= bits >> 33;
+        return (uint32_t) bits;
+    }
+
+    static bool equal(const EvaValue &a, const EvaValue &b) {
+        if (a.type != b.type) {
+            return false;
+        }
+        switch (a.type) {
+            case EvaValueType::NUMBER:
+                return a.number == b.number;
+            case EvaValueType::BOOLEAN:
+                return a.boolean == b.boolean;
+            default:
+                return a.object == b.object ||
+                       ((StringObject *) a.object)->string == ((StringObject *) b.object)->string;
+        }
+    }
 };
 
+size_t objectTypeSize(ObjectType type) {
+    switch (type) {
+        case ObjectType::STRING:
+            return sizeof(StringObject);
+        case ObjectType::CODE:
+            return sizeof(CodeObject);
+        case ObjectType::NATIVE:
+            return sizeof(NativeObject);
+        case ObjectType::FUNCTION:
+            return sizeof(FunctionObject);
+        case ObjectType::CELL:
+            return sizeof(CellObject);
+        case ObjectType::CLASS:
+            return sizeof(ClassObject);
+        case ObjectType::INSTANCE:
+            return sizeof(InstanceObject);
+        case ObjectType::COROUTINE:
+            return sizeof(CoroutineObject);
+        case ObjectType::CHANNEL:
+            return sizeof(ChannelObject);
+        case ObjectType::ARRAY:
+            return sizeof(ArrayObject);
+        case ObjectType::FLOAT64_ARRAY:
+            return sizeof(Float64ArrayObject);
+        case ObjectType::MAP:
+            return sizeof(MapObject);
+    }
+    return 0; // Unreachable
+}
+
+/**
+ * Name of the object type.
+ * */
+const char *objectTypeName(ObjectType type) {
+    switch (type) {
+        case ObjectType::STRING:
+            return "STRING";
+        case ObjectType::CODE:
+            return "CODE";
+        case ObjectType::NATIVE:
+            return "NATIVE";
+        case ObjectType::FUNCTION:
+            return "FUNCTION";
+        case ObjectType::CELL:
+            return "CELL";
+        case ObjectType::CLASS:
+            return "CLASS";
+        case ObjectType::INSTANCE:
+            return "INSTANCE";
+        case ObjectType::COROUTINE:
+            return "COROUTINE";
+        case ObjectType::CHANNEL:
+            return "CHANNEL";
+        case ObjectType::ARRAY:
+            return "ARRAY";
+        case ObjectType::FLOAT64_ARRAY:
+            return "FLOAT64_ARRAY";
+        case ObjectType::MAP:
+            return "MAP";
+    }
+    return ""; // Unreachable
+}
+
+/**
+ * Destroys the object: runs the destructor of its actual
+ * type (Traceable has no virtual one) and frees the memory.
+ * */
+void destroyObject(Traceable *object) {
+    if (object->sampled) {
+        HeapProfiler::free(object);
+    }
+
+    switch (((Object *) object)->type) {
+        case ObjectType::STRING:
+            delete (StringObject *) object;
+            break;
+        case ObjectType::CODE:
+            delete (CodeObject *) object;
+            break;
+        case ObjectType::NATIVE:
+            delete (NativeObject *) object;
+            break;
+        case ObjectType::FUNCTION:
+            delete (FunctionObject *) object;
+            break;
+        case ObjectType::CELL:
+            delete (CellObject *) object;
+            break;
+        case ObjectType::CLASS:
+            delete (ClassObject *) object;
+            break;
+        case ObjectType::INSTANCE:
+            delete (InstanceObject *) object;
+            break;
+        case ObjectType::COROUTINE:
+            delete (CoroutineObject *) object;
+            break;
+        case ObjectType::CHANNEL:
+            delete (ChannelObject *) object;
+            break;
+        case ObjectType::ARRAY:
+            delete (ArrayObject *) object;
+            break;
+        case ObjectType::FLOAT64_ARRAY:
+            delete (Float64ArrayObject *) object;
+            break;
+        case ObjectType::MAP:
+            delete (MapObject *) object;
+            break;
+    }
+}
+
+/**
+ * Storage the object holds outside of the heap (accounted in it).
+ * */
+size_t externalSizeOf(Traceable *object) {
+    switch (((Object *) object)->type) {
+        case ObjectType::ARRAY:
+            return ((ArrayObject *) object)->externalBytes;
+        case ObjectType::FLOAT64_ARRAY:
+            return ((Float64ArrayObject *) object)->externalBytes;
+        case ObjectType::MAP:
+            return ((MapObject *) object)->externalBytes;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Visits all object pointers of the object: calls visit(EvaValue &)
+ * for the values and visit(T *&) for the typed pointers (may be null).
+ * */
+template<typename Visitor>
+void traceObject(Traceable *object, Visitor &visit) {
+    switch (((Object *) object)->type) {
+        case ObjectType::STRING:
+        case ObjectType::NATIVE:
+        case ObjectType::CHANNEL:
+        case ObjectType::FLOAT64_ARRAY:
+            break;
+        case ObjectType::CODE:
+            ((CodeObject *) object)->trace(visit);
+            break;
+        case ObjectType::FUNCTION:
+            ((FunctionObject *) object)->trace(visit);
+            break;
+        case ObjectType::CELL:
+            ((CellObject *) object)->trace(visit);
+            break;
+        case ObjectType::CLASS:
+            ((ClassObject *) object)->trace(visit);
+            break;
+        case ObjectType::INSTANCE:
+            ((InstanceObject *) object)->trace(visit);
+            break;
+        case ObjectType::COROUTINE:
+            ((CoroutineObject *) object)->trace(visit);
+            break;
+        case ObjectType::ARRAY:
+            ((ArrayObject *) object)->trace(visit);
+            break;
+        case ObjectType::MAP:
+            ((MapObject *) object)->trace(visit);
+            break;
+    }
+}
+
+/**
+ * Trace visitor calling fn(Traceable *) for every
+ * referenced object (skips non-objects and nulls).
+ * */
+template<typename Fn>
+struct ObjectVisitor {
+    template<typename T>
+    void operator()(T *object) {
+        if (object != nullptr) {
+            fn((Traceable *) object);
+        }
+    }
+
+    void operator()(const EvaValue &value) {
+        if (value.type == EvaValueType::OBJECT) {
+            fn((Traceable *) value.object);
+        }
+    }
+
+    Fn fn;
+};
+
+template<typename Fn>
+ObjectVisitor<Fn> makeObjectVisitor(Fn fn) {
+    return ObjectVisitor<Fn>{fn};
+}
+
+void Traceable::cleanup(Heap &heap) {
+    auto space = heap.detach();
+    heap.freeAll(space, [&heap](void *object) {
+        heap.freeExternal(externalSizeOf((Traceable *) object));
+        destroyObject((Traceable *) object);
+    });
+    heap.attach(space);
+    heap.releaseEmptyPages(false);
+}
+
 /* ------------------------------------- */
 // Constructors:
 #define NUMBER(value) ((EvaValue){.type = EvaValueType::NUMBER, .number = (value)})
@@ -326,6 +1052,16 @@ struct FunctionObject : public Object {
     ((EvaValue){.type = EvaValueType::OBJECT, .object = (Object*)new ClassObject(name, superClass)})
 #define ALLOC_INSTANCE(cls) \
     ((EvaValue){.type = EvaValueType::OBJECT, .object = (Object*)new InstanceObject(cls)})
+#define ALLOC_COROUTINE(fn) \
+    ((EvaValue){.type = EvaValueType::OBJECT, .object = (Object*)new CoroutineObject(fn)})
+#define ALLOC_CHANNEL(channel) \
+    ((EvaValue){.type = EvaValueType::OBJECT, .object = (Object*)new ChannelObject(channel)})
+#define ALLOC_ARRAY(items) \
+    ((EvaValue){.type = EvaValueType::OBJECT, .object = (Object*)new ArrayObject(items)})
+#define ALLOC_FLOAT64_ARRAY(items) \
+    ((EvaValue){.type = EvaValueType::OBJECT, .object = (Object*)new Float64ArrayObject(items)})
+#define ALLOC_MAP() \
+    ((EvaValue){.type = EvaValueType::OBJECT, .object = (Object*)new MapObject()})
 
 
 /* ------------------------------------- */
@@ -343,6 +1079,11 @@ struct FunctionObject : public Object {
 #define AS_CELL(evaValue) ((CellObject*)(evaValue).object)
 #define AS_CLASS(evaValue) ((ClassObject*)(evaValue).object)
 #define AS_INSTANCE(evaValue) ((InstanceObject*)(evaValue).object)
+#define AS_COROUTINE(evaValue) ((CoroutineObject*)(evaValue).object)
+#define AS_CHANNEL(evaValue) ((ChannelObject*)(evaValue).object)
+#define AS_ARRAY(evaValue) ((ArrayObject*)(evaValue).object)
+#define AS_FLOAT64_ARRAY(evaValue) ((Float64ArrayObject*)(evaValue).object)
+#define AS_MAP(evaValue) ((MapObject*)(evaValue).object)
 
 /* ------------------------------------- */
 // Testers:
@@ -360,6 +1101,11 @@ struct FunctionObject : public Object {
 #define IS_CELL(evaValue) IS_OBJECT_TYPE(evaValue, ObjectType::CELL)
 #define IS_CLASS(evaValue) IS_OBJECT_TYPE(evaValue, ObjectType::CLASS)
 #define IS_INSTANCE(evaValue) IS_OBJECT_TYPE(evaValue, ObjectType::INSTANCE)
+#define IS_COROUTINE(evaValue) IS_OBJECT_TYPE(evaValue, ObjectType::COROUTINE)
+#define IS_CHANNEL(evaValue) IS_OBJECT_TYPE(evaValue, ObjectType::CHANNEL)
+#define IS_ARRAY(evaValue) IS_OBJECT_TYPE(evaValue, ObjectType::ARRAY)
+#define IS_FLOAT64_ARRAY(evaValue) IS_OBJECT_TYPE(evaValue, ObjectType::FLOAT64_ARRAY)
+#define IS_MAP(evaValue) IS_OBJECT_TYPE(evaValue, ObjectType::MAP)
 
 /**
  * String representation used in constants for debug.
@@ -383,12 +1129,72 @@ std::string evaValueToTypeString(const EvaValue &evaValue) {
         return "CLASS";
     } else if (IS_INSTANCE(evaValue)) {
         return "INSTANCE";
+    } else if (IS_COROUTINE(evaValue)) {
+        return "COROUTINE";
+    } else if (IS_CHANNEL(evaValue)) {
+        return "CHANNEL";
+    } else if (IS_ARRAY(evaValue)) {
+        return "ARRAY";
+    } else if (IS_FLOAT64_ARRAY(evaValue)) {
+        return "FLOAT64_ARRAY";
+    } else if (IS_MAP(evaValue)) {
+        return "MAP";
     } else {
         DIE << "evaValueToTypeString: unknown type " << (int) evaValue.type;
     }
     return ""; // Unreachable
 }
 
+void Traceable::printStats(Heap &heap) {
+    std::cout << "------------------------------\n";
+    std::cout << "Memory stats:\n\n";
+
+    auto objectsCount = heap.objectsCount();
+    auto objectsBytes = heap.objectsBytes();
+
+    std::cout << "Objects allocated : " << std::dec << objectsCount << "\n";
+    std::cout << "Bytes allocated   : " << std::dec << heap.bytesAllocated << "\n";
+    std::cout << "Object header     : " << sizeof(Traceable) << " bytes\n";
+    if (objectsCount != 0) {
+        std::cout << "Bytes per object  : " << objectsBytes / objectsCount << "\n";
+    }
+
+    // Count and memory per object type.
+    std::map<std::string, std::pair<size_t, size_t>> types;
+    heap.forEachObject([&types](void *object) {
+        auto &type = types[evaValueToTypeString(OBJECT((Object *) object))];
+        type.first++;
+        type.second += ((Traceable *) object)->size();
+    });
+    for (auto &type: types) {
+        std::cout << "  " << type.first << ": " << type.second.first << " object(s), "
+                  << type.second.second << " bytes\n";
+    }
+    std::cout << "\n";
+
+    heap.printStats();
+}
+
+/**
+ * Max number of array elements (map entries) shown by evaValueToConstantString.
+ * */
+#define CONSTANT_STRING_ITEMS 16
+
+std::string evaValueToConstantString(const EvaValue &evaValue);
+
+/**
+ * String representation of an element: nested arrays
+ * and maps are not expanded (they may contain themselves).
+ * */
+std::string evaValueToItemString(const EvaValue &evaValue) {
+    if (IS_ARRAY(evaValue)) {
+        return "[...]";
+    } else if (IS_MAP(evaValue)) {
+        return "{...}";
+    }
+    return evaValueToConstantString(evaValue);
+}
+
 /**
  * String representation of constant value used for debug.
  * */
@@ -415,6 +1221,36 @@ std::string evaValueToConstantString(const EvaValue &evaValue) {
     } else if (IS_INSTANCE(evaValue)) {
         auto instanceObj = AS_INSTANCE(evaValue);
         ss << "instance: " << instanceObj->cls->name;
+    } else if (IS_COROUTINE(evaValue)) {
+        auto coroutine = AS_COROUTINE(evaValue);
+        ss << "coroutine: " << coroutine->function->co->name << (coroutine->done ? " (done)" : "");
+    } else if (IS_CHANNEL(evaValue)) {
+        ss << "channel " << AS_CHANNEL(evaValue)->channel.get();
+    } else if (IS_ARRAY(evaValue)) {
+        auto &items = AS_ARRAY(evaValue)->items;
+        ss << "[";
+        for (size_t i = 0; i < items.size() && i < CONSTANT_STRING_ITEMS; i++) {
+            ss << (i == 0 ? "" : ", ") << evaValueToItemString(items[i]);
+        }
+        ss << (items.size() > CONSTANT_STRING_ITEMS ? ", ...]" : "]");
+    } else if (IS_MAP(evaValue)) {
+        auto map = AS_MAP(evaValue);
+        size_t shown = 0;
+        ss << "{";
+        map->forEach([&](const EvaValue &key, const EvaValue &value) {
+            if (shown++ < CONSTANT_STRING_ITEMS) {
+                ss << (shown == 1 ? "" : ", ") << evaValueToConstantString(key) << ": "
+                   << evaValueToItemString(value);
+            }
+        });
+        ss << (map->count > CONSTANT_STRING_ITEMS ? ", ...}" : "}");
+    } else if (IS_FLOAT64_ARRAY(evaValue)) {
+        auto &items = AS_FLOAT64_ARRAY(evaValue)->items;
+        ss << "float64 [";
+        for (size_t i = 0; i < items.size() && i < CONSTANT_STRING_ITEMS; i++) {
+            ss << (i == 0 ? "" : ", ") << items[i];
+        }
+        ss << (items.size() > CONSTANT_STRING_ITEMS ? ", ...]" : "]");
     } else if (IS_NATIVE(evaValue)) {
         auto fn = AS_NATIVE(evaValue);
         ss << fn->name << "/" << fn->arity;
@@ -0,0 +1,332 @@
+#ifndef EVA_VM_FLOAT64KERNELS_H
+#define EVA_VM_FLOAT64KERNELS_H
+
+#include <cstddef>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define FLOAT64_KERNELS_X86
+#endif
+
+/**
+ * Numeric kernels over the unboxed Float64Array storage.
+ *
+ * Vectorized with AVX2 (4 doubles) when the CPU supports it (checked at
+ * runtime, the VM itself is compiled without -mavx2), else with SSE2 (2
+ * doubles), with a scalar fallback on the other architectures.
+ *
+ * The sums (sum, dot) accumulate in FLOAT64_LANES interleaved lanes, added
+ * up in order at the end, in all the variants: the results don't depend on
+ * the instruction set (though they may differ from a sequential loop in the
+ * last bits). No FMA for the same reason.
+ * */
+namespace float64 {
+
+/**
+ * Number of partial sums.
+ * */
+#define FLOAT64_LANES 8
+
+/**
+ * Comparison of the elements with a value.
+ * */
+enum class Compare {
+    LESS,
+    GREATER
+};
+
+inline double addLanes(const double *lanes) {
+    double sum = 0;
+    for (size_t i = 0; i < FLOAT64_LANES; i++) {
+        sum += lanes[i];
+    }
+    return sum;
+}
+
+// ----------------------------------------------
+// Scalar:
+
+inline double sumScalar(const double *a, size_t n) {
+    double lanes[FLOAT64_LANES]{};
+    size_t i = 0;
+    for (; i + FLOAT64_LANES <= n; i += FLOAT64_LANES) {
+        for (size_t lane = 0; lane < FLOAT64_LANES; lane++) {
+            lanes[lane] += a[i + lane];
+        }
+    }
+    auto sum = addLanes(lanes);
+    for (; i < n; i++) {
+        sum += a[i];
+    }
+    return sum;
+}
+
+inline double dotScalar(const double *a, const double *b, size_t n) {
+    double lanes[FLOAT64_LANES]{};
+    size_t i = 0;
+    for (; i + FLOAT64_LANES <= n; i += FLOAT64_LANES) {
+        for (size_t lane = 0; lane < FLOAT64_LANES; lane++) {
+            lanes[lane] += a[i + lane] * b[i + lane];
+        }
+    }
+    auto sum = addLanes(lanes);
+    for (; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+inline void scaleScalar(double *a, size_t n, double factor) {
+    for (size_t i = 0; i < n; i++) {
+        a[i] *= factor;
+    }
+}
+
+/**
+ * Min (or max) of a non-empty array: m = x < m ? x : m, as minpd does.
+ * */
+inline double minMaxScalar(const double *a, size_t n, bool max) {
+    auto m = a[0];
+    for (size_t i = 1; i < n; i++) {
+        m = max ? (a[i] > m ? a[i] : m) : (a[i] < m ? a[i] : m);
+    }
+    return m;
+}
+
+inline void compareScalar(const double *a, size_t n, double value, Compare compare, double *out) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = (compare == Compare::LESS ? a[i] < value : a[i] > value) ? 1.0 : 0.0;
+    }
+}
+
+#ifdef FLOAT64_KERNELS_X86
+
+// ----------------------------------------------
+// SSE2 (baseline on x86-64):
+
+inline double sumSSE2(const double *a, size_t n) {
+    __m128d acc[FLOAT64_LANES / 2];
+    for (auto &lane: acc) {
+        lane = _mm_setzero_pd();
+    }
+    size_t i = 0;
+    for (; i + FLOAT64_LANES <= n; i += FLOAT64_LANES) {
+        for (size_t k = 0; k < FLOAT64_LANES / 2; k++) {
+            acc[k] = _mm_add_pd(acc[k], _mm_loadu_pd(a + i + 2 * k));
+        }
+    }
+    double lanes[FLOAT64_LANES];
+    for (size_t k = 0; k < FLOAT64_LANES / 2; k++) {
+        _mm_storeu_pd(lanes + 2 * k, acc[k]);
+    }
+    auto sum = addLanes(lanes);
+    for (; i < n; i++) {
+        sum += a[i];
+    }
+    return sum;
+}
+
+inline double dotSSE2(const double *a, const double *b, size_t n) {
+    __m128d acc[FLOAT64_LANES / 2];
+    for (auto &lane: acc) {
+        lane = _mm_setzero_pd();
+    }
+    size_t i = 0;
+    for (; i + FLOAT64_LANES <= n; i += FLOAT64_LANES) {
+        for (size_t k = 0; k < FLOAT64_LANES / 2; k++) {
+            auto product = _mm_mul_pd(_mm_loadu_pd(a + i + 2 * k), _mm_loadu_pd(b + i + 2 * k));
+            acc[k] = _mm_add_pd(acc[k], product);
+        }
+    }
+    double lanes[FLOAT64_LANES];
+    for (size_t k = 0; k < FLOAT64_LANES / 2; k++) {
+        _mm_storeu_pd(lanes + 2 * k, acc[k]);
+    }
+    auto sum = addLanes(lanes);
+    for (; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+inline void scaleSSE2(double *a, size_t n, double factor) {
+    auto k = _mm_set1_pd(factor);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(a + i, _mm_mul_pd(_mm_loadu_pd(a + i), k));
+    }
+    scaleScalar(a + i, n - i, factor);
+}
+
+inline double minMaxSSE2(const double *a, size_t n, bool max) {
+    if (n < 4) {
+        return minMaxScalar(a, n, max);
+    }
+    // minpd/maxpd(x, m) = x < m (x > m) ? x : m, same as the scalar loop.
+    auto m = _mm_loadu_pd(a);
+    size_t i = 2;
+    for (; i + 2 <= n; i += 2) {
+        auto x = _mm_loadu_pd(a + i);
+        m = max ? _mm_max_pd(x, m) : _mm_min_pd(x, m);
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, m);
+    double tail[3] = {lanes[0], lanes[1], i < n ? a[i] : lanes[0]};
+    return minMaxScalar(tail, 3, max);
+}
+
+inline void compareSSE2(const double *a, size_t n, double value, Compare compare, double *out) {
+    auto v = _mm_set1_pd(value);
+    auto one = _mm_set1_pd(1.0);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        auto x = _mm_loadu_pd(a + i);
+        auto mask = compare == Compare::LESS ? _mm_cmplt_pd(x, v) : _mm_cmpgt_pd(x, v);
+        _mm_storeu_pd(out + i, _mm_and_pd(mask, one));
+    }
+    compareScalar(a + i, n - i, value, compare, out + i);
+}
+
+// ----------------------------------------------
+// AVX2:
+
+__attribute__((target("avx2"))) inline double sumAVX2(const double *a, size_t n) {
+    auto acc0 = _mm256_setzero_pd();
+    auto acc1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + FLOAT64_LANES <= n; i += FLOAT64_LANES) {
+        acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(a + i));
+        acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(a + i + 4));
+    }
+    double lanes[FLOAT64_LANES];
+    _mm256_storeu_pd(lanes, acc0);
+    _mm256_storeu_pd(lanes + 4, acc1);
+    auto sum = addLanes(lanes);
+    for (; i < n; i++) {
+        sum += a[i];
+    }
+    return sum;
+}
+
+__attribute__((target("avx2"))) inline double dotAVX2(const double *a, const double *b, size_t n) {
+    auto acc0 = _mm256_setzero_pd();
+    auto acc1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + FLOAT64_LANES <= n; i += FLOAT64_LANES) {
+        acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+    }
+    double lanes[FLOAT64_LANES];
+    _mm256_storeu_pd(lanes, acc0);
+    _mm256_storeu_pd(lanes + 4, acc1);
+    auto sum = addLanes(lanes);
+    for (; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+__attribute__((target("avx2"))) inline void scaleAVX2(double *a, size_t n, double factor) {
+    auto k = _mm256_set1_pd(factor);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(a + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), k));
+    }
+    scaleScalar(a + i, n - i, factor);
+}
+
+__attribute__((target("avx2"))) inline double minMaxAVX2(const double *a, size_t n, bool max) {
+    if (n < 8) {
+        return minMaxSSE2(a, n, max);
+    }
+    auto m = _mm256_loadu_pd(a);
+    size_t i = 4;
+    for (; i + 4 <= n; i += 4) {
+        auto x = _mm256_loadu_pd(a + i);
+        m = max ? _mm256_max_pd(x, m) : _mm256_min_pd(x, m);
+    }
+    double lanes[7];
+    _mm256_storeu_pd(lanes, m);
+    size_t count = 4;
+    for (; i < n; i++) {
+        lanes[count++] = a[i];
+    }
+    return minMaxScalar(lanes, count, max);
+}
+
+__attribute__((target("avx2"))) inline void compareAVX2(const double *a, size_t n, double value,
+                                                         Compare compare, double *out) {
+    auto v = _mm256_set1_pd(value);
+    auto one = _mm256_set1_pd(1.0);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        auto x = _mm256_loadu_pd(a + i);
+        auto mask = compare == Compare::LESS ? _mm256_cmp_pd(x, v, _CMP_LT_OQ) : _mm256_cmp_pd(x, v, _CMP_GT_OQ);
+        _mm256_storeu_pd(out + i, _mm256_and_pd(mask, one));
+    }
+    compareScalar(a + i, n - i, value, compare, out + i);
+}
+
+/**
+ * Whether the CPU has AVX2 (checked once).
+ * */
+inline bool hasAVX2() {
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2;
+}
+
+#define FLOAT64_DISPATCH(kernel, ...) \
+    (hasAVX2() ? kernel##AVX2(__VA_ARGS__) : kernel##SSE2(__VA_ARGS__))
+
+#else
+
+#define FLOAT64_DISPATCH(kernel, ...) kernel##Scalar(__VA_ARGS__)
+
+#endif
+
+// ----------------------------------------------
+// Kernels:
+
+/**
+ * Sum of the elements.
+ * */
+inline double sum(const double *a, size_t n) {
+    return FLOAT64_DISPATCH(sum, a, n);
+}
+
+/**
+ * Dot product of two arrays of n elements.
+ * */
+inline double dot(const double *a, const double *b, size_t n) {
+    return FLOAT64_DISPATCH(dot, a, b, n);
+}
+
+/**
+ * Multiplies the elements by the factor (in place).
+ * */
+inline void scale(double *a, size_t n, double factor) {
+    FLOAT64_DISPATCH(scale, a, n, factor);
+}
+
+/**
+ * Min and max of the elements (n > 0).
+ * */
+inline double min(const double *a, size_t n) {
+    return FLOAT64_DISPATCH(minMax, a, n, false);
+}
+
+inline double max(const double *a, size_t n) {
+    return FLOAT64_DISPATCH(minMax, a, n, true);
+}
+
+/**
+ * Mask of the elements compared with the value: 1 where
+ * the comparison holds, 0 elsewhere (out has n elements).
+ * */
+inline void compare(const double *a, size_t n, double value, Compare compare, double *out) {
+    FLOAT64_DISPATCH(compare, a, n, value, compare, out);
+}
+
+} // namespace float64
+
+#endif
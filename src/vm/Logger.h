@@ -1,17 +1,104 @@
 #ifndef EVA_VM_LOGGER_H
 #define EVA_VM_LOGGER_H
 
+#include <exception>
+#include <functional>
 #include <iostream>
 #include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
 
-class ErrorLogMessage : public std::basic_ostringstream<char> {
+/**
+ * Fatal error, thrown by DIE instead of exiting on
+ * the threads which recover from errors (see recover).
+ * */
+class EvaError : public std::runtime_error {
 public:
-    ~ErrorLogMessage() {
-        fprintf(stderr, "Fatal error: %s\n", str().c_str());
+    using std::runtime_error::runtime_error;
+};
+
+class ErrorLogMessage {
+public:
+    ~ErrorLogMessage() noexcept(false) {
+        auto message = stream.str();
+
+        // Reset first: an error in the context itself mustn't recurse.
+        auto where = std::move(context);
+        context = nullptr;
+        std::string location;
+        if (where) {
+            location = where();
+        }
+
+        // Not while unwinding from another error.
+        if (recoverable && std::uncaught_exceptions() == 0) {
+            while (!message.empty() && message.back() == '\n') {
+                message.pop_back();
+            }
+            throw EvaError(location.empty() ? message : message + "\n" + location);
+        }
+
+        fprintf(stderr, "Fatal error: %s\n", message.c_str());
+        if (!location.empty()) {
+            fprintf(stderr, "%s\n", location.c_str());
+        }
+
         exit(EXIT_FAILURE);
     }
+
+    template<typename T>
+    ErrorLogMessage &operator<<(const T &value) {
+        stream << value;
+        return *this;
+    }
+
+    /**
+     * Where the error happened (e.g. the Eva source lines
+     * of the running code), set by the VM of the thread.
+     * */
+    static thread_local std::function<std::string()> context;
+
+    /**
+     * Whether an error throws an EvaError on this thread, rather than exiting.
+     * */
+    static thread_local bool recoverable;
+
+private:
+    // Not a base class: its destructor can't throw.
+    std::ostringstream stream;
 };
 
+thread_local std::function<std::string()> ErrorLogMessage::context{};
+
+thread_local bool ErrorLogMessage::recoverable = false;
+
+/**
+ * Calls the action, an error (DIE, or a syntax error) stops it
+ * instead of exiting. Returns the error message, empty if none.
+ *
+ * Errors on other threads are raised again by the VM which started
+ * the work there (see EvaVM::checkActors and ParallelPool::run).
+ * */
+inline std::string recover(const std::function<void()> &action) {
+    auto wasRecoverable = std::exchange(ErrorLogMessage::recoverable, true);
+    std::string error;
+    try {
+        action();
+    } catch (const std::runtime_error *e) {
+        // The parser throws syntax errors by pointer.
+        error = e->what();
+        delete e;
+    } catch (const std::exception &e) {
+        error = e.what();
+    }
+    ErrorLogMessage::recoverable = wasRecoverable;
+    while (!error.empty() && error.back() == '\n') {
+        error.pop_back();
+    }
+    return error;
+}
+
 #define DIE ErrorLogMessage()
 
 #define log(value) std::cout << #value << " = " << (value) << "\n";
@@ -0,0 +1,240 @@
+#ifndef EVA_VM_OPCODESTATS_H
+#define EVA_VM_OPCODESTATS_H
+
+/**
+ * Per-opcode execution stats, for an instrumented build of the
+ * interpreter loop (compile with -DEVA_OPCODE_STATS). Without the
+ * flag, OPCODE_STATS(opcode) expands to nothing.
+ * */
+#ifdef EVA_OPCODE_STATS
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "../bytecode/OpCode.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+/**
+ * Every n-th instruction is timed (power of 2).
+ * */
+#define OPCODE_STATS_TIMING_EVERY 64
+
+/**
+ * Pairs and triples shown in the report.
+ * */
+#define OPCODE_STATS_TOP 20
+
+/**
+ * Execution counts per opcode, dynamic (as executed) opcode pairs
+ * and triples, and sampled cycles per opcode: every n-th instruction
+ * is timed with rdtsc from its dispatch to the next one.
+ *
+ * Each thread (VM, actor or parallel worker) counts in its own
+ * Counters, merged by print (called once the threads are done).
+ * */
+struct OpcodeStats {
+    /**
+     * Called on every instruction dispatch.
+     * */
+    static void record(uint8_t opcode) {
+        auto &stats = local();
+        if (stats.timedOpcode != NOT_TIMING) {
+            stats.cycles[stats.timedOpcode] += now() - stats.timingStart;
+            stats.timedCount[stats.timedOpcode]++;
+            stats.timedOpcode = NOT_TIMING;
+        }
+
+        stats.counts[opcode]++;
+        stats.pairs[stats.previous][opcode]++;
+        stats.triples[stats.beforePrevious][stats.previous][opcode]++;
+        stats.beforePrevious = stats.previous;
+        stats.previous = opcode;
+
+        if ((++stats.dispatched & (OPCODE_STATS_TIMING_EVERY - 1)) == 0) {
+            stats.timedOpcode = opcode;
+            stats.timingStart = now();
+        }
+    }
+
+    /**
+     * Prints the opcodes by execution count, and the most frequent pairs
+     * and triples, summed over all the threads.
+     * */
+    static void print() {
+        auto total = merge();
+        auto &counts = total->counts;
+        auto &cycles = total->cycles;
+        auto &timedCount = total->timedCount;
+        auto &pairs = total->pairs;
+        auto &triples = total->triples;
+        auto dispatched = total->dispatched;
+
+        std::cout << std::dec << "---------------- Opcode stats ----------------\n";
+        std::cout << std::left << std::setw(16) << "Opcode" << std::right << std::setw(14) << "Count"
+                  << std::setw(9) << "%" << std::setw(14) << "Cycles (avg)" << "\n";
+
+        std::vector<uint8_t> opcodes;
+        for (size_t opcode = 0; opcode < OPCODES_COUNT; opcode++) {
+            if (counts[opcode] != 0) {
+                opcodes.push_back(opcode);
+            }
+        }
+        std::sort(opcodes.begin(), opcodes.end(), [&counts](uint8_t a, uint8_t b) { return counts[a] > counts[b]; });
+
+        for (auto opcode: opcodes) {
+            std::cout << std::left << std::setw(16) << opcodeToString(opcode) << std::right
+                      << std::setw(14) << counts[opcode]
+                      << std::setw(9) << std::fixed << std::setprecision(2) << 100.0 * counts[opcode] / dispatched
+                      << std::setw(14) << std::setprecision(1)
+                      << (timedCount[opcode] == 0 ? 0.0 : (double) cycles[opcode] / timedCount[opcode]) << "\n";
+        }
+        std::cout << "Total: " << dispatched << " instructions\n\n";
+
+        // Pairs and triples. HALT is only executed last, so the sequences
+        // starting with it are the program start (no predecessor), skipped.
+        std::vector<std::pair<uint64_t, std::vector<uint8_t>>> sequences;
+        for (size_t a = OP_HALT + 1; a < OPCODES_COUNT; a++) {
+            for (size_t b = 0; b < OPCODES_COUNT; b++) {
+                if (pairs[a][b] != 0) {
+                    sequences.push_back({pairs[a][b], {(uint8_t) a, (uint8_t) b}});
+                }
+            }
+        }
+        printTop("Opcode pairs", sequences);
+
+        sequences.clear();
+        for (size_t a = OP_HALT + 1; a < OPCODES_COUNT; a++) {
+            for (size_t b = OP_HALT + 1; b < OPCODES_COUNT; b++) {
+                for (size_t c = 0; c < OPCODES_COUNT; c++) {
+                    if (triples[a][b][c] != 0) {
+                        sequences.push_back({triples[a][b][c], {(uint8_t) a, (uint8_t) b, (uint8_t) c}});
+                    }
+                }
+            }
+        }
+        printTop("Opcode triples", sequences);
+
+        std::cout << std::defaultfloat;
+    }
+
+private:
+    static constexpr uint8_t NOT_TIMING = 0xFF;
+
+    /**
+     * Stats of one thread.
+     * */
+    struct Counters {
+        std::array<uint64_t, OPCODES_COUNT> counts{};
+
+        std::array<uint64_t, OPCODES_COUNT> cycles{};
+
+        std::array<uint64_t, OPCODES_COUNT> timedCount{};
+
+        uint64_t pairs[OPCODES_COUNT][OPCODES_COUNT]{};
+
+        uint64_t triples[OPCODES_COUNT][OPCODES_COUNT][OPCODES_COUNT]{};
+
+        uint64_t dispatched{0};
+
+        /* Previous two opcodes (HALT before the first instruction). */
+        uint8_t previous{OP_HALT};
+
+        uint8_t beforePrevious{OP_HALT};
+
+        uint8_t timedOpcode{NOT_TIMING};
+
+        uint64_t timingStart{0};
+    };
+
+    /**
+     * Counters of the current thread, registered on its first
+     * instruction (kept after the thread exits, for print).
+     * */
+    static Counters &local() {
+        if (current == nullptr) {
+            std::lock_guard<std::mutex> lock(threadsMutex);
+            threads.push_back(std::make_unique<Counters>());
+            current = threads.back().get();
+        }
+        return *current;
+    }
+
+    /**
+     * Sum of the counters of all the threads.
+     * */
+    static std::unique_ptr<Counters> merge() {
+        auto total = std::make_unique<Counters>();
+        std::lock_guard<std::mutex> lock(threadsMutex);
+        for (auto &stats: threads) {
+            for (size_t a = 0; a < OPCODES_COUNT; a++) {
+                total->counts[a] += stats->counts[a];
+                total->cycles[a] += stats->cycles[a];
+                total->timedCount[a] += stats->timedCount[a];
+                for (size_t b = 0; b < OPCODES_COUNT; b++) {
+                    total->pairs[a][b] += stats->pairs[a][b];
+                    for (size_t c = 0; c < OPCODES_COUNT; c++) {
+                        total->triples[a][b][c] += stats->triples[a][b][c];
+                    }
+                }
+            }
+            total->dispatched += stats->dispatched;
+        }
+        return total;
+    }
+
+    static void printTop(const char *title, std::vector<std::pair<uint64_t, std::vector<uint8_t>>> &sequences) {
+        std::sort(sequences.begin(), sequences.end(), [](const auto &a, const auto &b) { return a.first > b.first; });
+
+        std::cout << title << ":\n";
+        for (size_t i = 0; i < sequences.size() && i < OPCODE_STATS_TOP; i++) {
+            std::string names;
+            for (auto opcode: sequences[i].second) {
+                names += (names.empty() ? "" : " ") + opcodeToString(opcode);
+            }
+            std::cout << "  " << std::left << std::setw(48) << names << std::right << std::setw(14)
+                      << sequences[i].first << "\n";
+        }
+        std::cout << "\n";
+    }
+
+    static uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    static std::mutex threadsMutex;
+
+    static std::vector<std::unique_ptr<Counters>> threads;
+
+    static thread_local Counters *current;
+};
+
+std::mutex OpcodeStats::threadsMutex;
+
+std::vector<std::unique_ptr<OpcodeStats::Counters>> OpcodeStats::threads;
+
+thread_local OpcodeStats::Counters *OpcodeStats::current{nullptr};
+
+#define OPCODE_STATS(opcode) OpcodeStats::record(opcode)
+
+#else
+
+#define OPCODE_STATS(opcode)
+
+#endif
+
+#endif
@@ -92,9 +92,10 @@ struct Scope {
      * free, and hence should be promoted to a cell, unless global.
      * */
     std::pair<Scope *, AllocType> resolve(const std::string &name, AllocType allocType) {
-        // Found in the current scope
+        // Found in the current scope (a global may be found in
+        // any scope, where it was resolved before)
         if (allocInfo.count(name) != 0) {
-            return std::make_pair(this, allocType);
+            return std::make_pair(this, allocInfo[name] == AllocType::GLOBAL ? AllocType::GLOBAL : allocType);
         }
 
         // We crossed the boundary of the function and still didn't
@@ -0,0 +1,288 @@
+/**
+ * Heap snapshot analyzer: object count, shallow and retained size per
+ * class, for one snapshot, or the difference between two of them
+ * (written by --heap-snapshot or the heap-snapshot native).
+ *
+ * Objects are grouped by class name for instances, and by type for the
+ * rest, e.g. (STRING). Retained size of an object is the memory freed if
+ * it became unreachable: its subtree in the dominator tree. Retained size
+ * of a class only counts the objects not retained by another object of
+ * the same class (so linked structures aren't counted several times).
+ *
+ * Usage: heap-snapshot-diff <snapshot> [<newer snapshot>]
+ * */
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/**
+ * Parsed snapshot. Node 0 is the synthetic root
+ * referencing all the roots of the snapshot.
+ * */
+struct Snapshot {
+    struct Node {
+        std::string group;
+
+        size_t size = 0;
+
+        std::vector<size_t> edges;
+    };
+
+    std::vector<Node> nodes{1};
+};
+
+/**
+ * Totals of one class in a snapshot.
+ * */
+struct ClassStats {
+    size_t count = 0;
+
+    size_t shallowSize = 0;
+
+    size_t retainedSize = 0;
+};
+
+using ClassTable = std::map<std::string, ClassStats>;
+
+Snapshot read(const std::string &fileName) {
+    std::ifstream file(fileName);
+    if (!file) {
+        std::cerr << "Can't read " << fileName << "\n";
+        exit(1);
+    }
+
+    std::string line;
+    if (!std::getline(file, line) || line != "eva-heap-snapshot 1") {
+        std::cerr << fileName << " is not an Eva heap snapshot\n";
+        exit(1);
+    }
+
+    Snapshot snapshot;
+    auto node = [&snapshot](size_t id) -> Snapshot::Node & {
+        if (id >= snapshot.nodes.size()) {
+            snapshot.nodes.resize(id + 1);
+        }
+        return snapshot.nodes[id];
+    };
+
+    while (std::getline(file, line)) {
+        std::istringstream record(line);
+        std::string kind;
+        record >> kind;
+
+        if (kind == "r") {
+            size_t to;
+            record >> to;
+            node(0).edges.push_back(to);
+        } else if (kind == "n") {
+            size_t id;
+            std::string type, name;
+            size_t size;
+            record >> id >> type >> size;
+            record.get();
+            std::getline(record, name);
+
+            auto &object = node(id);
+            object.size = size;
+            object.group = type == "INSTANCE" ? name : "(" + type + ")";
+        } else if (kind == "e") {
+            size_t from, to;
+            record >> from >> to;
+            node(std::max(from, to));
+            snapshot.nodes[from].edges.push_back(to);
+        }
+    }
+
+    return snapshot;
+}
+
+/**
+ * Immediate dominators (Cooper, Harvey, Kennedy: "A Simple, Fast
+ * Dominance Algorithm"), returns the nodes in reverse postorder.
+ * */
+std::vector<size_t> dominators(const Snapshot &snapshot, std::vector<size_t> &idom) {
+    auto count = snapshot.nodes.size();
+    const auto none = count;
+
+    // Postorder numbering (iterative DFS from the root).
+    std::vector<size_t> postorder;
+    std::vector<size_t> number(count, none);
+    std::vector<bool> visited(count, false);
+    std::vector<std::pair<size_t, size_t>> stack{{0, 0}};
+    visited[0] = true;
+    while (!stack.empty()) {
+        auto &top = stack.back();
+        auto &edges = snapshot.nodes[top.first].edges;
+        if (top.second < edges.size()) {
+            auto next = edges[top.second++];
+            if (!visited[next]) {
+                visited[next] = true;
+                stack.push_back({next, 0});
+            }
+            continue;
+        }
+        number[top.first] = postorder.size();
+        postorder.push_back(top.first);
+        stack.pop_back();
+    }
+
+    std::vector<std::vector<size_t>> predecessors(count);
+    for (size_t from = 0; from < count; from++) {
+        for (auto to: snapshot.nodes[from].edges) {
+            predecessors[to].push_back(from);
+        }
+    }
+
+    std::vector<size_t> order(postorder.rbegin(), postorder.rend());
+
+    idom.assign(count, none);
+    idom[0] = 0;
+
+    auto intersect = [&](size_t a, size_t b) {
+        while (a != b) {
+            while (number[a] < number[b]) a = idom[a];
+            while (number[b] < number[a]) b = idom[b];
+        }
+        return a;
+    };
+
+    for (auto changed = true; changed;) {
+        changed = false;
+        for (size_t i = 1; i < order.size(); i++) {
+            auto node = order[i];
+            auto newIdom = none;
+            for (auto pred: predecessors[node]) {
+                if (idom[pred] == none) {
+                    continue;
+                }
+                newIdom = newIdom == none ? pred : intersect(pred, newIdom);
+            }
+            if (idom[node] != newIdom) {
+                idom[node] = newIdom;
+                changed = true;
+            }
+        }
+    }
+
+    return order;
+}
+
+/**
+ * Per-class count, shallow and retained sizes.
+ * */
+ClassTable analyze(const Snapshot &snapshot) {
+    std::vector<size_t> idom;
+    auto order = dominators(snapshot, idom);
+    auto &nodes = snapshot.nodes;
+
+    // Retained sizes: children of the dominator tree come after
+    // their dominator in the reverse postorder.
+    std::vector<size_t> retained(nodes.size(), 0);
+    std::vector<std::vector<size_t>> dominated(nodes.size());
+    for (auto it = order.rbegin(); it != order.rend(); it++) {
+        auto node = *it;
+        retained[node] += nodes[node].size;
+        if (node != 0) {
+            retained[idom[node]] += retained[node];
+            dominated[idom[node]].push_back(node);
+        }
+    }
+
+    // Walk the dominator tree, counting per class only the outermost objects.
+    ClassTable table;
+    std::map<std::string, size_t> open;
+    std::vector<std::pair<size_t, size_t>> stack{{0, 0}};
+    while (!stack.empty()) {
+        auto &top = stack.back();
+        auto node = top.first;
+        auto &group = nodes[node].group;
+
+        if (top.second == 0 && node != 0) {
+            auto &stats = table[group];
+            stats.count++;
+            stats.shallowSize += nodes[node].size;
+            if (open[group]++ == 0) {
+                stats.retainedSize += retained[node];
+            }
+        }
+
+        if (top.second < dominated[node].size()) {
+            stack.push_back({dominated[node][top.second++], 0});
+            continue;
+        }
+
+        if (node != 0) {
+            open[group]--;
+        }
+        stack.pop_back();
+    }
+
+    return table;
+}
+
+void printRow(const std::string &name, const std::vector<long long> &columns) {
+    std::cout << std::left << std::setw(32) << name.substr(0, 31) << std::right;
+    for (auto value: columns) {
+        std::cout << std::setw(14) << value;
+    }
+    std::cout << "\n";
+}
+
+int main(int argc, const char *argv[]) {
+    if (argc < 2 || argc > 3) {
+        std::cout << "Usage: heap-snapshot-diff <snapshot> [<newer snapshot>]\n";
+        return 1;
+    }
+
+    auto before = analyze(read(argv[1]));
+
+    if (argc == 2) {
+        std::vector<std::pair<std::string, ClassStats>> rows(before.begin(), before.end());
+        std::sort(rows.begin(), rows.end(), [](const auto &a, const auto &b) {
+            return a.second.retainedSize > b.second.retainedSize;
+        });
+
+        std::cout << std::left << std::setw(32) << "Class" << std::right << std::setw(14) << "Count"
+                  << std::setw(14) << "Shallow" << std::setw(14) << "Retained" << "\n";
+        for (auto &row: rows) {
+            printRow(row.first, {(long long) row.second.count, (long long) row.second.shallowSize,
+                                 (long long) row.second.retainedSize});
+        }
+        return 0;
+    }
+
+    auto after = analyze(read(argv[2]));
+
+    // Classes of both snapshots, the largest retained growth first.
+    std::map<std::string, std::pair<ClassStats, ClassStats>> classes;
+    for (auto &entry: before) classes[entry.first].first = entry.second;
+    for (auto &entry: after) classes[entry.first].second = entry.second;
+
+    std::vector<std::pair<std::string, std::pair<ClassStats, ClassStats>>> rows(classes.begin(), classes.end());
+    auto growth = [](const std::pair<ClassStats, ClassStats> &stats) {
+        return (long long) stats.second.retainedSize - (long long) stats.first.retainedSize;
+    };
+    std::sort(rows.begin(), rows.end(), [&growth](const auto &a, const auto &b) {
+        return growth(a.second) > growth(b.second);
+    });
+
+    std::cout << std::left << std::setw(32) << "Class" << std::right << std::setw(14) << "Count"
+              << std::setw(14) << "+/- Count" << std::setw(14) << "+/- Shallow"
+              << std::setw(14) << "Retained" << std::setw(14) << "+/- Retained" << "\n";
+    for (auto &row: rows) {
+        auto &was = row.second.first;
+        auto &now = row.second.second;
+        printRow(row.first, {(long long) now.count,
+                             (long long) now.count - (long long) was.count,
+                             (long long) now.shallowSize - (long long) was.shallowSize,
+                             (long long) now.retainedSize,
+                             growth(row.second)});
+    }
+
+    return 0;
+}